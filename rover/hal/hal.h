@@ -0,0 +1,42 @@
+#ifndef HAL_H
+#define HAL_H
+
+/*
+	Hardware abstraction for the rover firmware.
+
+	On the AVR this is (nearly) empty: the firmware keeps talking to avr-libc
+	and the registers directly. The host build (make host) puts ../hal/host
+	ahead of the system headers, so <avr/io.h>, <avr/interrupt.h>,
+	<util/delay.h> etc. resolve to the simulated MCU in hal/host/sim.c and
+	the firmware runs as an ordinary Linux program against a simulated clock.
+*/
+
+#ifdef HOST_BUILD
+
+#include "sim.h"
+
+/* sim.c owns the real main() and calls the firmware's once it is set up */
+#define main firmware_main
+int firmware_main(void);
+
+/* Busy-wait loops skip ahead to the next simulated event */
+#define HAL_SPIN() sim_spin()
+
+/* Stop the simulation and print the run report */
+#define HAL_HALT() sim_halt()
+
+#else
+
+#define HAL_SPIN()
+#define HAL_HALT() while(1) {}
+
+#endif
+
+/* Keeps the compiler from moving memory accesses across it, so plain
+   loads stay between the two reads of a seq-checked copy */
+#define HAL_BARRIER() __asm__ __volatile__("" ::: "memory")
+
+/* ISR and main loop CPU time accounting */
+#include "profile.h"
+
+#endif /* end of include guard: HAL_H */
@@ -0,0 +1,28 @@
+#ifndef _AVR_EEPROM_H_
+#define _AVR_EEPROM_H_
+
+/*
+	Host stand-in for <avr/eeprom.h>. The EEPROM is an array in sim.c; each
+	byte written costs the datasheet's 3.3 ms of simulated time, during
+	which interrupts keep running, just like avr-libc's busy-waiting calls.
+	Run the simulator with -e <file> to keep the contents after a run.
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define EEMEM
+
+uint8_t eeprom_read_byte(const uint8_t *addr);
+uint16_t eeprom_read_word(const uint16_t *addr);
+void eeprom_read_block(void *dst, const void *src, size_t n);
+void eeprom_write_byte(uint8_t *addr, uint8_t value);
+void eeprom_write_word(uint16_t *addr, uint16_t value);
+void eeprom_write_block(const void *src, void *dst, size_t n);
+void eeprom_update_byte(uint8_t *addr, uint8_t value);
+void eeprom_update_block(const void *src, void *dst, size_t n);
+int eeprom_is_ready(void);
+
+#define eeprom_busy_wait() do { } while(!eeprom_is_ready())
+
+#endif /* _AVR_EEPROM_H_ */
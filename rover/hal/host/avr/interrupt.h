@@ -0,0 +1,24 @@
+#ifndef _AVR_INTERRUPT_H_
+#define _AVR_INTERRUPT_H_
+
+/*
+	Host stand-in for <avr/interrupt.h>. A handler is an ordinary function
+	named after its vector; sim.c finds it through a weak reference and
+	calls it when the interrupt is enabled and its flag is raised.
+*/
+
+#include <avr/io.h>
+
+void sim_sei(void);
+void sim_cli(void);
+
+#define sei() sim_sei()
+#define cli() sim_cli()
+
+#define ISR(vector, ...) void vector(void); void vector(void)
+#define SIGNAL(vector) ISR(vector)
+#define EMPTY_INTERRUPT(vector) ISR(vector) {}
+#define ISR_BLOCK
+#define ISR_NOBLOCK
+
+#endif /* _AVR_INTERRUPT_H_ */
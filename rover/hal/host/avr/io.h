@@ -0,0 +1,354 @@
+#ifndef _AVR_IO_H_
+#define _AVR_IO_H_
+
+/*
+	Host stand-in for avr-libc's <avr/io.h>.
+
+	Registers live in sim_reg[], laid out like the atmega644 data space.
+	Firmware reaches them through sim_io8()/sim_io16(), which is where the
+	simulated clock advances, pending interrupts are taken and register
+	side effects (starting a TWI transfer, an ADC conversion, ...) happen.
+	sim.c itself defines SIM_INTERNAL to get at the raw storage instead.
+*/
+
+#include <stdint.h>
+
+extern uint8_t sim_reg[0x100];
+volatile uint8_t *sim_io8(uint8_t addr);
+volatile uint16_t *sim_io16(uint8_t addr);
+
+#ifdef SIM_INTERNAL
+#define _SFR_MEM8(addr) (sim_reg[addr])
+#define _SFR_MEM16(addr) (*(uint16_t *)&sim_reg[addr])
+#else
+#define _SFR_MEM8(addr) (*sim_io8(addr))
+#define _SFR_MEM16(addr) (*sim_io16(addr))
+#endif
+
+#define _SFR_BYTE(sfr) (sfr)
+#define _BV(bit) (1 << (bit))
+
+#define bit_is_set(sfr, bit) (_SFR_BYTE(sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!(_SFR_BYTE(sfr) & _BV(bit)))
+#define loop_until_bit_is_set(sfr, bit) do { } while (bit_is_clear(sfr, bit))
+#define loop_until_bit_is_clear(sfr, bit) do { } while (bit_is_set(sfr, bit))
+
+#if defined(__AVR_ATmega168__)
+#define RAMEND 0x04FF
+#define E2END 0x01FF
+#else
+#define RAMEND 0x10FF
+#define E2END 0x07FF
+#endif
+
+/* Ports */
+#define PINA _SFR_MEM8(0x20)
+#define DDRA _SFR_MEM8(0x21)
+#define PORTA _SFR_MEM8(0x22)
+#define PINB _SFR_MEM8(0x23)
+#define DDRB _SFR_MEM8(0x24)
+#define PORTB _SFR_MEM8(0x25)
+#define PINC _SFR_MEM8(0x26)
+#define DDRC _SFR_MEM8(0x27)
+#define PORTC _SFR_MEM8(0x28)
+#define PIND _SFR_MEM8(0x29)
+#define DDRD _SFR_MEM8(0x2A)
+#define PORTD _SFR_MEM8(0x2B)
+
+/* Interrupt flags */
+#define TIFR0 _SFR_MEM8(0x35)
+#define OCF0B 2
+#define OCF0A 1
+#define TOV0 0
+
+#define TIFR1 _SFR_MEM8(0x36)
+#define ICF1 5
+#define OCF1B 2
+#define OCF1A 1
+#define TOV1 0
+
+#define TIFR2 _SFR_MEM8(0x37)
+#define OCF2B 2
+#define OCF2A 1
+#define TOV2 0
+
+#define PCIFR _SFR_MEM8(0x3B)
+#define PCIF3 3
+#define PCIF2 2
+#define PCIF1 1
+#define PCIF0 0
+
+#define EIFR _SFR_MEM8(0x3C)
+#define INTF2 2
+#define INTF1 1
+#define INTF0 0
+
+#define EIMSK _SFR_MEM8(0x3D)
+#define INT2 2
+#define INT1 1
+#define INT0 0
+
+#define GPIOR0 _SFR_MEM8(0x3E)
+
+/* EEPROM */
+#define EECR _SFR_MEM8(0x3F)
+#define EERIE 3
+#define EEMPE 2
+#define EEPE 1
+#define EERE 0
+
+#define EEDR _SFR_MEM8(0x40)
+#define EEAR _SFR_MEM16(0x41)
+#define EEARL _SFR_MEM8(0x41)
+#define EEARH _SFR_MEM8(0x42)
+
+#define GTCCR _SFR_MEM8(0x43)
+#define TSM 7
+#define PSRASY 1
+#define PSRSYNC 0
+
+/* Timer 0 */
+#define TCCR0A _SFR_MEM8(0x44)
+#define COM0A1 7
+#define COM0A0 6
+#define COM0B1 5
+#define COM0B0 4
+#define WGM01 1
+#define WGM00 0
+
+#define TCCR0B _SFR_MEM8(0x45)
+#define FOC0A 7
+#define FOC0B 6
+#define WGM02 3
+#define CS02 2
+#define CS01 1
+#define CS00 0
+
+#define TCNT0 _SFR_MEM8(0x46)
+#define OCR0A _SFR_MEM8(0x47)
+#define OCR0B _SFR_MEM8(0x48)
+
+#define GPIOR1 _SFR_MEM8(0x4A)
+#define GPIOR2 _SFR_MEM8(0x4B)
+
+#define SMCR _SFR_MEM8(0x53)
+#define SM2 3
+#define SM1 2
+#define SM0 1
+#define SE 0
+
+#define MCUSR _SFR_MEM8(0x54)
+#define MCUCR _SFR_MEM8(0x55)
+
+#define SREG _SFR_MEM8(0x5F)
+#define SREG_I 7
+
+#define WDTCSR _SFR_MEM8(0x60)
+
+/* External and pin change interrupts */
+#define PCICR _SFR_MEM8(0x68)
+#define PCIE3 3
+#define PCIE2 2
+#define PCIE1 1
+#define PCIE0 0
+
+#define EICRA _SFR_MEM8(0x69)
+#define ISC21 5
+#define ISC20 4
+#define ISC11 3
+#define ISC10 2
+#define ISC01 1
+#define ISC00 0
+
+#define PCMSK0 _SFR_MEM8(0x6B)
+#define PCMSK1 _SFR_MEM8(0x6C)
+#define PCMSK2 _SFR_MEM8(0x6D)
+
+#define TIMSK0 _SFR_MEM8(0x6E)
+#define OCIE0B 2
+#define OCIE0A 1
+#define TOIE0 0
+
+#define TIMSK1 _SFR_MEM8(0x6F)
+#define ICIE1 5
+#define OCIE1B 2
+#define OCIE1A 1
+#define TOIE1 0
+
+#define TIMSK2 _SFR_MEM8(0x70)
+#define OCIE2B 2
+#define OCIE2A 1
+#define TOIE2 0
+
+#define PCMSK3 _SFR_MEM8(0x73)
+
+/* ADC */
+#define ADC _SFR_MEM16(0x78)
+#define ADCW _SFR_MEM16(0x78)
+#define ADCL _SFR_MEM8(0x78)
+#define ADCH _SFR_MEM8(0x79)
+
+#define ADCSRA _SFR_MEM8(0x7A)
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+
+#define ADCSRB _SFR_MEM8(0x7B)
+#define ACME 6
+#define ADTS2 2
+#define ADTS1 1
+#define ADTS0 0
+
+#define ADMUX _SFR_MEM8(0x7C)
+#define REFS1 7
+#define REFS0 6
+#define ADLAR 5
+#define MUX4 4
+#define MUX3 3
+#define MUX2 2
+#define MUX1 1
+#define MUX0 0
+
+#define DIDR0 _SFR_MEM8(0x7E)
+#define ADC7D 7
+#define ADC6D 6
+#define ADC5D 5
+#define ADC4D 4
+#define ADC3D 3
+#define ADC2D 2
+#define ADC1D 1
+#define ADC0D 0
+#define DIDR1 _SFR_MEM8(0x7F)
+
+/* Timer 1 */
+#define TCCR1A _SFR_MEM8(0x80)
+#define COM1A1 7
+#define COM1A0 6
+#define COM1B1 5
+#define COM1B0 4
+#define WGM11 1
+#define WGM10 0
+
+#define TCCR1B _SFR_MEM8(0x81)
+#define ICNC1 7
+#define ICES1 6
+#define WGM13 4
+#define WGM12 3
+#define CS12 2
+#define CS11 1
+#define CS10 0
+
+#define TCCR1C _SFR_MEM8(0x82)
+#define FOC1A 7
+#define FOC1B 6
+
+#define TCNT1 _SFR_MEM16(0x84)
+#define TCNT1L _SFR_MEM8(0x84)
+#define TCNT1H _SFR_MEM8(0x85)
+#define ICR1 _SFR_MEM16(0x86)
+#define ICR1L _SFR_MEM8(0x86)
+#define ICR1H _SFR_MEM8(0x87)
+#define OCR1A _SFR_MEM16(0x88)
+#define OCR1AL _SFR_MEM8(0x88)
+#define OCR1AH _SFR_MEM8(0x89)
+#define OCR1B _SFR_MEM16(0x8A)
+#define OCR1BL _SFR_MEM8(0x8A)
+#define OCR1BH _SFR_MEM8(0x8B)
+
+/* Timer 2 */
+#define TCCR2A _SFR_MEM8(0xB0)
+#define COM2A1 7
+#define COM2A0 6
+#define COM2B1 5
+#define COM2B0 4
+#define WGM21 1
+#define WGM20 0
+
+#define TCCR2B _SFR_MEM8(0xB1)
+#define FOC2A 7
+#define FOC2B 6
+#define WGM22 3
+#define CS22 2
+#define CS21 1
+#define CS20 0
+
+#define TCNT2 _SFR_MEM8(0xB2)
+#define OCR2A _SFR_MEM8(0xB3)
+#define OCR2B _SFR_MEM8(0xB4)
+
+#define ASSR _SFR_MEM8(0xB6)
+#define EXCLK 6
+#define AS2 5
+
+/* TWI */
+#define TWBR _SFR_MEM8(0xB8)
+
+#define TWSR _SFR_MEM8(0xB9)
+#define TWPS1 1
+#define TWPS0 0
+
+#define TWAR _SFR_MEM8(0xBA)
+#define TWGCE 0
+
+#define TWDR _SFR_MEM8(0xBB)
+
+#define TWCR _SFR_MEM8(0xBC)
+#define TWINT 7
+#define TWEA 6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC 3
+#define TWEN 2
+#define TWIE 0
+
+#define TWAMR _SFR_MEM8(0xBD)
+
+/* USART 0 */
+#define UCSR0A _SFR_MEM8(0xC0)
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define FE0 4
+#define DOR0 3
+#define UPE0 2
+#define U2X0 1
+#define MPCM0 0
+
+#define UCSR0B _SFR_MEM8(0xC1)
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ02 2
+#define RXB80 1
+#define TXB80 0
+
+#define UCSR0C _SFR_MEM8(0xC2)
+#define UMSEL01 7
+#define UMSEL00 6
+#define UPM01 5
+#define UPM00 4
+#define USBS0 3
+#define UCSZ01 2
+#define UCSZ00 1
+#define UCPOL0 0
+
+#define UBRR0 _SFR_MEM16(0xC4)
+#define UBRR0L _SFR_MEM8(0xC4)
+#define UBRR0H _SFR_MEM8(0xC5)
+#define UDR0 _SFR_MEM8(0xC6)
+
+/* Interrupt vectors (one set of names for both parts) */
+#define USART_RX_vect USART0_RX_vect
+#define USART_UDRE_vect USART0_UDRE_vect
+#define USART_TX_vect USART0_TX_vect
+#define SIG_USART_RECV USART0_RX_vect
+#define SIG_USART_DATA USART0_UDRE_vect
+
+#endif /* _AVR_IO_H_ */
@@ -0,0 +1,16 @@
+#ifndef _AVR_PGMSPACE_H_
+#define _AVR_PGMSPACE_H_
+
+/* Host stand-in for <avr/pgmspace.h>: flash and SRAM are the same memory here */
+
+#include <stdint.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t *)(addr))
+#define pgm_read_word(addr) (*(const uint16_t *)(addr))
+#define memcpy_P memcpy
+#define strlen_P strlen
+
+#endif /* _AVR_PGMSPACE_H_ */
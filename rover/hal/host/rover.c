@@ -0,0 +1,755 @@
+/*
+	rover.c - the plant behind the simulated MCU.
+
+	Two DC-motor wheels with first-order speed response, a small gain
+	mismatch between them, quadrature encoders with A on INT0 (PD2, left)
+	and INT1 (PD3, right) and B on PD6 and PD7, A repeated on the counter
+	inputs T0 (PB0, left) and T1 (PB1, right), dead reckoning of the rover's pose, and analogue sensors for the
+	ADC. Built with SIM_ROLE_MASTER it plays the motor board at TWI_SLAVE on
+	the bus; with SIM_ROLE_SLAVE it reads the H-bridge PWM registers
+	directly and a remote master replays a short drive over TWI.
+
+	As the motor board it also benchmarks the master's wheel
+	synchronisation: each straight or turn, from the command that starts
+	it to the next BRAKE, it tracks the difference in distance covered by
+	the two wheels and reports the worst and RMS error, the heading drift
+	and the settling time (until the error stays within SETTLE_TICKS).
+
+	Its ramps and speed loop stand in for slave.c's. The slave role runs
+	them beside the firmware's own, from the frames the remote master
+	sends, and fails the run if the PWM they give strays from the
+	firmware's.
+*/
+
+#define SIM_INTERNAL
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <avr/io.h>
+#include <util/crc16.h>
+#include "sim.h"
+
+#define STEP_US 100
+#define TICKS_PER_METRE 300.0
+#define TRACK_WIDTH 0.14 /* metres between the wheels */
+#define MAX_SPEED 1.4 /* metres per second at full duty */
+#define STALL_DUTY 40 /* duty below which the motors don't turn */
+#define TAU_DRIVE 0.20 /* speed time constants in seconds */
+#define TAU_COAST 0.60
+#define TAU_BRAKE 0.05
+#define SETTLE_TICKS 2.0
+
+/* Mirrors the command set in master.h / slave.h */
+#define TWI_SLAVE 0x5A
+#define FORWARD_LEFT 1
+#define FORWARD_RIGHT 2
+#define BRAKE 3
+#define REVERSE_LEFT 4
+#define REVERSE_RIGHT 5
+#define FORWARD 6
+#define TURN_RIGHT 7
+#define TURN_LEFT 8
+#define REVERSE 9
+#define SETPOINT 10 /* reverse bits, left speed, right speed */
+#define REGISTER 11 /* register map offset for the next reads */
+#define RAMP 12 /* reverse bits, left and right targets, left and right accelerations */
+#define RAMP_HZ 1250 /* acceleration / 64 PWM counts per tick */
+#define VELOCITY 13 /* left and right ticks per second, int16 */
+#define SPEED_MAX 420 /* slave.c's speed loop: feedforward, */
+#define SPEED_KP (128 / 256.0) /* gains, */
+#define SPEED_KI (24 / 256.0 * 250) /* per second, */
+#define SPEED_LIMIT 80 /* and what the PID adds */
+
+/* Mirrors the frame format: length, sequence, commands, CRC-8 */
+#define FRAME_OVERHEAD 3
+#define COMMAND_LENGTH(code) (((code) == SETPOINT) ? 4 : ((code) == RAMP) ? 6 : ((code) == VELOCITY) ? 5 : 2)
+
+static uint8_t frame_crc(const uint8_t *data, uint8_t length)
+{
+	uint8_t crc = 0;
+
+	while(length--)
+		crc = _crc8_ccitt_update(crc, *data++);
+	return crc;
+}
+
+/* Mirrors struct slave_registers */
+struct registers {
+	int16_t left, right;
+	uint8_t sequence;
+	uint8_t faults;
+	int32_t encoder_left, encoder_right;
+	int16_t speed_left, speed_right;
+	uint16_t sensors[2];
+	uint16_t sensor_age;
+	uint8_t sensor_seq;
+} __attribute__((__packed__));
+
+struct wheel {
+	int16_t duty; /* -255 .. 255 */
+	uint8_t brake;
+	double gain;
+	double speed; /* ticks per second */
+	double position; /* ticks */
+	uint8_t port, a, b;
+	uint8_t counter; /* Tn pin on port B */
+	double ramp, ramp_rate; /* motor board's PWM ramp, counts and counts per second */
+	int16_t ramp_target;
+	uint8_t velocity_on; /* motor board's speed loop */
+	double velocity_target, velocity_integral;
+};
+
+static struct wheel left = { .gain = 1.00, .port = SIM_PORTD, .a = 2, .b = 6, .counter = 0 };
+static struct wheel right = { .gain = 0.96, .port = SIM_PORTD, .a = 3, .b = 7, .counter = 1 };
+static double heading, x, y;
+static uint32_t seed = 1;
+static unsigned failures; /* Checks on the firmware that failed */
+
+/* Deterministic noise in [-amplitude, amplitude] */
+static int16_t noise(int16_t amplitude)
+{
+	seed = seed * 1103515245 + 12345;
+	return (int16_t)((seed >> 16) % (2 * amplitude + 1)) - amplitude;
+}
+
+static void drive(struct wheel *w, int16_t duty)
+{
+	w->duty = duty;
+	w->brake = 0;
+	w->ramp_rate = 0.0;
+	w->velocity_on = 0;
+}
+
+static void brake(struct wheel *w, uint8_t amount)
+{
+	w->duty = 0;
+	w->brake = amount;
+	w->ramp_rate = 0.0;
+	w->velocity_on = 0;
+}
+
+static void wheel_step(struct wheel *w, double dt)
+{
+	double target = 0.0;
+	double tau = TAU_COAST;
+	int16_t duty = abs(w->duty);
+	uint8_t quarter;
+
+	if(w->brake) {
+		tau = TAU_BRAKE * 255.0 / w->brake;
+	} else if(duty > STALL_DUTY) {
+		target = w->gain * MAX_SPEED * TICKS_PER_METRE * (duty - STALL_DUTY) / (255 - STALL_DUTY);
+		if(w->duty < 0)
+			target = -target;
+		tau = TAU_DRIVE;
+	}
+	w->speed += (target - w->speed) * dt / tau;
+	w->position += w->speed * dt;
+
+	/* A and B in quadrature, B leading going forward: AB = 00 01 11 10 per tick */
+	quarter = (int64_t)floor(w->position * 4.0) & 3;
+	sim_pin(w->port, w->a, quarter >= 2);
+	sim_pin(w->port, w->b, quarter == 1 || quarter == 2);
+#if defined(SIM_ROLE_MASTER)
+	sim_pin(SIM_PORTB, w->counter, quarter >= 2);
+#endif
+}
+
+/* Like slave.c's ramp_start(): from the duty applied unless already ramping */
+static void ramp(struct wheel *w, int16_t target, uint8_t acceleration)
+{
+	if(w->ramp_rate == 0.0)
+		w->ramp = w->duty;
+	w->ramp_target = target;
+	w->ramp_rate = acceleration * RAMP_HZ / 64.0;
+	if(w->ramp_rate == 0.0)
+		w->ramp = target;
+	w->duty = (int16_t)floor(w->ramp);
+	w->brake = 0;
+	w->velocity_on = 0;
+}
+
+/* Ramps run continuously here rather than in RAMP_HZ steps */
+static void ramp_step(struct wheel *w, double dt)
+{
+	if(w->ramp_rate == 0.0)
+		return;
+	if(w->ramp < w->ramp_target)
+		w->ramp = fmin(w->ramp + w->ramp_rate * dt, w->ramp_target);
+	else
+		w->ramp = fmax(w->ramp - w->ramp_rate * dt, w->ramp_target);
+	if(w->ramp == w->ramp_target)
+		w->ramp_rate = 0.0;
+	w->duty = (int16_t)floor(w->ramp);
+}
+
+/* Like slave.c's speed_start() */
+static void velocity(struct wheel *w, int16_t target)
+{
+	if(!w->velocity_on)
+		w->velocity_integral = 0.0;
+	w->velocity_on = 1;
+	w->velocity_target = target;
+	w->ramp_rate = 0.0;
+	w->brake = 0;
+}
+
+/* slave.c's speed loop, run continuously on the true speed */
+static void velocity_step(struct wheel *w, double dt)
+{
+	double error, duty;
+
+	if(!w->velocity_on)
+		return;
+	if(w->velocity_target == 0.0) {
+		w->velocity_integral = 0.0;
+		w->duty = 0;
+		return;
+	}
+	error = w->velocity_target - w->speed;
+	w->velocity_integral = fmax(-SPEED_LIMIT, fmin(SPEED_LIMIT, w->velocity_integral + SPEED_KI * error * dt));
+	duty = w->velocity_target * 255.0 / SPEED_MAX
+		+ fmax(-SPEED_LIMIT, fmin(SPEED_LIMIT, SPEED_KP * error + w->velocity_integral));
+	w->duty = (int16_t)fmax(-255.0, fmin(255.0, duty));
+}
+
+
+#if defined(SIM_ROLE_MASTER)
+
+/* Wheel synchronisation benchmark */
+static struct segment {
+	const char *kind; /* NULL between segments */
+	uint64_t start, settled;
+	double left0, right0, heading0;
+	double error, worst, squares;
+	uint32_t steps;
+} segment;
+
+static struct {
+	uint16_t count;
+	double worst, squares, settling, drift;
+	uint32_t steps;
+} totals;
+
+static void segment_start(const char *kind)
+{
+	if(segment.kind)
+		return;
+	segment.kind = kind;
+	segment.start = segment.settled = sim_cycles;
+	segment.left0 = left.position;
+	segment.right0 = right.position;
+	segment.heading0 = heading;
+	segment.worst = segment.squares = 0.0;
+	segment.steps = 0;
+}
+
+static void segment_step(void)
+{
+	double error;
+
+	if(!segment.kind)
+		return;
+	error = fabs(left.position - segment.left0) - fabs(right.position - segment.right0);
+	if(fabs(error) > SETTLE_TICKS)
+		segment.settled = sim_cycles;
+	if(fabs(error) > segment.worst)
+		segment.worst = fabs(error);
+	segment.squares += error * error;
+	segment.steps++;
+	segment.error = error;
+}
+
+static void segment_end(void)
+{
+	double settling, drift;
+
+	if(!segment.kind || !segment.steps)
+		return;
+	settling = SIM_SECONDS(segment.settled - segment.start);
+	drift = (heading - segment.heading0) * 180.0 / M_PI;
+	if(segment.kind[0] == 's') /* turns are meant to change the heading */
+		totals.drift += fabs(drift);
+	fprintf(stderr, "rover: %-8s %5.2f s, sync error %+5.1f worst %4.1f rms %4.1f ticks, settled %5.2f s, heading %+6.1f deg\n",
+		segment.kind, SIM_SECONDS(sim_cycles - segment.start), segment.error, segment.worst,
+		sqrt(segment.squares / segment.steps), settling, drift);
+
+	totals.count++;
+	totals.steps += segment.steps;
+	totals.squares += segment.squares;
+	totals.settling += settling;
+	if(segment.worst > totals.worst)
+		totals.worst = segment.worst;
+	segment.kind = NULL;
+}
+
+/* Both wheels from a SETPOINT frame; a segment starts with the first one after a brake */
+static void setpoint(int16_t l, int16_t r)
+{
+	segment_start(((l < 0) == (r < 0)) ? "straight" : "turn");
+	drive(&left, l);
+	drive(&right, r);
+}
+
+/* Both wheels from a VELOCITY frame */
+static void velocities(int16_t l, int16_t r)
+{
+	segment_start(((l < 0) == (r < 0)) ? "straight" : "turn");
+	velocity(&left, l);
+	velocity(&right, r);
+}
+
+/* Both wheels from a RAMP frame, starting a segment like a setpoint */
+static void ramps(int16_t l, int16_t r, uint8_t left_acceleration, uint8_t right_acceleration)
+{
+	segment_start(((l < 0) == (r < 0)) ? "straight" : "turn");
+	ramp(&left, l, left_acceleration);
+	ramp(&right, r, right_acceleration);
+}
+
+static void command(uint8_t command, uint8_t value)
+{
+	switch(command) {
+		case FORWARD:
+		case REVERSE:
+			segment_start("straight");
+			break;
+		case TURN_LEFT:
+		case TURN_RIGHT:
+			segment_start("turn");
+			break;
+		case BRAKE:
+			segment_end();
+			break;
+	}
+
+	switch(command) {
+		case FORWARD_LEFT:
+			drive(&left, value);
+			break;
+		case FORWARD_RIGHT:
+			drive(&right, value);
+			break;
+		case BRAKE:
+			brake(&left, value);
+			brake(&right, value);
+			break;
+		case REVERSE_LEFT:
+			drive(&left, -value);
+			break;
+		case REVERSE_RIGHT:
+			drive(&right, -value);
+			break;
+		case FORWARD:
+			drive(&left, value);
+			drive(&right, value);
+			break;
+		case TURN_LEFT:
+			drive(&left, -value);
+			drive(&right, value);
+			break;
+		case TURN_RIGHT:
+			drive(&left, value);
+			drive(&right, -value);
+			break;
+		case REVERSE:
+			drive(&left, -value);
+			drive(&right, -value);
+			break;
+	}
+}
+
+/* Motor board: collects a write and applies it at the stop, like slave.c's twi_rx(),
+   and answers reads from its register map like twi_tx() */
+static uint8_t frame[32];
+static uint8_t frame_length;
+static struct registers registers; /* counts, speeds and rangers as from a SPEED_CONTROL, SENSORS slave */
+static uint8_t register_pointer, register_index;
+static uint8_t general; /* The write going on is a general call */
+
+static void board_start(uint8_t read)
+{
+	frame_length = 0;
+	general = 0;
+	if(read) {
+		registers.left = left.duty;
+		registers.right = right.duty;
+		registers.encoder_left = (int32_t)floor(left.position);
+		registers.encoder_right = (int32_t)floor(right.position);
+		registers.speed_left = (int16_t)left.speed;
+		registers.speed_right = (int16_t)right.speed;
+		registers.sensors[0] = rover_adc(0) << 2; // 12-bit, a block every 20 ms
+		registers.sensors[1] = rover_adc(1) << 2;
+		registers.sensor_age = (sim_cycles % SIM_MS(20)) / SIM_MS(1);
+		registers.sensor_seq = sim_cycles / SIM_MS(20);
+		register_index = register_pointer;
+	}
+}
+
+static void board_general_start(uint8_t read)
+{
+	frame_length = 0;
+	general = 1;
+}
+
+static uint8_t board_write(uint8_t data)
+{
+	if(frame_length == sizeof(frame))
+		return 0;
+	frame[frame_length++] = data;
+	return 1;
+}
+
+static uint8_t board_read(uint8_t ack)
+{
+	if(register_index >= sizeof(registers))
+		return 0xFF;
+	return ((uint8_t *)&registers)[register_index++];
+}
+
+static void board_stop(void)
+{
+	uint8_t *c, *end = frame + frame_length - 1;
+
+	/* A read, or an empty write checking the board is there */
+	if(frame_length == 0)
+		return;
+	if(frame_length < FRAME_OVERHEAD || frame_length != frame[0] + FRAME_OVERHEAD ||
+			frame_crc(frame, frame_length - 1) != *end) {
+		fprintf(stderr, "rover: bad frame from the master\n");
+		return;
+	}
+	for(c = frame + 2; c < end; c += COMMAND_LENGTH(*c))
+		;
+	if(c != end || (!general && frame[1] == registers.sequence))
+		return;
+	if(general)
+		fprintf(stderr, "rover: general call, %u command bytes\n", frame[0]);
+
+	for(c = frame + 2; c < end; c += COMMAND_LENGTH(*c)) {
+		if(c[0] == REGISTER) {
+			if(c[1] < sizeof(registers))
+				register_pointer = c[1];
+		} else if(c[0] == SETPOINT) {
+			setpoint((c[1] & 1) ? -c[2] : c[2], (c[1] & 2) ? -c[3] : c[3]);
+		} else if(c[0] == RAMP) {
+			ramps((c[1] & 1) ? -c[2] : c[2], (c[1] & 2) ? -c[3] : c[3], c[4], c[5]);
+		} else if(c[0] == VELOCITY) {
+			velocities((int16_t)(c[1] | c[2] << 8), (int16_t)(c[3] | c[4] << 8));
+		} else {
+			command(c[0], c[1]);
+		}
+	}
+	if(!general)
+		registers.sequence = frame[1];
+}
+
+static struct sim_twi_device board = {
+	.address = TWI_SLAVE,
+	.start = board_start,
+	.write = board_write,
+	.read = board_read,
+	.stop = board_stop
+};
+
+/* The board listens to general calls too, as slave.c sets TWGCE */
+static struct sim_twi_device board_general = {
+	.address = 0,
+	.start = board_general_start,
+	.write = board_write,
+	.read = board_read,
+	.stop = board_stop
+};
+
+static void motors(void)
+{
+	ramp_step(&left, STEP_US * 1e-6);
+	ramp_step(&right, STEP_US * 1e-6);
+	velocity_step(&left, STEP_US * 1e-6);
+	velocity_step(&right, STEP_US * 1e-6);
+	segment_step();
+}
+
+static void benchmark_report(void)
+{
+	if(!totals.count)
+		return;
+	fprintf(stderr, "rover: %u segments, sync error worst %.1f rms %.1f ticks, mean settling %.2f s, straight heading drift %.1f deg\n",
+		totals.count, totals.worst, sqrt(totals.squares / totals.steps),
+		totals.settling / totals.count, totals.drift);
+}
+
+#elif defined(SIM_ROLE_SLAVE)
+
+/* Remote master replaying a short drive at the firmware. Writes are
+   framed as they go out; CORRUPT ones get a bad CRC and must be ignored. */
+#define WRITE 0
+#define READ 1
+#define CORRUPT 2
+#define GENERAL 3 /* A general call, carrying the last frame's sequence */
+#define CHECK 4 /* A read of the whole map that expects exactly the faults in data[0] */
+#define SETPOINT_COMMAND(l, r) SETPOINT, ((l) < 0) | (((r) < 0) << 1), (l) < 0 ? -(l) : (l), (r) < 0 ? -(r) : (r)
+#define RAMP_COMMAND(l, r, a) RAMP, ((l) < 0) | (((r) < 0) << 1), (l) < 0 ? -(l) : (l), (r) < 0 ? -(r) : (r), a, a
+#define VELOCITY_COMMAND(l, r) VELOCITY, (l) & 0xFF, ((l) >> 8) & 0xFF, (r) & 0xFF, ((r) >> 8) & 0xFF
+#define READ_REGISTERS READ, sizeof(struct registers)
+#define CHECK_FAULTS(faults) CHECK, sizeof(struct registers), { faults }
+
+static const struct {
+	uint16_t ms;
+	uint8_t kind;
+	uint8_t length;
+	uint8_t data[6];
+} script[] = {
+	{ 2500, WRITE, 2, { FORWARD, 200 } },
+	{ 4500, WRITE, 2, { TURN_RIGHT, 120 } },
+	{ 5000, WRITE, 2, { BRAKE, 255 } },
+	{ 6000, WRITE, 4, { SETPOINT_COMMAND(255, 255) } },
+	{ 7000, WRITE, 4, { SETPOINT_COMMAND(-120, 120) } },
+	{ 7500, WRITE, 6, { SETPOINT_COMMAND(255, 230), REGISTER, 0 } },
+	{ 7600, WRITE, 2, { 0x63, 0 } }, /* Unknown, so the next read shows a fault */
+	{ 7650, CORRUPT, 4, { SETPOINT_COMMAND(-255, -255) } },
+	{ 7660, WRITE, 2, { REGISTER, offsetof(struct registers, sequence) } },
+	{ 7670, READ, 1 }, /* Stops short of the faults, so they mustn't be cleared */
+	{ 7680, WRITE, 2, { REGISTER, 0 } },
+	{ 7700, CHECK_FAULTS(0x0A) }, /* Unknown and CRC */
+	{ 7800, WRITE, 6, { RAMP_COMMAND(-200, 200, 64) } }, /* 1250 counts/s */
+	{ 7850, CHECK_FAULTS(0x00) }, /* left part way down, right there */
+	{ 8200, READ_REGISTERS },
+	{ 8500, WRITE, 2, { BRAKE, 255 } },
+	{ 8600, READ_REGISTERS },
+	/* Speed loop, when slave.c is built with SPEED_CONTROL; otherwise faults 02 */
+	{ 9000, WRITE, 5, { VELOCITY_COMMAND(300, 300) } },
+	{ 9600, READ_REGISTERS },
+	{ 9700, WRITE, 5, { VELOCITY_COMMAND(-150, 150) } },
+	{ 10300, READ_REGISTERS },
+	{ 10400, WRITE, 5, { VELOCITY_COMMAND(0, 0) } },
+	{ 10900, READ_REGISTERS },
+	{ 11000, WRITE, 4, { SETPOINT_COMMAND(200, 200) } },
+	{ 11500, GENERAL, 2, { BRAKE, 255 } }, /* Applied, though it repeats the sequence */
+	{ 11600, READ_REGISTERS }
+};
+static uint8_t remote_sequence;
+
+static struct sim_twi_transfer transfer;
+static uint8_t script_index;
+static int16_t expect_faults = -1; /* Of the read going on, if it's a CHECK */
+
+/* The ramps and speed loop the master role drives its wheels with, run
+   here beside the firmware's own from the same frames and checked against
+   the PWM it sets. A ramp should stay within a PWM step. The speed loop
+   takes up a new target at its next tick, SPEED_DIVIDER ramp ticks on,
+   so isn't checked until then; through a reversal its speed from edge
+   periods trails the true one the model runs on, so it gets more room. */
+#ifndef SPEED_CONTROL
+#define SPEED_CONTROL 0 /* As slave.h, VELOCITY is a fault without it */
+#endif
+#define MODEL_RAMP 1
+#define MODEL_SPEED 2
+#define RAMP_TOLERANCE 2 /* PWM counts */
+#define SPEED_TOLERANCE 32
+#define SPEED_DIVIDER 5 /* slave.h's ramp ticks to a speed loop tick */
+static struct wheel model_left, model_right;
+static uint8_t modelled; /* MODEL_ kind running, 0 if neither */
+static uint64_t model_since; /* Cycle of the frame that started or changed it */
+static double model_worst; /* PWM counts off the firmware's */
+
+static void model_end(void)
+{
+	static const char *const names[] = { "", "ramp", "speed loop" };
+	static const double tolerances[] = { 0.0, RAMP_TOLERANCE, SPEED_TOLERANCE };
+
+	if(!modelled)
+		return;
+	fprintf(stderr, "rover: %s model worst %.0f PWM counts off the slave's\n", names[modelled], model_worst);
+	if(model_worst > tolerances[modelled]) {
+		fprintf(stderr, "rover: FAILED, %s model more than %.0f off\n", names[modelled], tolerances[modelled]);
+		failures++;
+	}
+	modelled = 0;
+}
+
+/* Check kind from now on, carrying on if it's what's running */
+static void model_start(uint8_t kind)
+{
+	if(modelled != kind) {
+		model_end();
+		modelled = kind;
+		model_worst = 0.0;
+	}
+	model_since = sim_cycles;
+}
+
+/* A frame the firmware took: ramps and speed loops start the model, other drives end it */
+static void model_frame(const uint8_t *frame)
+{
+	const uint8_t *c, *end = frame + frame[0] + 2;
+
+	for(c = frame + 2; c < end; c += COMMAND_LENGTH(*c)) {
+		if(c[0] == RAMP) {
+			model_start(MODEL_RAMP);
+			ramp(&model_left, (c[1] & 1) ? -c[2] : c[2], c[4]);
+			ramp(&model_right, (c[1] & 2) ? -c[3] : c[3], c[5]);
+		} else if(c[0] == VELOCITY && SPEED_CONTROL) {
+			model_start(MODEL_SPEED);
+			velocity(&model_left, (int16_t)(c[1] | c[2] << 8));
+			velocity(&model_right, (int16_t)(c[3] | c[4] << 8));
+		} else if(c[0] >= FORWARD_LEFT && c[0] <= SETPOINT) {
+			model_end();
+		}
+	}
+}
+
+/* Off, the model follows the firmware so the next ramp starts from the same PWM */
+static void model_step(struct wheel *model, const struct wheel *w)
+{
+	if(!modelled) {
+		drive(model, w->duty);
+		return;
+	}
+	model->speed = w->speed;
+	ramp_step(model, STEP_US * 1e-6);
+	velocity_step(model, STEP_US * 1e-6);
+	if(modelled == MODEL_RAMP || sim_cycles - model_since >= SIM_US(1000000UL * SPEED_DIVIDER / RAMP_HZ))
+		model_worst = fmax(model_worst, abs(model->duty - w->duty));
+}
+
+static void remote_done(struct sim_twi_transfer *t, uint8_t ok)
+{
+	struct registers r;
+
+	if(!ok) {
+		fprintf(stderr, "rover: frame %u not acknowledged\n", t->data[1]);
+	} else if(!t->read) {
+		if(frame_crc(t->data, t->length - 1) == t->data[t->length - 1])
+			model_frame(t->data);
+	} else if(t->length < sizeof(r)) {
+		fprintf(stderr, "rover: slave register bytes %u\n", t->length);
+	} else {
+		memcpy(&r, t->data, sizeof(r));
+		fprintf(stderr, "rover: slave registers left %d right %d sequence %u faults %02x encoders %d %d speeds %d %d\n",
+			r.left, r.right, r.sequence, r.faults, r.encoder_left, r.encoder_right, r.speed_left, r.speed_right);
+		fprintf(stderr, "rover: wheel speeds %.0f %.0f ticks/s\n", left.speed, right.speed);
+		fprintf(stderr, "rover: slave sensors %u %u age %u ms seq %u\n",
+			r.sensors[0], r.sensors[1], r.sensor_age, r.sensor_seq);
+		if(expect_faults >= 0 && r.faults != expect_faults) {
+			fprintf(stderr, "rover: FAILED, expected faults %02x\n", expect_faults);
+			failures++;
+		}
+	}
+}
+
+static void remote_send(void)
+{
+	uint8_t length = script[script_index].length;
+
+	transfer.address = (script[script_index].kind == GENERAL) ? 0 : TWI_SLAVE;
+	transfer.read = (script[script_index].kind == READ) || (script[script_index].kind == CHECK);
+	expect_faults = (script[script_index].kind == CHECK) ? script[script_index].data[0] : -1;
+	if(transfer.read) {
+		transfer.length = length;
+	} else {
+		transfer.data[0] = length;
+		transfer.data[1] = (script[script_index].kind == GENERAL) ? remote_sequence : ++remote_sequence;
+		memcpy(transfer.data + 2, script[script_index].data, length);
+		transfer.data[length + 2] = frame_crc(transfer.data, length + 2);
+		if(script[script_index].kind == CORRUPT)
+			transfer.data[length + 2] ^= 0x01;
+		transfer.length = length + FRAME_OVERHEAD;
+	}
+	transfer.done = remote_done;
+	sim_twi_inject(&transfer);
+
+	if(++script_index < sizeof(script) / sizeof(script[0]))
+		sim_schedule(SIM_EV_REMOTE, SIM_MS(script[script_index].ms) - sim_cycles, remote_send);
+}
+
+static void motor(struct wheel *w, uint8_t forward, uint8_t reverse)
+{
+	if(forward && reverse)
+		brake(w, forward < reverse ? forward : reverse);
+	else
+		drive(w, (int16_t)forward - reverse);
+}
+
+/* The H-bridges follow the PWM compare registers (MOTORL1/2, MOTORR1/2 in slave.h) */
+static void motors(void)
+{
+	motor(&left, OCR1A, OCR1B);
+	motor(&right, OCR0A, OCR0B);
+	model_step(&model_left, &left);
+	model_step(&model_right, &right);
+}
+
+static void benchmark_report(void)
+{
+	model_end();
+}
+
+#else
+#error "define SIM_ROLE_MASTER or SIM_ROLE_SLAVE"
+#endif
+
+
+static void step(void)
+{
+	double dt = STEP_US * 1e-6;
+	double dl, dr;
+
+	motors();
+	wheel_step(&left, dt);
+	wheel_step(&right, dt);
+
+	dl = left.speed * dt / TICKS_PER_METRE;
+	dr = right.speed * dt / TICKS_PER_METRE;
+	x += (dl + dr) / 2.0 * cos(heading);
+	y += (dl + dr) / 2.0 * sin(heading);
+	heading += (dl - dr) / TRACK_WIDTH;
+
+	sim_schedule(SIM_EV_ROVER, SIM_US(STEP_US), step);
+}
+
+void rover_init(void)
+{
+#if defined(SIM_ROLE_MASTER)
+	sim_twi_attach(&board);
+	sim_twi_attach(&board_general);
+#else
+	sim_schedule(SIM_EV_REMOTE, SIM_MS(script[0].ms), remote_send);
+#endif
+	sim_schedule(SIM_EV_ROVER, SIM_US(STEP_US), step);
+}
+
+/*
+	ADC0-1 rangers, ADC2-3 the two compass axes, ADC4-6 infrared,
+	scaled for a 10-bit conversion against AREF
+*/
+uint16_t rover_adc(uint8_t channel)
+{
+	switch(channel) {
+		case 0:
+		case 1:
+			return 300 + noise(4);
+		case 2:
+			return 512 + (int16_t)(200.0 * cos(heading)) + noise(3);
+		case 3:
+			return 512 + (int16_t)(200.0 * sin(heading)) + noise(3);
+		case 4:
+		case 5:
+		case 6:
+			return 100 + noise(8);
+	}
+	return 0;
+}
+
+int rover_report(void)
+{
+	benchmark_report();
+	fprintf(stderr, "rover: left %.1f ticks, right %.1f ticks, heading %.1f deg, position (%.2f, %.2f) m\n",
+		left.position, right.position, heading * 180.0 / M_PI, x, y);
+	if(failures)
+		fprintf(stderr, "rover: %u checks FAILED\n", failures);
+	return failures != 0;
+}
@@ -0,0 +1,1428 @@
+/*
+	sim.c - simulated AVR behind the host build of the rover firmware.
+
+	See sim.h for the model. Peripherals are simulated at register level so
+	the unmodified twi.c and uart.c drivers run on top of them:
+
+	  external interrupts  INT0-2 edges and pin change groups, fed by sim_pin()
+	  timers 0-2           normal, CTC and fast PWM counting with compare,
+	                       overflow and ICR1-as-TOP flags; dual-slope modes
+	                       are approximated as single slope at half the rate;
+	                       timers 0 and 1 count edges on T0/T1 as well
+	  ADC                  single and free-running conversions, rover_adc() samples
+	  TWI                  master mode against attached devices, slave mode
+	                       against transfers injected by a remote master
+	  USART0               transmitter only, output goes to stdout
+	  EEPROM               through the avr-libc block functions or EECR
+	                       writes with EE_READY, erased (0xFF) or loaded
+	                       from the -e file
+
+	Registers whose writes have side effects get an io_write handler, which
+	runs when the access is committed (at the next access, delay or spin).
+	A plain access can't tell a read from a write of the same value, so
+	TWCR and the interrupt flag registers carry a marker in an otherwise
+	unused bit while the firmware has them: if the marker survives, the
+	access was a read.
+*/
+
+#define SIM_INTERNAL
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <compat/twi.h>
+#include "sim.h"
+
+#define ADDR(reg) ((uint8_t)((uint8_t *)&(reg) - sim_reg))
+
+#define FLAG_MARKER 0x80 /* unused in EIFR, PCIFR and TIFRn */
+#define TWCR_MARKER 0x02 /* reserved bit of TWCR */
+
+#define EEPROM_WRITE_US 3300
+
+uint8_t sim_reg[0x100] __attribute__((aligned(2)));
+uint64_t sim_cycles;
+uint8_t sim_verbose;
+
+static uint64_t limit = SIM_MS(60000);
+static uint64_t spin_cycles;
+
+/* Register side effects */
+static void (*io_read[0x100])(uint8_t addr);
+static void (*io_write[0x100])(uint8_t addr, uint8_t old);
+static int16_t pending = -1;
+static uint8_t pending_width;
+static uint8_t pending_old[2];
+
+/* Event queue */
+static uint64_t event_time[SIM_EVENTS];
+static void (*event_fire[SIM_EVENTS])(void);
+
+/* Interrupts */
+#define VECTOR_LIST \
+	X(INT0) X(INT1) X(INT2) X(PCINT0) X(PCINT1) X(PCINT2) X(PCINT3) X(WDT) \
+	X(TIMER2_COMPA) X(TIMER2_COMPB) X(TIMER2_OVF) X(TIMER1_CAPT) \
+	X(TIMER1_COMPA) X(TIMER1_COMPB) X(TIMER1_OVF) X(TIMER0_COMPA) \
+	X(TIMER0_COMPB) X(TIMER0_OVF) X(SPI_STC) X(USART0_RX) X(USART0_UDRE) \
+	X(USART0_TX) X(ANALOG_COMP) X(ADC) X(EE_READY) X(TWI) X(SPM_READY)
+
+#define X(name) extern void name##_vect(void) __attribute__((weak));
+VECTOR_LIST
+#undef X
+extern void BADISR_vect(void) __attribute__((weak));
+
+static struct vector {
+	const char *name;
+	void (*handler)(void);
+	uint32_t count;
+	uint64_t cycles;
+	uint64_t max;
+} vectors[SIM_VECTORS] = {
+#define X(name) [SIM_##name] = { #name "_vect", name##_vect },
+	VECTOR_LIST
+#undef X
+};
+
+static uint8_t current_vector;
+
+/* Pins */
+static uint8_t pin_in[4];
+
+/* TWI */
+enum {
+	TWI_OP_START,
+	TWI_OP_ADDRESS,
+	TWI_OP_TRANSMIT,
+	TWI_OP_RECEIVE,
+	TWI_OP_REMOTE_ADDRESS,
+	TWI_OP_REMOTE_RECEIVE,
+	TWI_OP_REMOTE_TRANSMIT,
+	TWI_OP_REMOTE_STOP
+};
+
+#define TWI_DEVICES 8
+#define TWI_QUEUE 8
+#ifdef TWI_FREQ
+#define TWI_REMOTE_FREQ TWI_FREQ /* The master runs the same bus clock */
+#else
+#define TWI_REMOTE_FREQ 100000UL
+#endif
+
+static struct {
+	uint8_t control; /* TWCR as the hardware sees it */
+	uint8_t status;
+	uint8_t prescaler;
+	uint8_t op;
+	uint8_t byte;
+	uint8_t master; /* firmware holds the bus */
+	uint8_t start_pending;
+	struct sim_twi_device *device;
+	struct sim_twi_transfer *remote;
+	uint8_t index;
+	uint8_t trace[40];
+	uint8_t trace_length;
+} twi;
+
+static struct sim_twi_device *twi_devices[TWI_DEVICES];
+static struct sim_twi_transfer *twi_queue[TWI_QUEUE];
+static uint8_t twi_queued;
+
+/* USART */
+static struct {
+	uint8_t shift;
+	uint8_t buffer;
+	uint8_t busy;
+	uint8_t full;
+} usart;
+
+/* EEPROM */
+static uint8_t eeprom[E2END + 1];
+static const char *eeprom_file;
+static uint16_t eeprom_address; /* Of the EECR write in progress */
+static uint8_t eeprom_data;
+
+/* Timers */
+static struct timer {
+	uint8_t tccra, tccrb, tcnt, ocra, ocrb, tifr, timsk;
+	uint8_t wide;
+	uint8_t event;
+	uint32_t count; /* steps from BOTTOM; past TOP on the way down in phase correct modes */
+	uint64_t synced; /* cycle the count is valid for */
+} timers[3] = {
+	{ 0x44, 0x45, 0x46, 0x47, 0x48, 0x35, 0x6E, 0, SIM_EV_TIMER0 },
+	{ 0x80, 0x81, 0x84, 0x88, 0x8A, 0x36, 0x6F, 1, SIM_EV_TIMER1 },
+	{ 0xB0, 0xB1, 0xB2, 0xB3, 0xB4, 0x37, 0x70, 0, SIM_EV_TIMER2 }
+};
+
+/* ADC */
+static uint8_t adc_channel;
+static uint8_t adc_first;
+
+int firmware_main(void);
+static void take_interrupts(void);
+
+
+/* Clock and events */
+
+void sim_schedule(uint8_t event, uint64_t delay, void (*fire)(void))
+{
+	event_time[event] = sim_cycles + delay;
+	event_fire[event] = fire;
+}
+
+static void cancel(uint8_t event)
+{
+	event_time[event] = SIM_NEVER;
+}
+
+static uint64_t next_event(uint8_t *event)
+{
+	uint64_t when = SIM_NEVER;
+	uint8_t i;
+
+	for(i = 0; i < SIM_EVENTS; i++) {
+		if(event_time[i] < when) {
+			when = event_time[i];
+			if(event) *event = i;
+		}
+	}
+	return when;
+}
+
+static void run_until(uint64_t end)
+{
+	uint64_t when;
+	uint8_t event = 0;
+
+	while((when = next_event(&event)) <= end && when < limit) {
+		sim_cycles = when;
+		event_time[event] = SIM_NEVER;
+		event_fire[event]();
+	}
+	if(end >= limit) {
+		sim_cycles = limit;
+		fprintf(stderr, "sim: time limit reached\n");
+		sim_halt();
+	}
+	sim_cycles = end;
+}
+
+
+/* Register access */
+
+static void commit(void)
+{
+	uint8_t addr, i;
+
+	if(pending < 0)
+		return;
+	addr = pending;
+	pending = -1;
+	for(i = 0; i < pending_width; i++) {
+		if(io_write[addr + i])
+			io_write[addr + i](addr + i, pending_old[i]);
+	}
+}
+
+static void io_access(uint8_t addr, uint8_t width)
+{
+	uint8_t i;
+
+	commit();
+	run_until(sim_cycles + SIM_IO_CYCLES);
+	take_interrupts();
+	for(i = 0; i < width; i++) {
+		if(io_read[addr + i])
+			io_read[addr + i](addr + i);
+		pending_old[i] = sim_reg[addr + i];
+	}
+	pending = addr;
+	pending_width = width;
+}
+
+volatile uint8_t *sim_io8(uint8_t addr)
+{
+	io_access(addr, 1);
+	return &sim_reg[addr];
+}
+
+volatile uint16_t *sim_io16(uint8_t addr)
+{
+	io_access(addr, 2);
+	return (volatile uint16_t *)&sim_reg[addr];
+}
+
+/* Write-one-to-clear flag registers */
+static void read_flags(uint8_t addr)
+{
+	sim_reg[addr] |= FLAG_MARKER;
+}
+
+static void write_flags(uint8_t addr, uint8_t old)
+{
+	uint8_t value = sim_reg[addr];
+
+	if(value & FLAG_MARKER)
+		sim_reg[addr] = value & ~FLAG_MARKER;
+	else
+		sim_reg[addr] = (old & ~FLAG_MARKER) & ~value;
+}
+
+
+/* Interrupts */
+
+void sim_sei(void)
+{
+	commit();
+	SREG |= _BV(SREG_I);
+	take_interrupts();
+}
+
+void sim_cli(void)
+{
+	commit();
+	SREG &= ~_BV(SREG_I);
+}
+
+static uint8_t pending_vector(void)
+{
+	uint8_t i;
+
+	for(i = 0; i < 3; i++) {
+		if((EIFR & _BV(i)) && (EIMSK & _BV(i)))
+			return SIM_INT0 + i;
+	}
+	for(i = 0; i < 4; i++) {
+		if((PCIFR & _BV(i)) && (PCICR & _BV(i)))
+			return SIM_PCINT0 + i;
+	}
+	for(i = 3; i-- > 0; ) {
+		uint8_t due = sim_reg[timers[i].tifr] & sim_reg[timers[i].timsk];
+		uint8_t base = (i == 2) ? SIM_TIMER2_COMPA : (i == 1) ? SIM_TIMER1_COMPA : SIM_TIMER0_COMPA;
+
+		if(i == 1 && (due & _BV(ICF1)))
+			return SIM_TIMER1_CAPT;
+		if(due & _BV(OCF0A))
+			return base;
+		if(due & _BV(OCF0B))
+			return base + 1;
+		if(due & _BV(TOV0))
+			return base + 2;
+	}
+	if((UCSR0A & _BV(RXC0)) && (UCSR0B & _BV(RXCIE0)))
+		return SIM_USART0_RX;
+	if((UCSR0A & _BV(UDRE0)) && (UCSR0B & _BV(UDRIE0)))
+		return SIM_USART0_UDRE;
+	if((UCSR0A & _BV(TXC0)) && (UCSR0B & _BV(TXCIE0)))
+		return SIM_USART0_TX;
+	if((ADCSRA & _BV(ADIF)) && (ADCSRA & _BV(ADIE)))
+		return SIM_ADC;
+	if((EECR & _BV(EERIE)) && !(EECR & _BV(EEPE)))
+		return SIM_EE_READY;
+	if((twi.control & _BV(TWINT)) && (twi.control & _BV(TWIE)) && (twi.control & _BV(TWEN)))
+		return SIM_TWI;
+	return 0;
+}
+
+/* Compare A, compare B and overflow flags, in vector order */
+static const uint8_t timer_flag[3] = { _BV(OCF0A), _BV(OCF0B), _BV(TOV0) };
+
+/* Clear the flags the hardware clears when it jumps to the vector */
+static void acknowledge(uint8_t vector)
+{
+	if(vector >= SIM_INT0 && vector <= SIM_INT2)
+		EIFR &= ~_BV(vector - SIM_INT0);
+	else if(vector >= SIM_PCINT0 && vector <= SIM_PCINT3)
+		PCIFR &= ~_BV(vector - SIM_PCINT0);
+	else if(vector >= SIM_TIMER2_COMPA && vector <= SIM_TIMER2_OVF)
+		TIFR2 &= ~timer_flag[vector - SIM_TIMER2_COMPA];
+	else if(vector == SIM_TIMER1_CAPT)
+		TIFR1 &= ~_BV(ICF1);
+	else if(vector >= SIM_TIMER1_COMPA && vector <= SIM_TIMER1_OVF)
+		TIFR1 &= ~timer_flag[vector - SIM_TIMER1_COMPA];
+	else if(vector >= SIM_TIMER0_COMPA && vector <= SIM_TIMER0_OVF)
+		TIFR0 &= ~timer_flag[vector - SIM_TIMER0_COMPA];
+	else if(vector == SIM_USART0_TX)
+		UCSR0A &= ~_BV(TXC0);
+	else if(vector == SIM_ADC)
+		ADCSRA &= ~_BV(ADIF);
+}
+
+static void take_interrupts(void)
+{
+	struct vector *vector;
+	uint64_t start, spent;
+	uint8_t v, previous;
+
+	while((SREG & _BV(SREG_I)) && (v = pending_vector())) {
+		vector = &vectors[v];
+		start = sim_cycles;
+		acknowledge(v);
+		SREG &= ~_BV(SREG_I);
+		previous = current_vector;
+		current_vector = v;
+		run_until(sim_cycles + SIM_ISR_ENTRY);
+
+		if(vector->handler) {
+			vector->handler();
+		} else if(BADISR_vect) {
+			BADISR_vect();
+		} else {
+			fprintf(stderr, "sim: %s enabled with no handler, resetting\n", vector->name);
+			sim_halt();
+		}
+
+		commit();
+		run_until(sim_cycles + SIM_ISR_EXIT);
+		current_vector = previous;
+		SREG |= _BV(SREG_I);
+
+		spent = sim_cycles - start;
+		vector->count++;
+		vector->cycles += spent;
+		if(spent > vector->max)
+			vector->max = spent;
+	}
+}
+
+
+/* Waiting */
+
+void sim_delay(uint64_t cycles)
+{
+	uint64_t step;
+
+	commit();
+	while(cycles) {
+		step = next_event(NULL) - sim_cycles;
+		if(step > cycles)
+			step = cycles;
+		run_until(sim_cycles + step);
+		cycles -= step;
+		take_interrupts();
+	}
+}
+
+void sim_spin(void)
+{
+	uint64_t start, next;
+
+	commit();
+	take_interrupts();
+	start = sim_cycles;
+	next = next_event(NULL);
+	if(next == SIM_NEVER) {
+		fprintf(stderr, "sim: spinning with nothing left to happen\n");
+		sim_halt();
+	}
+	run_until(next > sim_cycles + SIM_IO_CYCLES ? next : sim_cycles + SIM_IO_CYCLES);
+	spin_cycles += sim_cycles - start;
+	take_interrupts();
+}
+
+
+/* Pins and external interrupts */
+
+static void timer_clock(uint8_t n, uint8_t level);
+
+static void read_pin(uint8_t addr)
+{
+	uint8_t port = (addr - ADDR(PINA)) / 3;
+	uint8_t ddr = sim_reg[addr + 1];
+
+	sim_reg[addr] = (pin_in[port] & ~ddr) | (sim_reg[addr + 2] & ddr);
+}
+
+static void edge(uint8_t n, uint8_t level)
+{
+	uint8_t sense = (EICRA >> (2 * n)) & 0x03;
+
+	if((sense == 0 && !level) || sense == 1 || (sense == 2 && !level) || (sense == 3 && level))
+		EIFR |= _BV(n);
+}
+
+void sim_pin(uint8_t port, uint8_t bit, uint8_t level)
+{
+	uint8_t old = pin_in[port];
+	uint8_t group;
+
+	if(level)
+		pin_in[port] |= _BV(bit);
+	else
+		pin_in[port] &= ~_BV(bit);
+	if(old == pin_in[port])
+		return;
+
+	if(port == SIM_PORTD && (bit == 2 || bit == 3))
+		edge(bit - 2, level);
+
+#if defined(__AVR_ATmega168__)
+	/* T0 on PD4, T1 on PD5 */
+	if(port == SIM_PORTD && (bit == 4 || bit == 5))
+		timer_clock(bit - 4, level);
+#else
+	/* T0 on PB0, T1 on PB1 */
+	if(port == SIM_PORTB && bit <= 1)
+		timer_clock(bit, level);
+#endif
+
+#if defined(__AVR_ATmega168__)
+	/* PCINT0-7 on port B, 8-14 on port C, 16-23 on port D */
+	if(port == SIM_PORTA)
+		return;
+	group = port - 1;
+#else
+	/* INT2 on PB2, PCINT0-31 on ports A to D */
+	if(port == SIM_PORTB && bit == 2)
+		edge(2, level);
+	group = port;
+#endif
+	if(PCMSK0 == 0 && PCMSK1 == 0 && PCMSK2 == 0 && PCMSK3 == 0)
+		return;
+	if(sim_reg[ADDR(PCMSK0) + group + (group == 3 ? 5 : 0)] & _BV(bit))
+		PCIFR |= _BV(group);
+}
+
+
+/* Timers */
+
+static struct timer *timer_at(uint8_t addr)
+{
+	uint8_t i;
+
+	for(i = 0; i < 3; i++) {
+		struct timer *t = &timers[i];
+		if(addr == t->tccra || addr == t->tccrb || addr == t->tifr || addr == t->timsk
+			|| (addr & ~t->wide) == t->tcnt || (addr & ~t->wide) == t->ocra
+			|| (addr & ~t->wide) == t->ocrb || (t->wide && (addr & ~1) == ADDR(ICR1L)))
+			return t;
+	}
+	return NULL;
+}
+
+static uint32_t timer_value(struct timer *t, uint8_t addr)
+{
+	return t->wide ? *(uint16_t *)&sim_reg[addr] : sim_reg[addr];
+}
+
+/* Cycles per count, 0 while stopped */
+static uint32_t timer_prescale(struct timer *t)
+{
+	static const uint16_t sync[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	static const uint16_t async[8] = { 0, 1, 8, 32, 64, 128, 256, 1024 };
+	uint8_t cs = sim_reg[t->tccrb] & 0x07;
+
+	return (t == &timers[2]) ? async[cs] : sync[cs];
+}
+
+struct timer_shape {
+	uint32_t top;
+	uint32_t max;
+	uint32_t period; /* counts from BOTTOM back to BOTTOM */
+	uint8_t ctc;
+	uint8_t dual;
+	uint8_t icr; /* ICR1 is TOP, ICF1 flags it */
+};
+
+static void timer_shape(struct timer *t, struct timer_shape *shape)
+{
+	uint8_t wgm;
+
+	shape->ctc = shape->dual = shape->icr = 0;
+	if(t->wide) {
+		wgm = (sim_reg[t->tccra] & 0x03) | ((sim_reg[t->tccrb] >> 1) & 0x0C);
+		shape->max = 0xFFFF;
+		switch(wgm) {
+			case 1: case 5: shape->top = 0x00FF; break;
+			case 2: case 6: shape->top = 0x01FF; break;
+			case 3: case 7: shape->top = 0x03FF; break;
+			case 4: case 9: case 11: case 15: shape->top = OCR1A; break;
+			case 8: case 10: case 12: case 14: shape->top = ICR1; shape->icr = 1; break;
+			default: shape->top = 0xFFFF; break;
+		}
+		shape->ctc = (wgm == 4 || wgm == 12);
+		shape->dual = (wgm >= 1 && wgm <= 3) || (wgm >= 8 && wgm <= 11);
+	} else {
+		wgm = (sim_reg[t->tccra] & 0x03) | ((sim_reg[t->tccrb] >> 1) & 0x04);
+		shape->max = 0xFF;
+		shape->top = (wgm == 2 || wgm == 5 || wgm == 7) ? sim_reg[t->ocra] : 0xFF;
+		shape->ctc = (wgm == 2);
+		shape->dual = (wgm == 1 || wgm == 5);
+	}
+	/* Phase correct modes count up to TOP and back down */
+	shape->period = (shape->dual && shape->top) ? 2 * shape->top : shape->top + 1;
+}
+
+/* Does counting k steps on from c (mod period) step off m? */
+static uint8_t timer_passes(uint32_t c, uint64_t k, uint32_t period, uint32_t m)
+{
+	if(m >= period)
+		return 0;
+	if(k >= period)
+		return 1;
+	return (m + period - c) % period < k;
+}
+
+/* Count k steps, setting the flags the counter passes */
+static void timer_step(struct timer *t, uint64_t k)
+{
+	struct timer_shape shape;
+	uint32_t period, run;
+
+	timer_shape(t, &shape);
+
+	/* Past a lowered TOP the counter runs on to MAX and wraps */
+	if(!shape.dual && t->count > shape.top) {
+		run = shape.max - t->count;
+		if(k <= run) {
+			t->count += k;
+			return;
+		}
+		k -= run + 1;
+		t->count = 0;
+		sim_reg[t->tifr] |= _BV(TOV0);
+		if(!k)
+			return;
+	}
+
+	/* Compare flags are set on the count after the match, as the hardware
+	   does, and on the way down too in phase correct modes */
+	period = shape.period;
+	if(timer_passes(t->count, k, period, timer_value(t, t->ocra))
+		|| (shape.dual && timer_passes(t->count, k, period, 2 * shape.top - timer_value(t, t->ocra))))
+		sim_reg[t->tifr] |= _BV(OCF0A);
+	if(timer_passes(t->count, k, period, timer_value(t, t->ocrb))
+		|| (shape.dual && timer_passes(t->count, k, period, 2 * shape.top - timer_value(t, t->ocrb))))
+		sim_reg[t->tifr] |= _BV(OCF0B);
+	if(timer_passes(t->count, k, period, period - 1) && (!shape.ctc || shape.top == shape.max))
+		sim_reg[t->tifr] |= _BV(TOV0);
+	if(shape.icr && timer_passes(t->count, k, period, shape.top))
+		sim_reg[t->tifr] |= _BV(ICF1);
+	t->count = (t->count + k) % period;
+}
+
+/* Fold the counts since the last sync into TCNT and the flags */
+static void timer_sync(struct timer *t)
+{
+	struct timer_shape shape;
+	uint32_t p = timer_prescale(t);
+	uint64_t k;
+
+	timer_shape(t, &shape);
+	k = p ? sim_cycles / p - t->synced / p : 0;
+	t->synced = sim_cycles;
+	if(k)
+		timer_step(t, k);
+}
+
+/* An edge on Tn: counts if the timer is clocked from that edge */
+static void timer_clock(uint8_t n, uint8_t level)
+{
+	uint8_t cs = sim_reg[timers[n].tccrb] & 0x07;
+
+	if((cs == 6 && !level) || (cs == 7 && level))
+		timer_step(&timers[n], 1);
+}
+
+static void (*const timer_fires[3])(void);
+
+/* Schedule an event for the next flag an enabled interrupt is waiting on */
+static void timer_schedule(struct timer *t)
+{
+	struct timer_shape shape;
+	uint32_t p = timer_prescale(t);
+	uint8_t enabled = sim_reg[t->timsk];
+	uint32_t period, d, next = 0;
+
+	cancel(t->event);
+	timer_shape(t, &shape);
+	if(!p || !enabled)
+		return;
+	period = shape.period;
+
+#define CANDIDATE(m) do { \
+		if((m) < period) { \
+			d = ((m) + period - t->count) % period + 1; \
+			if(!next || d < next) next = d; \
+		} \
+	} while(0)
+
+	if(!shape.dual && t->count > shape.top) {
+		next = shape.max - t->count + 1;
+	} else {
+		if(enabled & _BV(OCIE0A)) {
+			CANDIDATE(timer_value(t, t->ocra));
+			if(shape.dual)
+				CANDIDATE(2 * shape.top - timer_value(t, t->ocra));
+		}
+		if(enabled & _BV(OCIE0B)) {
+			CANDIDATE(timer_value(t, t->ocrb));
+			if(shape.dual)
+				CANDIDATE(2 * shape.top - timer_value(t, t->ocrb));
+		}
+		if(enabled & _BV(TOIE0))
+			CANDIDATE(period - 1);
+		if(shape.icr && (enabled & _BV(ICIE1)))
+			CANDIDATE(shape.top);
+	}
+#undef CANDIDATE
+
+	if(next)
+		event_time[t->event] = (sim_cycles / p + next) * p;
+	event_fire[t->event] = timer_fires[t - timers];
+}
+
+static void timer_fire(struct timer *t)
+{
+	timer_sync(t);
+	timer_schedule(t);
+}
+
+static void timer0_fire(void) { timer_fire(&timers[0]); }
+static void timer1_fire(void) { timer_fire(&timers[1]); }
+static void timer2_fire(void) { timer_fire(&timers[2]); }
+static void (*const timer_fires[3])(void) = { timer0_fire, timer1_fire, timer2_fire };
+
+static void timer_read(uint8_t addr)
+{
+	struct timer *t = timer_at(addr);
+	struct timer_shape shape;
+	uint32_t count;
+
+	timer_sync(t);
+	timer_shape(t, &shape);
+	count = (shape.dual && t->count > shape.top) ? 2 * shape.top - t->count : t->count;
+	if((addr & ~t->wide) == t->tcnt) {
+		if(t->wide)
+			*(uint16_t *)&sim_reg[t->tcnt] = count;
+		else
+			sim_reg[t->tcnt] = count;
+	}
+	if(addr == t->tifr)
+		read_flags(addr);
+}
+
+static void timer_write(uint8_t addr, uint8_t old)
+{
+	struct timer *t = timer_at(addr);
+
+	if(addr == t->tifr)
+		write_flags(addr, old);
+	/* Counting down in a phase correct mode, TCNT reads back other than
+	   the count, so only a change is taken as a write */
+	if((addr & ~t->wide) == t->tcnt && sim_reg[addr] != old) {
+		t->count = timer_value(t, t->tcnt);
+		t->synced = sim_cycles;
+	}
+	timer_schedule(t);
+}
+
+
+/* ADC */
+
+static void adc_start(void);
+
+static void adc_complete(void)
+{
+	uint16_t result = rover_adc(adc_channel) & 0x3FF;
+
+	if(ADMUX & _BV(ADLAR))
+		result <<= 6;
+	ADC = result;
+	ADCSRA |= _BV(ADIF);
+
+	/* Free-running mode retriggers straight away */
+	if((ADCSRA & _BV(ADATE)) && (ADCSRB & 0x07) == 0)
+		adc_start();
+	else
+		ADCSRA &= ~_BV(ADSC);
+}
+
+static void adc_start(void)
+{
+	static const uint8_t prescale[8] = { 2, 2, 4, 8, 16, 32, 64, 128 };
+
+	adc_channel = ADMUX & 0x07;
+	ADCSRA |= _BV(ADSC);
+	sim_schedule(SIM_EV_ADC, (uint64_t)prescale[ADCSRA & 0x07] * (adc_first ? 25 : 13), adc_complete);
+	adc_first = 0;
+}
+
+static void adc_control(uint8_t addr, uint8_t old)
+{
+	uint8_t value = ADCSRA;
+
+	/* Can't tell a read from writing back the same value, so take it as a read */
+	if(value == old)
+		return;
+
+	/* ADIF is cleared by writing a one, writing a zero leaves it */
+	if(value & _BV(ADIF))
+		value &= ~_BV(ADIF);
+	else
+		value |= old & _BV(ADIF);
+	ADCSRA = value;
+
+	if(!(value & _BV(ADEN))) {
+		cancel(SIM_EV_ADC);
+		ADCSRA &= ~_BV(ADSC);
+		adc_first = 1;
+	} else if((value & _BV(ADSC)) && event_time[SIM_EV_ADC] == SIM_NEVER) {
+		adc_start();
+	}
+}
+
+
+/* TWI */
+
+static uint64_t twi_scl(void)
+{
+	return 16 + 2 * (uint64_t)TWBR * (1 << (2 * twi.prescaler));
+}
+
+static uint64_t twi_remote_scl(void)
+{
+	return F_CPU / TWI_REMOTE_FREQ;
+}
+
+static void twi_view(void)
+{
+	TWCR = twi.control;
+	TWSR = twi.status | twi.prescaler;
+}
+
+static void twi_flag(uint8_t status)
+{
+	twi.status = status;
+	twi.control |= _BV(TWINT);
+	twi_view();
+}
+
+static void twi_trace(uint8_t byte)
+{
+	if(twi.trace_length < sizeof(twi.trace))
+		twi.trace[twi.trace_length++] = byte;
+}
+
+static void twi_trace_flush(void)
+{
+	uint8_t i;
+
+	if(sim_verbose && twi.trace_length) {
+		fprintf(stderr, "twi: %10.6f %c %02X:", SIM_SECONDS(sim_cycles),
+			(twi.trace[0] & TW_READ) ? 'R' : 'W', twi.trace[0] >> 1);
+		for(i = 1; i < twi.trace_length; i++)
+			fprintf(stderr, " %02x", twi.trace[i]);
+		fprintf(stderr, "\n");
+	}
+	twi.trace_length = 0;
+}
+
+static void twi_end_transfer(void)
+{
+	if(twi.device && twi.device->stop)
+		twi.device->stop();
+	twi.device = NULL;
+	twi_trace_flush();
+}
+
+static void twi_complete(void);
+static void twi_remote_next(void);
+
+static void twi_op(uint8_t op, uint64_t delay)
+{
+	twi.op = op;
+	sim_schedule(SIM_EV_TWI, delay, twi_complete);
+}
+
+static uint8_t twi_bus_idle(void)
+{
+	return !twi.master && !twi.remote && event_time[SIM_EV_TWI] == SIM_NEVER
+		&& event_time[SIM_EV_TWI_STOP] == SIM_NEVER;
+}
+
+static struct sim_twi_device *twi_find(uint8_t address)
+{
+	uint8_t i;
+
+	for(i = 0; i < TWI_DEVICES; i++) {
+		if(twi_devices[i] && twi_devices[i]->address == address)
+			return twi_devices[i];
+	}
+	return NULL;
+}
+
+static void twi_complete(void)
+{
+	struct sim_twi_transfer *remote = twi.remote;
+	uint8_t read;
+
+	switch(twi.op) {
+		case TWI_OP_START:
+			twi_end_transfer();
+			twi_flag(twi.master ? TW_REP_START : TW_START);
+			twi.master = 1;
+			break;
+		case TWI_OP_ADDRESS:
+			read = twi.byte & TW_READ;
+			twi_trace(twi.byte);
+			twi.device = twi_find(twi.byte >> 1);
+			if(twi.device && twi.device->start)
+				twi.device->start(read);
+			if(read)
+				twi_flag(twi.device ? TW_MR_SLA_ACK : TW_MR_SLA_NACK);
+			else
+				twi_flag(twi.device ? TW_MT_SLA_ACK : TW_MT_SLA_NACK);
+			break;
+		case TWI_OP_TRANSMIT:
+			twi_trace(twi.byte);
+			if(twi.device && twi.device->write(twi.byte))
+				twi_flag(TW_MT_DATA_ACK);
+			else
+				twi_flag(TW_MT_DATA_NACK);
+			break;
+		case TWI_OP_RECEIVE:
+			TWDR = twi.device ? twi.device->read(twi.control & _BV(TWEA)) : 0xFF;
+			twi_trace(TWDR);
+			twi_flag((twi.control & _BV(TWEA)) ? TW_MR_DATA_ACK : TW_MR_DATA_NACK);
+			break;
+		case TWI_OP_REMOTE_ADDRESS:
+			if(remote->read)
+				twi_flag(TW_ST_SLA_ACK);
+			else
+				twi_flag(remote->address == 0 ? TW_SR_GCALL_ACK : TW_SR_SLA_ACK);
+			break;
+		case TWI_OP_REMOTE_RECEIVE:
+			TWDR = remote->data[twi.index++];
+			if(remote->address == 0)
+				twi_flag((twi.control & _BV(TWEA)) ? TW_SR_GCALL_DATA_ACK : TW_SR_GCALL_DATA_NACK);
+			else
+				twi_flag((twi.control & _BV(TWEA)) ? TW_SR_DATA_ACK : TW_SR_DATA_NACK);
+			break;
+		case TWI_OP_REMOTE_TRANSMIT:
+			remote->data[twi.index++] = twi.byte;
+			if(twi.index < remote->length)
+				twi_flag((twi.control & _BV(TWEA)) ? TW_ST_DATA_ACK : TW_ST_LAST_DATA);
+			else
+				twi_flag(TW_ST_DATA_NACK);
+			break;
+		case TWI_OP_REMOTE_STOP:
+			twi_flag(TW_SR_STOP);
+			break;
+	}
+}
+
+static void twi_remote_done(uint8_t ok)
+{
+	struct sim_twi_transfer *remote = twi.remote;
+
+	twi.remote = NULL;
+	twi.status = TW_NO_INFO;
+	twi_view();
+	if(remote->done)
+		remote->done(remote, ok);
+	if(twi.start_pending) {
+		twi.start_pending = 0;
+		twi_op(TWI_OP_START, twi_scl());
+	} else {
+		twi_remote_next();
+	}
+}
+
+static void twi_remote_next(void)
+{
+	struct sim_twi_transfer *remote;
+	uint8_t listening, match;
+
+	while(twi_queued && twi_bus_idle()) {
+		remote = twi_queue[0];
+		memmove(twi_queue, twi_queue + 1, --twi_queued * sizeof(twi_queue[0]));
+
+		listening = (twi.control & _BV(TWEN)) && (twi.control & _BV(TWEA));
+		if(remote->address == 0)
+			match = TWAR & _BV(TWGCE);
+		else
+			match = (TWAR >> 1) == remote->address;
+		if(!listening || !match) {
+			if(remote->done)
+				remote->done(remote, 0);
+			continue;
+		}
+		twi.remote = remote;
+		twi.index = 0;
+		twi_op(TWI_OP_REMOTE_ADDRESS, 10 * twi_remote_scl());
+	}
+}
+
+void sim_twi_attach(struct sim_twi_device *device)
+{
+	uint8_t i;
+
+	for(i = 0; i < TWI_DEVICES; i++) {
+		if(!twi_devices[i]) {
+			twi_devices[i] = device;
+			return;
+		}
+	}
+}
+
+void sim_twi_inject(struct sim_twi_transfer *transfer)
+{
+	if(twi_queued == TWI_QUEUE) {
+		if(transfer->done)
+			transfer->done(transfer, 0);
+		return;
+	}
+	twi_queue[twi_queued++] = transfer;
+	twi_remote_next();
+}
+
+static void twi_stopped(void)
+{
+	twi.control &= ~_BV(TWSTO);
+	twi.master = 0;
+	twi_view();
+	if(twi.start_pending) {
+		twi.start_pending = 0;
+		twi_op(TWI_OP_START, twi_scl());
+	} else {
+		twi_remote_next();
+	}
+}
+
+static void twi_read_control(uint8_t addr)
+{
+	TWCR = twi.control | TWCR_MARKER;
+}
+
+static void twi_write_control(uint8_t addr, uint8_t old)
+{
+	uint8_t value = TWCR;
+	uint8_t clear = value & _BV(TWINT);
+
+	if(value & TWCR_MARKER) {
+		twi_view();
+		return;
+	}
+
+	twi.control = (value & ~_BV(TWINT)) | (clear ? 0 : (twi.control & _BV(TWINT)));
+	twi_view();
+
+	if(!(value & _BV(TWEN))) {
+		cancel(SIM_EV_TWI);
+		cancel(SIM_EV_TWI_STOP);
+		twi_end_transfer();
+		twi.master = 0;
+		twi.remote = NULL;
+		twi.status = TW_NO_INFO;
+		twi_view();
+		return;
+	}
+	if(!clear)
+		return;
+
+	if(value & _BV(TWSTO)) {
+		if(twi.master)
+			twi_end_transfer();
+		twi.status = TW_NO_INFO;
+		twi.start_pending = (value & _BV(TWSTA)) != 0;
+		twi_view();
+		sim_schedule(SIM_EV_TWI_STOP, twi_scl(), twi_stopped);
+		return;
+	}
+	if(value & _BV(TWSTA)) {
+		if(twi.remote)
+			twi.start_pending = 1;
+		else
+			twi_op(TWI_OP_START, twi_scl());
+		return;
+	}
+
+	twi.byte = TWDR;
+	switch(twi.status) {
+		case TW_START:
+		case TW_REP_START:
+			twi_op(TWI_OP_ADDRESS, 9 * twi_scl());
+			break;
+		case TW_MT_SLA_ACK:
+		case TW_MT_DATA_ACK:
+			twi_op(TWI_OP_TRANSMIT, 9 * twi_scl());
+			break;
+		case TW_MR_SLA_ACK:
+		case TW_MR_DATA_ACK:
+			twi_op(TWI_OP_RECEIVE, 9 * twi_scl());
+			break;
+		case TW_SR_SLA_ACK:
+		case TW_SR_GCALL_ACK:
+		case TW_SR_DATA_ACK:
+		case TW_SR_GCALL_DATA_ACK:
+			if(twi.index < twi.remote->length)
+				twi_op(TWI_OP_REMOTE_RECEIVE, 9 * twi_remote_scl());
+			else
+				twi_op(TWI_OP_REMOTE_STOP, twi_remote_scl());
+			break;
+		case TW_ST_SLA_ACK:
+		case TW_ST_DATA_ACK:
+			twi_op(TWI_OP_REMOTE_TRANSMIT, 9 * twi_remote_scl());
+			break;
+		case TW_SR_STOP:
+		case TW_ST_DATA_NACK:
+		case TW_ST_LAST_DATA:
+			twi_remote_done(1);
+			break;
+		case TW_SR_DATA_NACK:
+		case TW_SR_GCALL_DATA_NACK:
+			twi_remote_done(0);
+			break;
+		default:
+			/* Waiting for a start or stop after a nack */
+			twi.status = TW_NO_INFO;
+			twi_view();
+			break;
+	}
+}
+
+static void twi_read_status(uint8_t addr)
+{
+	twi_view();
+}
+
+static void twi_write_status(uint8_t addr, uint8_t old)
+{
+	twi.prescaler = TWSR & 0x03;
+	twi_view();
+}
+
+
+/* USART0 transmitter */
+
+static uint64_t usart_frame(void)
+{
+	uint16_t ubrr = UBRR0L | ((UBRR0H & 0x0F) << 8);
+
+	return 10ULL * (ubrr + 1) * ((UCSR0A & _BV(U2X0)) ? 8 : 16);
+}
+
+static void usart_sent(void)
+{
+	putchar(usart.shift);
+	if(usart.full) {
+		usart.shift = usart.buffer;
+		usart.full = 0;
+		UCSR0A |= _BV(UDRE0);
+		sim_schedule(SIM_EV_USART, usart_frame(), usart_sent);
+	} else {
+		usart.busy = 0;
+		UCSR0A |= _BV(TXC0);
+	}
+}
+
+/* The receiver isn't modelled, so UDR0 is only ever read in USART0_RX_vect */
+static void usart_data(uint8_t addr, uint8_t old)
+{
+	if(current_vector == SIM_USART0_RX || !(UCSR0B & _BV(TXEN0)))
+		return;
+	if(!usart.busy) {
+		usart.shift = UDR0;
+		usart.busy = 1;
+		sim_schedule(SIM_EV_USART, usart_frame(), usart_sent);
+	} else {
+		usart.buffer = UDR0;
+		usart.full = 1;
+		UCSR0A &= ~_BV(UDRE0);
+	}
+}
+
+static void usart_status(uint8_t addr, uint8_t old)
+{
+	uint8_t value = UCSR0A;
+	uint8_t flags = _BV(RXC0) | _BV(UDRE0) | _BV(FE0) | _BV(DOR0) | _BV(UPE0);
+
+	if(value == old)
+		return;
+	UCSR0A = (old & flags) | (value & (_BV(U2X0) | _BV(MPCM0)))
+		| (old & _BV(TXC0) & ~value);
+}
+
+
+/* EEPROM */
+
+static void eeprom_written(void)
+{
+	eeprom[eeprom_address & E2END] = eeprom_data;
+	EECR &= ~_BV(EEPE);
+}
+
+/* Writes start when EEPE is set with EEMPE still set from the write before */
+static void eeprom_control(uint8_t addr, uint8_t old)
+{
+	uint8_t value = EECR;
+	uint8_t busy = event_time[SIM_EV_EEPROM] != SIM_NEVER;
+
+	if(!busy && (value & _BV(EEPE)) && (old & _BV(EEMPE))) {
+		eeprom_address = EEAR;
+		eeprom_data = EEDR;
+		sim_schedule(SIM_EV_EEPROM, SIM_US(EEPROM_WRITE_US), eeprom_written);
+		busy = 1;
+	}
+	value = (value & ~_BV(EEPE)) | (busy ? _BV(EEPE) : 0);
+	if(value & _BV(EERE)) {
+		if(!busy)
+			EEDR = eeprom[EEAR & E2END];
+		value &= ~_BV(EERE);
+	}
+	if(old & _BV(EEMPE))
+		value &= ~_BV(EEMPE); /* Holds for four cycles, here until the next write */
+	EECR = value;
+}
+
+/* The library functions wait for a write EECR started, like avr-libc's */
+static void eeprom_busy(void)
+{
+	commit();
+	if(event_time[SIM_EV_EEPROM] != SIM_NEVER)
+		sim_delay(event_time[SIM_EV_EEPROM] - sim_cycles);
+}
+
+uint8_t eeprom_read_byte(const uint8_t *addr)
+{
+	eeprom_busy();
+	return eeprom[(uintptr_t)addr & E2END];
+}
+
+uint16_t eeprom_read_word(const uint16_t *addr)
+{
+	uint16_t value;
+
+	eeprom_read_block(&value, addr, sizeof(value));
+	return value;
+}
+
+void eeprom_read_block(void *dst, const void *src, size_t n)
+{
+	uint8_t *d = dst;
+	uintptr_t a = (uintptr_t)src;
+
+	eeprom_busy();
+	while(n--)
+		*d++ = eeprom[a++ & E2END];
+}
+
+void eeprom_write_byte(uint8_t *addr, uint8_t value)
+{
+	eeprom_busy();
+	eeprom[(uintptr_t)addr & E2END] = value;
+	sim_delay(SIM_US(EEPROM_WRITE_US));
+}
+
+void eeprom_write_word(uint16_t *addr, uint16_t value)
+{
+	eeprom_write_block(&value, addr, sizeof(value));
+}
+
+void eeprom_write_block(const void *src, void *dst, size_t n)
+{
+	const uint8_t *s = src;
+	uintptr_t a = (uintptr_t)dst;
+
+	while(n--)
+		eeprom_write_byte((uint8_t *)a++, *s++);
+}
+
+void eeprom_update_byte(uint8_t *addr, uint8_t value)
+{
+	if(eeprom_read_byte(addr) != value)
+		eeprom_write_byte(addr, value);
+}
+
+void eeprom_update_block(const void *src, void *dst, size_t n)
+{
+	const uint8_t *s = src;
+	uintptr_t a = (uintptr_t)dst;
+
+	while(n--)
+		eeprom_update_byte((uint8_t *)a++, *s++);
+}
+
+int eeprom_is_ready(void)
+{
+	return 1;
+}
+
+
+/* avr-libc number conversions (int is 16 bits on the AVR) */
+
+char *ultoa(unsigned long value, char *s, int radix)
+{
+	char digits[33];
+	char *p = digits;
+	char *d = s;
+
+	do {
+		*p++ = "0123456789abcdefghijklmnopqrstuvwxyz"[value % radix];
+		value /= radix;
+	} while(value);
+	while(p > digits)
+		*d++ = *--p;
+	*d = '\0';
+	return s;
+}
+
+char *ltoa(long value, char *s, int radix)
+{
+	if(value < 0 && radix == 10) {
+		s[0] = '-';
+		ultoa(-(unsigned long)value, s + 1, radix);
+		return s;
+	}
+	return ultoa((unsigned long)value, s, radix);
+}
+
+char *itoa(int value, char *s, int radix)
+{
+	if(radix == 10)
+		return ltoa((int16_t)value, s, radix);
+	return ultoa((uint16_t)value, s, radix);
+}
+
+char *utoa(unsigned int value, char *s, int radix)
+{
+	return ultoa((uint16_t)value, s, radix);
+}
+
+
+/* Reset, report and main */
+
+static void reset(void)
+{
+	uint8_t i;
+
+	memset(sim_reg, 0, sizeof(sim_reg));
+	memset(eeprom, 0xFF, sizeof(eeprom));
+	for(i = 0; i < SIM_EVENTS; i++)
+		event_time[i] = SIM_NEVER;
+
+	UCSR0A = _BV(UDRE0);
+	UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);
+	TWDR = 0xFF;
+	twi.status = TW_NO_INFO;
+	twi_view();
+	adc_first = 1;
+
+	for(i = 0; i < 4; i++)
+		io_read[ADDR(PINA) + 3 * i] = read_pin;
+	io_read[ADDR(EIFR)] = io_read[ADDR(PCIFR)] = read_flags;
+	io_write[ADDR(EIFR)] = io_write[ADDR(PCIFR)] = write_flags;
+	for(i = 0; i < 0xFF; i++) {
+		if(timer_at(i)) {
+			io_read[i] = timer_read;
+			io_write[i] = timer_write;
+		}
+	}
+	io_write[ADDR(ADCSRA)] = adc_control;
+	io_read[ADDR(TWCR)] = twi_read_control;
+	io_write[ADDR(TWCR)] = twi_write_control;
+	io_read[ADDR(TWSR)] = twi_read_status;
+	io_write[ADDR(TWSR)] = twi_write_status;
+	io_write[ADDR(UDR0)] = usart_data;
+	io_write[ADDR(UCSR0A)] = usart_status;
+	io_write[ADDR(EECR)] = eeprom_control;
+}
+
+static int report(void)
+{
+	uint8_t i;
+
+	fflush(stdout);
+	fprintf(stderr, "sim: %.6f s simulated, %.1f%% spinning\n",
+		SIM_SECONDS(sim_cycles), sim_cycles ? 100.0 * spin_cycles / sim_cycles : 0.0);
+	fprintf(stderr, "sim: %-18s %10s %12s %7s %6s\n", "vector", "calls", "cycles", "max", "cpu");
+	for(i = 1; i < SIM_VECTORS; i++) {
+		if(!vectors[i].count)
+			continue;
+		fprintf(stderr, "sim: %-18s %10u %12llu %7llu %5.1f%%\n", vectors[i].name,
+			vectors[i].count, (unsigned long long)vectors[i].cycles,
+			(unsigned long long)vectors[i].max, 100.0 * vectors[i].cycles / sim_cycles);
+	}
+	return rover_report();
+}
+
+void sim_halt(void)
+{
+	static uint8_t halting;
+	FILE *f;
+	int failed;
+
+	commit();
+	// HAL_HALT's loop on the AVR still takes interrupts: let the serial port drain
+	if(!halting) {
+		halting = 1;
+		while((SREG & _BV(SREG_I)) && ((UCSR0B & _BV(UDRIE0)) || (EECR & _BV(EERIE))))
+			sim_spin();
+	}
+	failed = report();
+	if(eeprom_file) {
+		f = fopen(eeprom_file, "wb");
+		if(f) {
+			fwrite(eeprom, 1, sizeof(eeprom), f);
+			fclose(f);
+		} else {
+			perror(eeprom_file);
+		}
+	}
+	exit(failed ? 1 : 0);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-t seconds] [-e eeprom.bin] [-p A3] [-v]\n"
+		"  -t  stop after this much simulated time (default 60)\n"
+		"  -e  load the EEPROM from this file if it exists, save it back at the end\n"
+		"  -p  drive an input pin high, e.g. -p A3 turns on EEPROM logging\n"
+		"  -v  trace TWI transfers\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	reset();
+	while((c = getopt(argc, argv, "t:e:p:vh")) != -1) {
+		switch(c) {
+			case 't':
+				limit = (uint64_t)(atof(optarg) * F_CPU);
+				break;
+			case 'e':
+				eeprom_file = optarg;
+				break;
+			case 'p':
+				if(optarg[0] < 'A' || optarg[0] > 'D' || optarg[1] < '0' || optarg[1] > '7')
+					usage(argv[0]);
+				sim_pin(optarg[0] - 'A', optarg[1] - '0', 1);
+				break;
+			case 'v':
+				sim_verbose = 1;
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if(eeprom_file) {
+		FILE *f = fopen(eeprom_file, "rb");
+		if(f) {
+			if(fread(eeprom, 1, sizeof(eeprom), f) != sizeof(eeprom))
+				fprintf(stderr, "sim: %s is short, the rest of the EEPROM is erased\n", eeprom_file);
+			fclose(f);
+		}
+	}
+
+	rover_init();
+	firmware_main();
+	sim_halt();
+}
@@ -0,0 +1,119 @@
+#ifndef SIM_H
+#define SIM_H
+
+/*
+	Simulated AVR for the host build.
+
+	The simulator is a discrete-event model driven by the firmware itself:
+	every register access costs SIM_IO_CYCLES, _delay_ms() and HAL_SPIN()
+	skip the clock forward, and peripherals (ADC, TWI, USART, the plant in
+	rover.c) schedule events on the same clock. Interrupts are taken at
+	register accesses, so ISRs interleave with the firmware at the same
+	points they could on the target. Plain C between register accesses is
+	free, so cycle figures are a lower bound, not an exact count.
+*/
+
+#include <stdint.h>
+
+#define SIM_IO_CYCLES 2 /* lds/sts */
+#define SIM_ISR_ENTRY 24 /* vector jump + SIGNAL prologue */
+#define SIM_ISR_EXIT 20 /* SIGNAL epilogue + reti */
+
+#define SIM_NEVER UINT64_MAX
+#define SIM_US(us) ((uint64_t)(us) * (F_CPU / 1000000UL))
+#define SIM_MS(ms) ((uint64_t)(ms) * (F_CPU / 1000UL))
+#define SIM_SECONDS(cycles) ((double)(cycles) / F_CPU)
+
+/* Interrupt vectors, numbered as in the atmega644 table (lower wins) */
+enum {
+	SIM_INT0 = 1,
+	SIM_INT1,
+	SIM_INT2,
+	SIM_PCINT0,
+	SIM_PCINT1,
+	SIM_PCINT2,
+	SIM_PCINT3,
+	SIM_WDT,
+	SIM_TIMER2_COMPA,
+	SIM_TIMER2_COMPB,
+	SIM_TIMER2_OVF,
+	SIM_TIMER1_CAPT,
+	SIM_TIMER1_COMPA,
+	SIM_TIMER1_COMPB,
+	SIM_TIMER1_OVF,
+	SIM_TIMER0_COMPA,
+	SIM_TIMER0_COMPB,
+	SIM_TIMER0_OVF,
+	SIM_SPI_STC,
+	SIM_USART0_RX,
+	SIM_USART0_UDRE,
+	SIM_USART0_TX,
+	SIM_ANALOG_COMP,
+	SIM_ADC,
+	SIM_EE_READY,
+	SIM_TWI,
+	SIM_SPM_READY,
+	SIM_VECTORS
+};
+
+/* Scheduled events, one outstanding per source */
+enum {
+	SIM_EV_ADC,
+	SIM_EV_TWI,
+	SIM_EV_TWI_STOP,
+	SIM_EV_USART,
+	SIM_EV_EEPROM,
+	SIM_EV_ROVER,
+	SIM_EV_REMOTE,
+	SIM_EV_TIMER0,
+	SIM_EV_TIMER1,
+	SIM_EV_TIMER2,
+	SIM_EVENTS
+};
+
+/* Ports for sim_pin() */
+#define SIM_PORTA 0
+#define SIM_PORTB 1
+#define SIM_PORTC 2
+#define SIM_PORTD 3
+
+extern uint64_t sim_cycles;
+extern uint8_t sim_verbose;
+
+void sim_sei(void);
+void sim_cli(void);
+void sim_delay(uint64_t cycles);
+void sim_spin(void);
+void sim_halt(void) __attribute__((noreturn));
+
+void sim_schedule(uint8_t event, uint64_t delay, void (*fire)(void));
+void sim_pin(uint8_t port, uint8_t bit, uint8_t level);
+
+/* A device on the bus that the firmware addresses as TWI master */
+struct sim_twi_device {
+	uint8_t address;
+	void (*start)(uint8_t read);
+	uint8_t (*write)(uint8_t data); /* returns 1 to ack */
+	uint8_t (*read)(uint8_t ack);
+	void (*stop)(void);
+};
+
+void sim_twi_attach(struct sim_twi_device *device);
+
+/* A transfer from a remote bus master that addresses the firmware as slave */
+struct sim_twi_transfer {
+	uint8_t address;
+	uint8_t read;
+	uint8_t length;
+	uint8_t data[32];
+	void (*done)(struct sim_twi_transfer *transfer, uint8_t ok);
+};
+
+void sim_twi_inject(struct sim_twi_transfer *transfer);
+
+/* The plant the firmware drives, supplied by rover.c */
+void rover_init(void);
+uint16_t rover_adc(uint8_t channel);
+int rover_report(void); /* nonzero if a check on the firmware failed */
+
+#endif /* end of include guard: SIM_H */
@@ -0,0 +1,13 @@
+#ifndef HOST_STDLIB_H
+#define HOST_STDLIB_H
+
+/* The C library's <stdlib.h> plus the avr-libc number conversions, implemented in sim.c */
+
+#include_next <stdlib.h>
+
+char *itoa(int value, char *s, int radix);
+char *utoa(unsigned int value, char *s, int radix);
+char *ltoa(long value, char *s, int radix);
+char *ultoa(unsigned long value, char *s, int radix);
+
+#endif /* end of include guard: HOST_STDLIB_H */
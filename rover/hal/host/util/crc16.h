@@ -0,0 +1,29 @@
+#ifndef _UTIL_CRC16_H_
+#define _UTIL_CRC16_H_
+
+/*
+	Host stand-in for <util/crc16.h>, just the CRCs the firmware uses.
+	Same results as avr-libc's versions, in plain C.
+*/
+
+#include <stdint.h>
+
+/* CRC-8, polynomial 0x07, initial value 0 */
+static inline uint8_t _crc8_ccitt_update(uint8_t crc, uint8_t data)
+{
+	crc ^= data;
+	for(uint8_t i = 0; i < 8; i++)
+		crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+	return crc;
+}
+
+/* CRC-CCITT, polynomial 0x1021 bit reversed (0x8408), usually from 0xFFFF */
+static inline uint16_t _crc_ccitt_update(uint16_t crc, uint8_t data)
+{
+	crc ^= data;
+	for(uint8_t i = 0; i < 8; i++)
+		crc = (crc & 1) ? (crc >> 1) ^ 0x8408 : crc >> 1;
+	return crc;
+}
+
+#endif /* _UTIL_CRC16_H_ */
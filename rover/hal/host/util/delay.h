@@ -0,0 +1,21 @@
+#ifndef _UTIL_DELAY_H_
+#define _UTIL_DELAY_H_
+
+/*
+	Host stand-in for <util/delay.h>. Delays advance the simulated clock
+	by the same number of cycles the busy loop would burn on the AVR;
+	interrupts taken meanwhile stretch the delay, as they do on the target.
+*/
+
+#include <stdint.h>
+
+#ifndef F_CPU
+#define F_CPU 1000000UL
+#endif
+
+void sim_delay(uint64_t cycles);
+
+#define _delay_ms(ms) sim_delay((uint64_t)((double)(ms) * (F_CPU / 1000.0)))
+#define _delay_us(us) sim_delay((uint64_t)((double)(us) * (F_CPU / 1000000.0)))
+
+#endif /* _UTIL_DELAY_H_ */
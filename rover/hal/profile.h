@@ -0,0 +1,164 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/*
+	CPU time accounting for the ISRs and the slow parts of the main loop.
+
+	Main-loop spans and the report are timed against a free-running timer
+	at clk / 64: Timer1 on the atmega644 master (already free-running for
+	the encoder edge stamps), Timer2 on the atmega168 slave (also stepping
+	the PWM ramps). Its overflow interrupt extends the count.
+
+	That's too coarse for ISRs, which mostly take under 64 cycles, and the
+	periodic ones run in step with it, so they'd read the same count at
+	both ends every time. ISRs are timed to the cycle against Timer0,
+	which both firmwares run at clock speed for PWM: fast PWM to 0xFF on
+	the master, so it simply wraps every 256 cycles, phase correct on the
+	slave, where it counts up to 0xFF and back down every 510 cycles and
+	two reads tell which way it's going. The clk / 64 count says how many
+	of those periods went by.
+
+	Each slot keeps an entry count, total time and worst case. ISRs are
+	timed from the first to the last line of the handler, so the vector
+	prologue and epilogue (~20 cycles each) aren't included. Main-loop spans
+	have the ISR time that ran inside them taken out, so idle is time the
+	main loop really had nothing to do.
+
+	Build with PROFILE=0 to leave it all out.
+*/
+
+#include <stdint.h>
+#include <avr/io.h>
+
+#ifndef PROFILE_ENABLED
+#define PROFILE_ENABLED 0
+#endif
+
+/* Slots, shared by both firmwares so reports line up */
+#define PROFILE_TICK 0		/* control tick, or the slave's PWM ramps, TIMER2_COMPA_vect */
+#define PROFILE_PCINT 1		/* encoder pin changes, PCINT3_vect */
+#define PROFILE_INT0 2
+#define PROFILE_INT1 3
+#define PROFILE_ADC 4
+#define PROFILE_TWI 5
+#define PROFILE_UART_RX 6
+#define PROFILE_UART_TX 7
+#define PROFILE_EEPROM 8	/* EEPROM log writes, EE_READY_vect */
+#define PROFILE_IDLE 9		/* main loop with nothing to do */
+#define PROFILE_SLOTS 10
+#define PROFILE_SPAN(slot) ((slot) >= PROFILE_IDLE) /* timed by profile_end(), not an ISR */
+
+#if(PROFILE_ENABLED)
+
+#define PROFILE_CYCLES 64U /* CPU cycles per timer count */
+
+#if defined(__AVR_ATmega168__)
+#define PROFILE_TCNT TCNT2
+#define PROFILE_TIFR TIFR2
+#define PROFILE_TOV TOV2
+#define PROFILE_OVF_vect TIMER2_OVF_vect
+#define PROFILE_BITS 8
+#define PROFILE_CYCLE_PERIOD 510 /* Timer0, phase correct to 0xFF */
+typedef uint8_t profile_count_t;
+
+/* Where Timer0 is in its up and down period, going down if a second read is
+   lower; a cycle or two out right at the turn */
+static inline uint16_t profile_cycle(void) {
+	uint8_t first = TCNT0, second = TCNT0;
+
+	if(second > first || (second == first && second < 0x80))
+		return second;
+	return PROFILE_CYCLE_PERIOD - second;
+}
+#else
+#define PROFILE_TCNT TCNT1
+#define PROFILE_TIFR TIFR1
+#define PROFILE_TOV TOV1
+#define PROFILE_OVF_vect TIMER1_OVF_vect
+#define PROFILE_BITS 16
+#define PROFILE_CYCLE_PERIOD 256 /* Timer0, fast PWM to 0xFF */
+typedef uint16_t profile_count_t;
+
+static inline uint16_t profile_cycle(void) {
+	return TCNT0;
+}
+#endif
+
+struct profile_slot {
+	uint32_t count;
+	uint32_t time; /* CPU cycles for ISRs, timer counts for main-loop spans */
+	uint32_t worst; /* the same */
+};
+
+/* Start of an ISR */
+struct profile_stamp {
+	uint16_t cycle;
+	profile_count_t count;
+};
+
+/* Start of a main-loop span */
+struct profile_mark {
+	uint32_t start;
+	uint32_t isr;
+};
+
+extern volatile struct profile_slot profile_slots[PROFILE_SLOTS];
+extern volatile uint32_t profile_isr_time; /* cycles spent in timed ISRs */
+
+void profile_init(void);
+uint32_t profile_now(void);
+void profile_begin(struct profile_mark *mark);
+void profile_end(struct profile_mark *mark, uint8_t slot);
+void profile_idle(void);
+void profile_busy(void);
+void profile_report(void (*put)(const char *line));
+
+/* Read both timers, Timer0 first, the same way at both ends of an ISR */
+static inline void profile_stamp(struct profile_stamp *stamp) {
+	stamp->cycle = profile_cycle();
+	stamp->count = PROFILE_TCNT;
+}
+
+/* Account an ISR; start was stamped at the top of the handler */
+static inline void profile_isr(uint8_t slot, const struct profile_stamp *start) {
+	volatile struct profile_slot *s = &profile_slots[slot];
+	struct profile_stamp now;
+	uint16_t coarse, spent;
+
+	profile_stamp(&now);
+	coarse = (profile_count_t)(now.count - start->count) * PROFILE_CYCLES;
+	spent = now.cycle - start->cycle;
+
+	// Timer0 gives the cycles modulo its period; the clk / 64 count,
+	// within a count either way, says which multiple of it to add
+	if(now.cycle < start->cycle)
+		spent += PROFILE_CYCLE_PERIOD;
+	while(spent + PROFILE_CYCLE_PERIOD / 2 < coarse)
+		spent += PROFILE_CYCLE_PERIOD;
+
+	s->count++;
+	s->time += spent;
+	if(spent > s->worst)
+		s->worst = spent;
+	profile_isr_time += spent;
+}
+
+#define PROFILE_ISR_START() struct profile_stamp profile_start; profile_stamp(&profile_start)
+#define PROFILE_ISR_STOP(slot) profile_isr(slot, &profile_start)
+#define PROFILE_BEGIN(mark) struct profile_mark mark; profile_begin(&mark)
+#define PROFILE_END(mark, slot) profile_end(&mark, slot)
+#define PROFILE_IDLE_ENTER() profile_idle()
+#define PROFILE_IDLE_LEAVE() profile_busy()
+
+#else
+
+#define PROFILE_ISR_START()
+#define PROFILE_ISR_STOP(slot)
+#define PROFILE_BEGIN(mark)
+#define PROFILE_END(mark, slot)
+#define PROFILE_IDLE_ENTER()
+#define PROFILE_IDLE_LEAVE()
+
+#endif
+
+#endif /* end of include guard: PROFILE_H */
@@ -0,0 +1,158 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <string.h>
+#include "eelog.h"
+#include "hal.h"
+
+static uint8_t eelog_queue[EELOG_QUEUE];
+static volatile uint8_t eelog_head; /* Next byte queued goes here */
+static volatile uint8_t eelog_tail; /* Next byte to write */
+static volatile uint16_t eelog_count; /* Bytes queued, 0 .. EELOG_QUEUE */
+static volatile uint16_t eelog_address; /* EEPROM address of the byte at eelog_tail */
+static uint16_t eelog_limit; /* End of the log area */
+static uint8_t eelog_marked; /* The last byte queued or written is EELOG_MARK */
+static volatile uint16_t eelog_drops;
+
+static const uint8_t eelog_mark = EELOG_MARK;
+
+/* Start the log at start; it stops short of end */
+void eelog_init(uint16_t start, uint16_t end) {
+	eelog_head = eelog_tail = 0;
+	eelog_count = 0;
+	eelog_address = start;
+	eelog_limit = end;
+	eelog_marked = 0;
+	eelog_drops = 0;
+}
+
+/* Copy into the queue in two runs either side of the wrap; interrupts off */
+static void eelog_push(const uint8_t *bytes, uint8_t length) {
+	uint8_t first = (length < EELOG_QUEUE - eelog_head)? length : EELOG_QUEUE - eelog_head;
+
+	memcpy(eelog_queue + eelog_head, bytes, first);
+	memcpy(eelog_queue, bytes + first, length - first);
+	eelog_head = (eelog_head + length) & (EELOG_QUEUE - 1);
+	eelog_count += length;
+}
+
+/* Start writing the next byte queued, or stop EE_READY_vect if there's none */
+static void eelog_next(void) {
+	if(!eelog_count) {
+		EECR &= ~_BV(EERIE);
+	} else {
+		EEAR = eelog_address++;
+		EEDR = eelog_queue[eelog_tail];
+		eelog_tail = (eelog_tail + 1) & (EELOG_QUEUE - 1);
+		eelog_count--;
+		EECR |= _BV(EEMPE);
+		EECR |= _BV(EEPE);
+	}
+}
+
+/* With interrupts off, do EE_READY_vect's job by polling EEPE */
+static void eelog_poll(void) {
+	if(EECR & _BV(EEPE))
+		HAL_SPIN();
+	else
+		eelog_next();
+}
+
+/*
+	Queue a record for EEPROM. Returns 0 if it's queued, 1 if it was
+	dropped: it would run past the end of the log, or the queue is full
+	and wait is 0. Waiting with interrupts off, from a handler, writes the
+	queue out by polling.
+*/
+uint8_t eelog_write(const void *data, uint8_t length, uint8_t wait) {
+	uint8_t sreg, queued;
+
+	while(1) {
+		sreg = SREG;
+		cli();
+		// The mark after the last record gives way to this one, and it
+		// only takes a queue slot while it's still waiting to be written
+		queued = eelog_count - (eelog_marked && eelog_count);
+		if(eelog_address + eelog_count - eelog_marked + length + 1 > eelog_limit) {
+			eelog_drops++;
+			SREG = sreg;
+			return 1;
+		}
+		if(queued + length + 1 <= EELOG_QUEUE)
+			break;
+		if(!wait) {
+			eelog_drops++;
+			SREG = sreg;
+			return 1;
+		}
+		SREG = sreg;
+		if(sreg & _BV(SREG_I))
+			HAL_SPIN();
+		else
+			eelog_poll();
+	}
+
+	if(eelog_marked) {
+		if(eelog_count) {
+			eelog_head = (eelog_head - 1) & (EELOG_QUEUE - 1);
+			eelog_count--;
+		} else {
+			eelog_address--;
+		}
+	}
+	eelog_push(data, length);
+	eelog_push(&eelog_mark, 1);
+	eelog_marked = 1;
+	EECR |= _BV(EERIE);
+	SREG = sreg;
+	return 0;
+}
+
+/* Bytes still to be written */
+uint16_t eelog_pending(void) {
+	uint8_t sreg = SREG;
+	uint16_t count;
+
+	cli();
+	count = eelog_count;
+	SREG = sreg;
+	return count;
+}
+
+/* Wait until everything queued is in EEPROM, polling if interrupts are off */
+void eelog_flush(void) {
+	while(eelog_count || (EECR & _BV(EEPE))) {
+		if(SREG & _BV(SREG_I))
+			HAL_SPIN();
+		else
+			eelog_poll();
+	}
+}
+
+/* Records dropped so far */
+uint16_t eelog_dropped(void) {
+	uint8_t sreg = SREG;
+	uint16_t drops;
+
+	cli();
+	drops = eelog_drops;
+	SREG = sreg;
+	return drops;
+}
+
+/* EEPROM address the records reach once the queue is written, the mark not counted */
+uint16_t eelog_end(void) {
+	uint8_t sreg = SREG;
+	uint16_t end;
+
+	cli();
+	end = eelog_address + eelog_count - eelog_marked;
+	SREG = sreg;
+	return end;
+}
+
+/* EEPROM ready for a byte: write the next one queued, or stop when there's none */
+SIGNAL(EE_READY_vect) {
+	PROFILE_ISR_START();
+	eelog_next();
+	PROFILE_ISR_STOP(PROFILE_EEPROM);
+}
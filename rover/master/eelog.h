@@ -0,0 +1,31 @@
+#ifndef EELOG_H
+#define EELOG_H
+
+#include <inttypes.h>
+
+/*
+	Background EEPROM log. eelog_write() copies a record into an SRAM
+	queue and returns; EE_READY_vect writes the queue out a byte at a time,
+	3.3 ms each, while the control tick carries on undisturbed. A record
+	that doesn't fit in the queue or in what's left of the log area is
+	dropped whole and counted, so the log never holds half a record.
+	An EELOG_MARK byte follows the last record, so a dump shows where
+	this run's log stops even over an older one. With interrupts off, as
+	in a handler that never returns, writing and flushing poll instead.
+*/
+
+#ifndef EELOG_QUEUE
+#define EELOG_QUEUE 256 /* Bytes, a power of 2 up to 256 */
+#endif
+
+#define EELOG_MARK 0xFF /* After the last record, as erased EEPROM reads */
+#define EELOG_WAIT 1 /* Wait for room in the queue instead of dropping */
+
+void eelog_init(uint16_t start, uint16_t end);
+uint8_t eelog_write(const void *data, uint8_t length, uint8_t wait);
+uint16_t eelog_pending(void);
+void eelog_flush(void);
+uint16_t eelog_dropped(void);
+uint16_t eelog_end(void);
+
+#endif /* end of include guard: EELOG_H */
@@ -0,0 +1,134 @@
+/*
+	Turn a dump of the master's EEPROM log back into CSV, one row per
+	value: time in seconds, event, field, value. Text records go in the
+	value column, quoted. Flight recorder samples get the time they were
+	taken and their values as they were, but come newest first. Built for
+	the host with make logdecode.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logevents.h"
+
+#define LOG_NAME(id, name, fields) name,
+#define LOG_FIELDS(id, name, fields) fields,
+static const char *event_names[] = { LOG_EVENTS(LOG_NAME) };
+static const char *event_fields[] = { LOG_EVENTS(LOG_FIELDS) };
+static const char *track_names[] = { LOG_TRACKS };
+
+static unsigned char dump[65536];
+static size_t size, at;
+
+/* Read a varint at the cursor; returns 0 if the dump ends inside it */
+static int varint(unsigned long *value) {
+	unsigned shift = 0;
+
+	*value = 0;
+	while(at < size && shift < 35) {
+		*value |= (unsigned long)(dump[at] & 0x7F) << shift;
+		shift += 7;
+		if(!(dump[at++] & 0x80))
+			return 1;
+	}
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct log_header header;
+	unsigned long delta, value, length;
+	long flight[LOG_VALUES] = { 0 }, values[LOG_VALUES];
+	double seconds = 0, flight_time = 0, flight_step = 0, when;
+	unsigned i;
+	const char *field, *end;
+	unsigned event;
+	FILE *f;
+
+	if(argc != 2) {
+		fprintf(stderr, "usage: %s eeprom.bin > run.csv\n", argv[0]);
+		return 2;
+	}
+	if(!(f = fopen(argv[1], "rb"))) {
+		perror(argv[1]);
+		return 1;
+	}
+	size = fread(dump, 1, sizeof(dump), f);
+	fclose(f);
+
+	if(size < sizeof(header)) {
+		fprintf(stderr, "%s: too short for a log header\n", argv[1]);
+		return 1;
+	}
+	memcpy(&header, dump, sizeof(header));
+	if(header.magic != LOG_MAGIC || header.version != LOG_VERSION || !header.tick_hz) {
+		fprintf(stderr, "%s: no version %d log here\n", argv[1], LOG_VERSION);
+		return 1;
+	}
+	at = sizeof(header);
+
+	printf("# built %.*s, options 0x%02x, track %s, %u ticks/s\n",
+		(int)sizeof(header.built), header.built, header.options,
+		(header.track < sizeof(track_names) / sizeof(track_names[0]))? track_names[header.track] : "?",
+		header.tick_hz);
+	printf("time,event,field,value\n");
+
+	while(at < size && dump[at] != LOG_END) {
+		event = dump[at++];
+		if(event >= LOG_EVENT_COUNT || !varint(&delta)) {
+			fprintf(stderr, "%s: bad record at %zu\n", argv[1], at - 1);
+			return 1;
+		}
+		seconds += (double)delta / header.tick_hz;
+
+		if(event == LOG_TEXT) {
+			if(!varint(&length) || at + length > size) {
+				fprintf(stderr, "%s: text runs off the end at %zu\n", argv[1], at);
+				return 1;
+			}
+			printf("%.3f,%s,,\"", seconds, event_names[event]);
+			for(; length; length--, at++) {
+				if(dump[at] == '"')
+					putchar('"');
+				putchar((dump[at] == '\n' || dump[at] == '\r')? ' ' : dump[at]);
+			}
+			printf("\"\n");
+			continue;
+		}
+
+		field = event_fields[event];
+		for(i = 0; *field && i < LOG_VALUES; i++) {
+			if(!varint(&value)) {
+				fprintf(stderr, "%s: record runs off the end at %zu\n", argv[1], at);
+				return 1;
+			}
+			values[i] = (long)(value >> 1) ^ -(long)(value & 1);
+			field = strchr(field, ',');
+			field = field? field + 1 : "";
+		}
+
+		// reason,samples,divider,age, then samples each less the one before
+		when = seconds;
+		if(event == LOG_FLIGHT) {
+			flight_step = (double)values[2] / header.tick_hz;
+			flight_time = seconds - (double)values[3] / header.tick_hz + flight_step;
+			memset(flight, 0, sizeof(flight));
+		} else if(event == LOG_FLIGHT_SAMPLE) {
+			flight_time -= flight_step;
+			when = flight_time;
+			for(i = 0; i < LOG_VALUES; i++)
+				values[i] = flight[i] += values[i];
+		}
+
+		field = event_fields[event];
+		if(!*field)
+			printf("%.3f,%s,,\n", when, event_names[event]);
+		for(i = 0; *field; i++) {
+			end = strchr(field, ',');
+			if(!end)
+				end = field + strlen(field);
+			printf("%.3f,%s,%.*s,%ld\n", when, event_names[event], (int)(end - field), field, values[i]);
+			field = *end? end + 1 : end;
+		}
+	}
+	return 0;
+}
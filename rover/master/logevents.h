@@ -0,0 +1,91 @@
+#ifndef LOGEVENTS_H
+#define LOGEVENTS_H
+
+/*
+	Binary EEPROM log, shared by master.c, which writes it, and logdecode.c
+	on the host, which turns a dump back into CSV (make logdecode, then
+	./logdecode eeprom.bin > run.csv).
+
+	The log opens with a struct log_header naming the build, then records
+	back to back: the event ID, the control ticks since the record before
+	as a varint, then the event's values in order as zigzag varints.
+	LOG_TEXT carries a varint length and the characters instead. Varints
+	are 7 bits a byte, low first, with the top bit set on all but the last;
+	zigzag maps 0, -1, 1, -2 ... to 0, 1, 2, 3 ... so small negatives stay
+	short. 0xFF, erased EEPROM, follows the last record.
+
+	A flight recorder dump is a LOG_FLIGHT record then up to its samples
+	of LOG_FLIGHT_SAMPLE, newest first, each holding its values less those
+	of the sample written before it (0 before the first). The newest was
+	taken age ticks before the LOG_FLIGHT record and each one after it
+	divider ticks earlier; the dump stops early when the log is full, so
+	it's the oldest samples that go missing.
+*/
+
+#include <inttypes.h>
+
+#define LOG_MAGIC 0x4C52 /* "RL" */
+#define LOG_VERSION 1
+#define LOG_END 0xFF
+
+/* Options the build had, for the header */
+#define LOG_SLAVE_SPEED_CONTROL 0x01
+#define LOG_SLAVE_SENSORS 0x02
+#define LOG_ENCODER_COUNTERS 0x04
+#define LOG_PROFILE 0x08
+#define LOG_TWI_BENCHMARK 0x10
+#define LOG_UART_BENCHMARK 0x20
+
+struct log_header {
+	uint16_t magic;
+	uint8_t version;
+	uint8_t options; /* LOG_ option bits */
+	uint8_t track; /* LOG_TRACKS index */
+	uint16_t tick_hz; /* Record times count control ticks at this rate */
+	char built[20]; /* __DATE__ " " __TIME__, not terminated */
+} __attribute__((__packed__));
+
+#define LOG_TRACKS "none", "square", "zigzag", "straight", "spin"
+
+/* What froze the flight recorder, LOG_FLIGHT's reason */
+#define FLIGHT_DEMAND 0 /* flight_trigger() from anywhere else */
+#define FLIGHT_BRAKE 1
+#define FLIGHT_COMMAND 2 /* A wheel command dropped or out of retries */
+#define FLIGHT_DONE 3
+#define FLIGHT_BAD_INTERRUPT 4
+
+/* Events: ID, name, then the names of its values in the order they're logged */
+#define LOG_EVENTS(X) \
+	X(LOG_TEXT, "text", "") \
+	X(LOG_CHECKPOINT, "checkpoint", "distance,angle,direction") \
+	X(LOG_COMPASS, "compass", "x,y,age") \
+	X(LOG_TURN, "turn", "goal_ticks") \
+	X(LOG_DRIVE, "drive", "goal_ticks") \
+	X(LOG_BRAKE, "brake", "left,right,left_speed,right_speed") \
+	X(LOG_LINK, "link", "control_latency,log_dropped,commands_dropped,commands_failed") \
+	X(LOG_SLAVE, "slave", "frames_sent,frame_sequence,slave_sequence,faults,left,right") \
+	X(LOG_SLAVE_SILENT, "slave_silent", "register") \
+	X(LOG_BUS, "bus", "address,polls,misses") \
+	X(LOG_BUS_LOAD, "bus_load", "permille,peak") \
+	X(LOG_ENCODER_ERRORS, "encoder_errors", "errors") \
+	X(LOG_ADC, "adc", "conversions,samples,overruns") \
+	X(LOG_BENCH_ROUNDS, "bench_rounds", "khz,mean_us,worst_us,errors") \
+	X(LOG_BENCH_QUEUE, "bench_queue", "khz,frames_per_s,errors") \
+	X(LOG_BAD_INTERRUPT, "bad_interrupt", "") \
+	X(LOG_DONE, "done", "") \
+	X(LOG_FLIGHT, "flight", "reason,samples,divider,age") \
+	X(LOG_FLIGHT_SAMPLE, "flight_sample", "left,right,left_command,right_command,ranger1,ranger2,twi_errors") \
+	X(LOG_BENCH_UART, "bench_uart", "baud,error_permille,bytes_per_s,putc_permille,write_permille") \
+	X(LOG_BENCH_UART_FEED, "bench_uart_feed", "bulk,cycles_per_100_bytes")
+
+#define LOG_ID(id, name, fields) id,
+enum log_event {
+	LOG_EVENTS(LOG_ID)
+	LOG_EVENT_COUNT
+};
+#undef LOG_ID
+
+#define LOG_VALUES 7 /* Most values an event has */
+#define LOG_RECORD (1 + 5 + LOG_VALUES * 5) /* Longest record but text */
+
+#endif /* end of include guard: LOGEVENTS_H */
@@ -2,13 +2,22 @@
 #include <avr/interrupt.h>
 #include <util/delay.h>
 #include <avr/eeprom.h>
+#include <util/crc16.h>
 #include <string.h>
-#include "master.h"
+#include <stddef.h>
+#include "pid.h"
 #include "twi.h"
+#include "eelog.h"
+#include "logevents.h"
+#include "master.h"
+#include "hal.h"
 
 #if(SERIAL_ENABLED)
 #include "uart.h"
 #include <stdlib.h>
+#if(UART_BAUD_ERROR(SERIAL_BAUD, F_CPU) > UART_BAUD_TOLERANCE)
+#error "SERIAL_BAUD is too far from any rate F_CPU / 8 divides down to"
+#endif
 #endif
 
 #if defined(SQUARE_TRACK)
@@ -30,44 +39,75 @@ void init(void) {
 	TIMSK1 = 0x00;
 	TIMSK2 = 0x00;
 	
-	// Setup 8-bit timer 2
-	TCCR0A = _BV(COM0A1) | _BV(WGM01) | _BV(WGM00); // Fast PWM, top at OCR0A
-	TCCR0B = _BV(WGM02) | _BV(CS00); // clock speed
-	OCR0A = 25; // 80 KHz wave
-	OCR0B = 12; // 50% duty cycle
+#if(ENCODER_COUNTERS)
+	// Timer0 and timer 1 count encoder ticks on T0 (PB0) and T1 (PB1)
+	DDRB &= ~(_BV(0) | _BV(1));
+	TCCR0A = 0x00;
+	TCCR0B = COUNTER_CLOCK;
+	TCCR1A = 0x00;
+	TCCR1B = COUNTER_CLOCK;
+	counterLeft = TCNT0;
+	counterRight = TCNT1;
+#else
+	// Setup 8-bit timer 0, wrapping at 0xFF so the profiler can time ISRs
+	// to the cycle against TCNT0
+	TCCR0A = _BV(COM0A1) | _BV(WGM01) | _BV(WGM00); // Fast PWM, top at 0xFF
+	TCCR0B = _BV(CS00); // clock speed
+	OCR0A = 128; // 78 KHz wave
+	OCR0B = 128; // 50% duty cycle
 	DDRB |= _BV(4); // Enable output on OC0B (PB4)
 	
-	// Setup 16-bit timer 1
-	TCCR1A = _BV(WGM11); // No PWM output
-	TCCR1B = _BV(WGM13) | _BV(WGM12) | _BV(CS11); // clk / 8, 16-bit Fast PWM
-	ICR1 = 50000; // Overflows every 20 ms
-	//TIMSK1 = _BV(ICIE1); // Trigger interrupt when timer reaches TOP	
+	// Setup 16-bit timer 1 free-running to timestamp encoder edges
+	// (the servo sweep in TIMER1_CAPT_vect wanted ICR1 = 50000 as TOP at clk / 8)
+	TCCR1A = 0x00; // No PWM output
+	TCCR1B = _BV(CS11) | _BV(CS10); // clk / 64, normal mode
+#endif
+#if(PROFILE_ENABLED)
+	profile_init(); // times itself on Timer0 and Timer1, so after they're set up
+#endif
 		
-	// Setup ADC
+	// Setup ADC for single conversions, started by the sequencer
 	ADMUX = MUX_RANGER1; // VRef = AREF, Right adjust result, src = ADC0
-	ADCSRA = _BV(ADEN) | _BV(ADIE); // Enable ADC and interrupt, clk /2 speed
-	ADCSRA |= _BV(ADATE);
-	//ADCSRB = _BV(ADTS2) | _BV(ADTS1) | _BV(ADTS0); // Auto-trigger on Timer1 capture event
-	ADCSRB = 0x00; // Free-running mode
+	ADCSRA = _BV(ADEN) | _BV(ADIE) | ADC_PRESCALE; // Enable ADC and interrupt
+	ADCSRB = 0x00;
 	DIDR0 = 0x00; // Don't disable digital input on ADC pins
-	//ADCSRA |= _BV(ADSC); // Start converting!
+	
+	// Spread the channels over the ticks so they don't all come due at once
+	for(uint8_t i = 0; i < ADC_CHANNELS; i++)
+		adc_counts[i] = i;
 		
 
-	// Setup TWI
+	// Setup TWI, and the wheel command transfers to go on it
 	twi_init();	
+	for(uint8_t i = 0; i < COMMAND_QUEUE; i++) {
+		commands[i].transfer.address = bus_devices[BUS_MOTORS].address;
+		commands[i].transfer.read = 0;
+		commands[i].transfer.data = commands[i].data;
+		commands[i].transfer.length = sizeof(commands[i].data);
+		commands[i].transfer.retries = COMMAND_RETRIES;
+		commands[i].transfer.priority = TWI_URGENT;
+		commands[i].transfer.done = command_done;
+	}
+	bus_init();
 	DDRC &= ~_BV(0);
 	DDRC &= ~_BV(1);
 	PORTC |= _BV(0) | _BV(1); // Enable input pull-up resistors (~15K)
 	
 	
-	// Enable rising-edge external interrupts on INT0(pin 4) and INT1(pin 5)
-	EICRA = _BV(ISC11) | _BV(ISC10) | _BV(ISC01) | _BV(ISC00);
-	EIMSK = _BV(INT1) | _BV(INT0);
+	// Decode both encoders from pin change interrupts on all four channels
+	ENCODER_DDR &= ~ENCODER_MASK;
+	ENCODER_PORT &= ~ENCODER_MASK;
+	EIMSK = 0x00;
+#if(!ENCODER_COUNTERS && !SLAVE_SPEED_CONTROL)
+	encoderState = encoder_read();
+	PCMSK3 = ENCODER_MASK;
+	PCICR = _BV(PCIE3);
+#endif
 
 	
 #if(SERIAL_ENABLED)
 
-	uart_init(UART_BAUD_SELECT(9600, F_CPU));
+	uart_init(UART_BAUD_SELECT_NEAREST(SERIAL_BAUD, F_CPU));
 	
 	UCSR0B &= ~_BV(RXCIE0);
 	
@@ -79,8 +119,12 @@ void init(void) {
 	// Make PA3 an input	
 	DDRA &= ~_BV(3);
 	
+	// High PA3 logs to EEPROM from the start, up to the gains block
+	log_start();
+	
 	// Setup and start following path
 	goal = track;
+	load_gains();
 
 	// Turn on interrupts
 	sei();
@@ -88,6 +132,8 @@ void init(void) {
 }
 
 int main(void) {
+	struct slave_registers slave;
+	
 	// Initialize LED outputs
 	LEDL_DDR |= _BV(LEDL_PIN);
 	LEDR_DDR |= _BV(LEDR_PIN);
@@ -109,152 +155,612 @@ int main(void) {
 	_delay_ms(STARTUP_DELAY);
 	
 	init();
-			
-	DEBUG_STRING("\n\n\nmaster starting...\n");
-		
-	// Disable outputs on INT0, INT1
-	DDRD &= ~_BV(2);
-	DDRD &= ~_BV(3);
-	PORTD &= ~_BV(2);
-	PORTD &= ~_BV(3);
+	
+#if(TWI_BENCHMARK)
+	twi_benchmark();
+#endif
+#if(UART_BENCHMARK)
+	uart_benchmark();
+#endif
+#if(SLAVE_POLL)
+	poll_select();
+#endif
 		
 	// Set encoder count to zero
 	encoderLeft = encoderRight = 0;
 	leftDirection = rightDirection = 1;
 	
-	while((goal->distance != 0) || (goal->angle != 0)) {
-		
-		// Turn to face the next checkpoint
-		DEBUG_STRING("\nGoing to next checkpoint:\n");
-		DEBUG_NUMBER("distance", goal->distance);
-		DEBUG_NUMBER("angle", goal->angle);
-			
-		if(goal->direction == 1) {
-			DEBUG_STRING("turning left\n");
-			command(TURN_LEFT, TURN_SPEED);
-			turnTo(goal->angle);
-		} 
-		else if(goal->direction == 2) {
-			DEBUG_STRING("turning right\n");
-			command(TURN_RIGHT, TURN_SPEED);
-			turnTo(goal->angle);
+	// Start the control tick; navigation runs from there on
+	TCCR2A = _BV(WGM21); // CTC, top at OCR2A
+	TCCR2B = _BV(CS22) | _BV(CS21); // clk / 256
+	OCR2A = CONTROL_TOP;
+	nav_left = nav_right = NAV_UNSET;
+	nav_state = NAV_NEXT;
+	debug_wait = 0;
+	TIMSK2 = _BV(OCIE2A);
+	
+	// Log the control tick's progress until it's done and the last commands are sent
+	uint8_t logged = NAV_IDLE;
+	while((nav_state != NAV_DONE) || twi_pending()) {
+		if(nav_state != logged) {
+			PROFILE_IDLE_LEAVE();
+			logged = nav_state;
+			log_navigation(logged);
+		} else {
+			PROFILE_IDLE_ENTER();
+			HAL_SPIN();
 		}
-		
-		brake(255);
-				
-		DEBUG_STRING("driving straight\n");
-		driveUntil(goal->distance);
-		
-		//DEBUG_NUMBER("encoderLeft", encoderLeft);
-		//DEBUG_NUMBER("encoderRight", encoderRight);
-		
-		brake(BRAKE_SPEED);
-		
-		goal++;
+#if(FLIGHT_RECORDER)
+		if(flight_frozen) {
+			PROFILE_IDLE_LEAVE();
+			flight_dump();
+		}
+#endif
 	}
+	PROFILE_IDLE_LEAVE();
 	
-	DEBUG_STRING("done track!\n");
+	TIMSK2 = 0x00;
+	debug_wait = EELOG_WAIT;
+#if(FLIGHT_RECORDER)
+	// Finish any dump under way, then dump the end of the track
+	while(flight_dump())
+		HAL_SPIN();
+	flight_freeze(FLIGHT_DONE);
+	while(flight_dump())
+		HAL_SPIN();
+#endif
+	LOG(LOG_LINK, control_latency, eelog_dropped(), commands_dropped, commands_failed);
+	if(read_slave(&slave))
+		LOG(LOG_SLAVE, commands_sent, command_sequence, slave.sequence, slave.faults, slave.left, slave.right);
+	else
+		LOG(LOG_SLAVE_SILENT, 0);
+	for(uint8_t i = 0; i < BUS_DEVICES; i++)
+		LOG(LOG_BUS, bus_devices[i].address, bus_devices[i].polls, bus_devices[i].misses);
+	LOG(LOG_BUS_LOAD, bus_load, bus_load_peak);
+#if(!SLAVE_SPEED_CONTROL)
+	LOG(LOG_ENCODER_ERRORS, encoderErrors);
+#endif
+	LOG(LOG_ADC, adc_conversions, adc_samples, adc_overruns);
+#if(PROFILE_ENABLED)
+	profile_report(profile_put);
+#endif
+	log_record(LOG_DONE, 0, 0);
+	eelog_flush();
 	
 	// Finished, do nothing
-	while(1) {}
+	HAL_HALT();
 	
 	return 0;
 }
 
-void command(uint8_t command, uint8_t value) {
-	uint8_t err;
-	cmd_data[0] = command;
-	cmd_data[1] = value;
-	do {
-		// Repeat transmission until successful
-		err = twi_writeTo(TWI_SLAVE, cmd_data, 2, 1);
-	} while(err);
+/* The next free command slot, or 0 if the bus is too far behind */
+struct queued_command *command_slot(void) {
+	struct queued_command *slot = &commands[command_head];
+	
+	if(slot->transfer.status == TWI_PENDING) {
+		commands_dropped++;
+#if(FLIGHT_RECORDER)
+		flight_trigger(FLIGHT_COMMAND);
+#endif
+		return 0;
+	}
+	return slot;
 }
 
-void turnTo(uint16_t degrees) {
-	uint32_t ticks = (uint32_t)((float)degrees * TICKS_PER_DEGREE);
-	DEBUG_NUMBER("goal ticks", ticks);
-	
-	//uint32_t endLeft = encoderLeft + ticks;
-	//uint32_t endRight = encoderRight + ticks;
-	uint32_t endLeft = ticks;
-	uint32_t endRight = ticks;
+/* Put the first length bytes of a filled in slot on the bus */
+void command_send(struct queued_command *slot, uint8_t length) {
+	slot->transfer.length = length;
+	if(twi_enqueue(&slot->transfer)) {
+		commands_dropped++;
+#if(FLIGHT_RECORDER)
+		flight_trigger(FLIGHT_COMMAND);
+#endif
+		return;
+	}
+	command_head = (command_head + 1) % COMMAND_QUEUE;
+}
+
+/* Room for a command in this tick's frame, or 0 if the bus is too far behind */
+uint8_t *command_add(uint8_t code) {
+	struct queued_command *slot = command_open;
+	uint8_t length = COMMAND_LENGTH(code);
 	
-	while((encoderLeft < endLeft) && (encoderRight < endRight)) {
-		DEBUG_NUMBER("encoderLeft", encoderLeft);
-		DEBUG_NUMBER("encoderRight", encoderRight);
+	// Nothing the frame already holds for the wheels matters after this
+	if(slot && COMMAND_BOTH_WHEELS(code))
+		slot->data[0] = 0;
+	if(slot && (slot->data[0] + length > FRAME_COMMANDS)) {
+		command_flush();
+		slot = 0;
+	}
+	if(!slot) {
+		slot = command_slot();
+		if(!slot)
+			return 0;
+		slot->data[0] = 0;
+		command_open = slot;
 	}
+	slot->data[0] += length;
+	return slot->data + 2 + slot->data[0] - length;
+}
+
+/* Seal this tick's frame and put it on the bus; end of the control tick */
+void command_flush(void) {
+	if(!command_open)
+		return;
+	command_send(command_open, frame_seal(command_open->data));
+	command_open = 0;
+}
+
+/* CRC-8 of a frame's bytes, polynomial 0x07 */
+uint8_t frame_crc(const uint8_t *data, uint8_t length) {
+	uint8_t crc = 0;
 	
-	encoderLeft = encoderRight = 0;
-	//encoderLeft = encoderLeft - endLeft;
-	//encoderRight = encoderRight - endRight;
+	while(length--)
+		crc = _crc8_ccitt_update(crc, *data++);
+	return crc;
+}
+
+/* Number a frame whose length and commands are filled in and add its CRC; returns its length */
+uint8_t frame_seal(uint8_t *frame) {
+	uint8_t length = frame[0] + FRAME_OVERHEAD;
 	
+	frame[1] = ++command_sequence;
+	frame[length - 1] = frame_crc(frame, length - 1);
+	return length;
 }
 
-void driveUntil(uint16_t distance) {
-	//uint32_t endLeft = encoderLeft + distance;
-	//uint32_t endRight = encoderRight + distance;
-	uint32_t endLeft = distance;
-	uint32_t endRight = distance;
+/* Queue a wheel command on the TWI bus; called from the control tick */
+void queue_command(uint8_t command, uint8_t value) {
+	uint8_t *data = command_add(command);
+	
+	if(!data)
+		return;
+	data[0] = command;
+	data[1] = value;
 	
-	DEBUG_NUMBER("goal distance", distance);
-	uint8_t high_speed = MOTOR_SPEED_HIGH;
-	uint8_t low_speed = MOTOR_SPEED_LOW;
+	// Braking leaves the wheels off their setpoints
+	if(command == BRAKE)
+		nav_left = nav_right = NAV_UNSET;
+}
+
+/* Queue signed speeds for both wheels in one frame, if they've changed;
+   with MOTOR_ACCEL the slave ramps the wheels there, and with
+   SLAVE_SPEED_CONTROL they're ticks per second for it to hold */
+void queue_setpoint(int16_t left, int16_t right) {
+	uint8_t *data;
 	
-	int32_t diff = 0;
+	if((left == nav_left) && (right == nav_right))
+		return;
+#if(SLAVE_SPEED_CONTROL)
+	data = command_add(VELOCITY);
+	if(!data)
+		return;
+	data[0] = VELOCITY;
+	data[1] = left & 0xFF;
+	data[2] = (uint16_t)left >> 8;
+	data[3] = right & 0xFF;
+	data[4] = (uint16_t)right >> 8;
+	nav_left = left;
+	nav_right = right;
+	return;
+#endif
+#if(MOTOR_ACCEL)
+	data = command_add(RAMP);
+#else
+	data = command_add(SETPOINT);
+#endif
+	if(!data)
+		return;
+	data[1] = ((left < 0)? SETPOINT_LEFT_REVERSE : 0) | ((right < 0)? SETPOINT_RIGHT_REVERSE : 0);
+	data[2] = MIN(ABS(left), 255);
+	data[3] = MIN(ABS(right), 255);
+#if(MOTOR_ACCEL)
+	data[0] = RAMP;
+	data[4] = data[5] = RAMP_RATE(MOTOR_ACCEL);
+#else
+	data[0] = SETPOINT;
+#endif
+	nav_left = left;
+	nav_right = right;
+}
+
+/* A frame's transfer is over; called from the TWI interrupt */
+void command_done(struct twi_transaction *transfer) {
+	if(transfer->status == 0) {
+		commands_sent++;
+	} else {
+		commands_failed++;
+		// The slave may not have the last setpoint, so send the next one regardless
+		nav_left = nav_right = NAV_UNSET;
+#if(FLIGHT_RECORDER)
+		flight_trigger(FLIGHT_COMMAND);
+#endif
+	}
+}
+
+/* Read the slave's whole register map; blocks, so not from the control tick */
+uint8_t read_slave(struct slave_registers *registers) {
+	uint8_t select[FRAME_LENGTH] = { 2, 0, REGISTER, 0 };
 	
-	command(FORWARD, high_speed);
+	if(twi_writeTo(TWI_SLAVE, select, frame_seal(select), TWI_WAIT))
+		return 0;
+	return twi_readFrom(TWI_SLAVE, (uint8_t *)registers, sizeof(*registers)) == sizeof(*registers);
+}
+
+#if(TWI_BENCHMARK)
+/* Command round trip and rate at each bus speed; wheels stopped, tick not started */
+void twi_benchmark(void) {
+	static const uint32_t speeds[] = { TWI_STANDARD, TWI_FAST };
+	uint8_t frame[FRAME_LENGTH] = { SETPOINT_LENGTH + 2, 0, SETPOINT, 0, 0, 0, REGISTER, REG_SEQUENCE };
+	uint8_t *data, sequence, errors, failed;
+	uint16_t start, spent, worst;
+	uint32_t total;
 	
-	while((encoderLeft < endLeft) && (encoderRight < endRight)) {
-		DEBUG_NUMBER("encoderLeft", encoderLeft);
-		DEBUG_NUMBER("encoderRight", encoderRight);
+	for(uint8_t s = 0; s < sizeof(speeds) / sizeof(speeds[0]); s++) {
+		twi_setFrequency(speeds[s]);
+		
+		// Round trip: a stop setpoint batched with a pointer to REG_SEQUENCE,
+		// then a read to see the slave applied that frame
+		errors = 0;
+		worst = 0;
+		total = 0;
+		for(uint8_t i = 0; i < BENCH_ROUNDS; i++) {
+			start = TCNT1;
+			if(twi_writeTo(TWI_SLAVE, frame, frame_seal(frame), TWI_WAIT) ||
+					(twi_readFrom(TWI_SLAVE, &sequence, 1) != 1) ||
+					(sequence != frame[1])) {
+				errors++;
+				continue;
+			}
+			spent = TCNT1 - start;
+			commands_sent++;
+			total += spent;
+			worst = MAX(worst, spent);
+		}
+		LOG(LOG_BENCH_ROUNDS, speeds[s] / 1000,
+			(errors < BENCH_ROUNDS)? total * 64 / (BENCH_ROUNDS - errors) / (F_CPU / 1000000UL) : 0,
+			(uint32_t)worst * 64 / (F_CPU / 1000000UL), errors);
 		
-		if((encoderLeft - encoderRight) != diff) {
-			diff = 2 * (encoderLeft - encoderRight);
-			uint8_t lspeed = CONSTRAIN(high_speed - diff, low_speed, high_speed);
-			uint8_t rspeed = CONSTRAIN(high_speed + diff, low_speed, high_speed);
-			command(FORWARD_LEFT, lspeed);
-			command(FORWARD_RIGHT, rspeed);
+		// Rate: one setpoint frame after another, the command queue kept full
+		failed = commands_failed;
+		start = TCNT1;
+		for(uint8_t i = 0; i < BENCH_COMMANDS; i++) {
+			while(commands[command_head].transfer.status == TWI_PENDING)
+				HAL_SPIN();
+			data = command_add(SETPOINT);
+			data[0] = SETPOINT;
+			data[1] = data[2] = data[3] = 0;
+			command_flush();
 		}
-		/*if((endLeft - encoderLeft < 100) || (endRight - encoderRight < 100)) {
-			high_speed = MOTOR_SPEED_HIGH2;
-			low_speed = MOTOR_SPEED_LOW2;
-		}*/
+		while(twi_pending())
+			HAL_SPIN();
+		spent = TCNT1 - start;
+		LOG(LOG_BENCH_QUEUE, speeds[s] / 1000, (uint32_t)BENCH_COMMANDS * EDGE_HZ / spent,
+			(uint8_t)(commands_failed - failed));
 	}
+	twi_setFrequency(TWI_FREQ);
+}
+#endif
+
+#if(UART_BENCHMARK)
+/* CPU cycles per 100 bytes queued by each feeder, then line rate and CPU share at each baud rate; tick not started */
+void uart_benchmark(void) {
+	static const uint32_t bauds[] = { UART_BENCH_BAUDS };
+	uint32_t error, rate, empty, spent;
+	uint16_t bytes;
+	float cycles[2];
 	
-	encoderLeft = encoderRight = 0;
-	//encoderLeft = encoderLeft - endLeft;
-	//encoderRight = encoderRight - endRight;
+	// Let the console finish, the fills start from an empty ring
+	while(uart_tx_free() < UART_TX_BUFFER_SIZE - 1)
+		HAL_SPIN();
+	// The same rounds queueing nothing, just the timer reads
+	empty = uart_bench_run(0, 0, &bytes);
+	for(uint8_t bulk = 0; bulk < 2; bulk++) {
+		spent = uart_bench_run(bulk, 1, &bytes);
+		spent -= MIN(empty, spent);
+		cycles[bulk] = (float)spent * 64 / bytes;
+		LOG(LOG_BENCH_UART_FEED, bulk, (uint32_t)(cycles[bulk] * 100 + 0.5f));
+	}
+	
+	for(uint8_t b = 0; b < sizeof(bauds) / sizeof(bauds[0]); b++) {
+		error = UART_BAUD_ERROR(bauds[b], F_CPU);
+		if(error > UART_BAUD_TOLERANCE) {
+			LOG(LOG_BENCH_UART, bauds[b], error, 0, 0, 0);
+			continue;
+		}
+		rate = UART_BAUD_ACTUAL(bauds[b], F_CPU) / 10; // Start, 8 data and stop bits
+		LOG(LOG_BENCH_UART, bauds[b], error, rate,
+			(uint32_t)(cycles[0] * rate * 1000 / F_CPU), (uint32_t)(cycles[1] * rate * 1000 / F_CPU));
+	}
+}
+
+/*
+	Time UART_BENCH_ROUNDS fills of the empty TX ring, with uart_putc() or
+	in bulk with uart_write(), or with fill 0 no bytes at all. Interrupts
+	are off while it fills so the UDRE interrupt can't drain it, then
+	uart_init() empties it and turns UDRIE off again, so none of it goes
+	out on the line. Returns the Timer1 counts taken; bytes gets how many
+	were queued.
+*/
+uint32_t uart_bench_run(uint8_t bulk, uint8_t fill, uint16_t *bytes) {
+	static const uint8_t pattern[UART_TX_BUFFER_SIZE] = { [0 ... UART_TX_BUFFER_SIZE - 1] = 'U' };
+	uint32_t spent = 0;
+	uint16_t start;
+	uint8_t room, sreg;
+	
+	*bytes = 0;
+	for(uint8_t r = 0; r < UART_BENCH_ROUNDS; r++) {
+		room = fill? uart_tx_free() : 0;
+		sreg = SREG;
+		cli();
+		start = TCNT1;
+		if(bulk) {
+			uart_write(pattern, room);
+		} else {
+			for(uint8_t i = 0; i < room; i++)
+				uart_putc(pattern[i]);
+		}
+		spent += (uint16_t)(TCNT1 - start);
+		uart_init(UART_BAUD_SELECT_NEAREST(SERIAL_BAUD, F_CPU));
+		SREG = sreg;
+		*bytes += room;
+	}
+	UCSR0B &= ~_BV(RXCIE0);
+	return spent;
+}
+#endif
+
+/* One step of the navigation state machine, run every control tick */
+void navigate(void) {
+	switch(nav_state) {
+		case NAV_NEXT:
+			if((goal->distance == 0) && (goal->angle == 0)) {
+				bus_brake(255); // Every board stops together at the end
+				nav_state = NAV_DONE;
+				break;
+			}
+			encoderLeft = encoderRight = 0;
+			nav_target = (int32_t)((float)goal->angle * TICKS_PER_DEGREE * COUNTS_PER_TICK);
+			leftDirection = (goal->direction == 1)? -1 : 1;
+			rightDirection = -leftDirection;
+			sync_pid.limit = SYNC_LIMIT_TURN;
+			pid_reset(&sync_pid);
+			sync_count = 0;
+			if((goal->direction == 1) || (goal->direction == 2)) {
+				queue_setpoint(NAV_TURN_SPEED * leftDirection, NAV_TURN_SPEED * rightDirection);
+				nav_state = NAV_TURN;
+			} else {
+				brake(255, NAV_TURN_BRAKE);
+			}
+			break;
+			
+		case NAV_TURN:
+			if((nav_now.left * leftDirection >= nav_target) || (nav_now.right * rightDirection >= nav_target))
+				brake(255, NAV_TURN_BRAKE);
+			else
+				synchronise(NAV_TURN_SPEED);
+			break;
+			
+		case NAV_TURN_BRAKE:
+			if((--nav_brake == 0) || wheels_stopped()) {
+				encoderLeft = encoderRight = 0;
+				nav_target = (int32_t)goal->distance * COUNTS_PER_TICK;
+				leftDirection = rightDirection = 1;
+				sync_pid.limit = SYNC_LIMIT_DRIVE;
+				pid_reset(&sync_pid);
+				sync_count = 0;
+				queue_setpoint(NAV_DRIVE_SPEED, NAV_DRIVE_SPEED);
+				nav_state = NAV_DRIVE;
+			}
+			break;
+			
+		case NAV_DRIVE:
+			if((nav_now.left >= nav_target) || (nav_now.right >= nav_target)) {
+				brake(BRAKE_SPEED, NAV_DRIVE_BRAKE);
+				break;
+			}
+			synchronise(NAV_DRIVE_SPEED);
+			break;
+			
+		case NAV_DRIVE_BRAKE:
+			if((--nav_brake == 0) || wheels_stopped()) {
+				encoderLeft = encoderRight = 0;
+				goal++;
+				nav_state = NAV_NEXT;
+			}
+			break;
+	}
 }
 
+/* Brake until both wheels stop or for BRAKE_TIME, then carry on in next_state */
+void brake(uint8_t amount, uint8_t next_state) {
+	nav_stop.left = nav_now.left;
+	nav_stop.right = nav_now.right;
+	nav_stop.left_speed = nav_now.left_speed;
+	nav_stop.right_speed = nav_now.right_speed;
+	nav_stop.time = nav_now.time;
+	queue_command(BRAKE, amount);
+	nav_brake = BRAKE_TICKS;
+	nav_state = next_state;
+#if(FLIGHT_RECORDER)
+	flight_trigger(FLIGHT_BRAKE);
+#endif
+}
 
-void brake(uint8_t amount) {
-	command(BRAKE, amount);
-	_delay_ms(BRAKE_TIME);
-	DEBUG_NUMBER("encoderLeft after stopping", encoderLeft);
-	DEBUG_NUMBER("encoderRight after stopping", encoderRight);
+/*
+	Keep the wheels level: every SYNC_DIVIDER ticks, run the PID on the
+	difference in distance the wheels have covered and set the wheels either side
+	of speed, slowing the wheel that's ahead, in their current directions
+*/
+void synchronise(int16_t speed) {
+	int16_t correction;
+	int16_t lspeed, rspeed;
+	
+	if(++sync_count < SYNC_DIVIDER)
+		return;
+	sync_count = 0;
+	
+	correction = pid_update(&sync_pid,
+		CONSTRAIN(nav_now.left * leftDirection - nav_now.right * rightDirection, -1000, 1000));
+	lspeed = CONSTRAIN(speed - correction, 0, NAV_SPEED_MAX);
+	rspeed = CONSTRAIN(speed + correction, 0, NAV_SPEED_MAX);
+	queue_setpoint(lspeed * leftDirection, rspeed * rightDirection);
+}
+
+/* Use the gains saved in EEPROM if there are any, else the built-in ones */
+void load_gains(void) {
+	struct gains gains;
 	
-	// Do error correction
-	/*if((encoderLeft - encoderRight) > 3) {
-		command(REVERSE_LEFT, 120);
-		while((encoderLeft - encoderRight) > 3) {};
+	eeprom_read_block(&gains, GAINS_EEPROM, sizeof(gains));
+	if(gains.magic == GAINS_MAGIC)
+		pid_init(&sync_pid, gains.kp, gains.ki, gains.kd, SYNC_LIMIT_DRIVE);
+	else
+		pid_init(&sync_pid, SYNC_KP, SYNC_KI, SYNC_KD, SYNC_LIMIT_DRIVE);
+}
+
+/* Log a navigation state change; called from the main loop, not the tick */
+void log_navigation(uint8_t state) {
+	struct encoder_snapshot stop;
+	uint16_t value, value2, age;
+	
+	switch(state) {
+		case NAV_TURN:
+			LOG(LOG_CHECKPOINT, goal->distance, goal->angle, goal->direction);
+			if(adc_get(MUX_COMPASS1, &value, &age) && adc_get(MUX_COMPASS2, &value2, &age))
+				LOG(LOG_COMPASS, value, value2, age);
+			LOG(LOG_TURN, nav_target);
+			break;
+		case NAV_DRIVE:
+			LOG(LOG_DRIVE, nav_target);
+			break;
+		case NAV_TURN_BRAKE:
+		case NAV_DRIVE_BRAKE:
+			snapshot_copy(&stop, &nav_stop);
+			LOG(LOG_BRAKE, stop.left, stop.right, stop.left_speed, stop.right_speed);
+			break;
 	}
-	else if((encoderRight - encoderLeft) > 3) {
-		command(REVERSE_RIGHT, 120);
-		while((encoderRight - encoderLeft) > 3) {};
+}
+
+
+
+#if(FLIGHT_RECORDER)
+/* Keep a sample every FLIGHT_DIVIDER ticks until frozen; called from the control tick */
+void flight_sample(void) {
+	struct flight_sample *sample;
+	
+	if(flight_frozen || (++flight_divider < FLIGHT_DIVIDER))
+		return;
+	flight_divider = 0;
+	
+	sample = &flight_ring[flight_head];
+	sample->left = nav_now.left;
+	sample->right = nav_now.right;
+	sample->left_command = nav_left;
+	sample->right_command = nav_right;
+	sample->ranger1 = adc_filters[MUX_RANGER1].value;
+	sample->ranger2 = adc_filters[MUX_RANGER2].value;
+	sample->twi_errors = commands_dropped + commands_failed;
+	flight_head = (flight_head + 1) % FLIGHT_SAMPLES;
+	if(flight_count < FLIGHT_SAMPLES)
+		flight_count++;
+	flight_last = controlTicks;
+	
+	if(flight_after && (--flight_after == 0))
+		flight_frozen = 1;
+}
+
+/* Freeze the ring FLIGHT_AFTER samples from now, if reason is in FLIGHT_TRIGGERS */
+void flight_trigger(uint8_t reason) {
+	uint8_t sreg = SREG;
+	
+	if(!(FLIGHT_TRIGGERS & _BV(reason)))
+		return;
+	cli();
+	if(!flight_after && !flight_frozen) {
+		flight_reason = reason;
+		flight_after = FLIGHT_AFTER;
 	}
-	command(BRAKE, 255);
-	_delay_ms(BRAKE_TIME);
-	*/
-	encoderLeft = encoderRight = 0;
+	SREG = sreg;
 }
 
+/* Freeze the ring now, for a trigger the tick won't be around to finish */
+void flight_freeze(uint8_t reason) {
+	uint8_t sreg = SREG;
+	
+	cli();
+	if(!flight_frozen && (flight_after || (FLIGHT_TRIGGERS & _BV(reason)))) {
+		if(!flight_after)
+			flight_reason = reason;
+		flight_after = 0;
+		flight_frozen = 1;
+	}
+	SREG = sreg;
+}
 
+/*
+	Log the frozen ring, see logevents.h, as many records at a time as
+	there's room for in the EEPROM queue so the main loop never waits on
+	it. Once it's all logged, or the log is full, the ring starts again
+	empty. Returns 1 while there's more to log.
+*/
+uint8_t flight_dump(void) {
+	static const struct flight_sample none;
+	const struct flight_sample *sample, *newer;
+	int32_t values[LOG_VALUES];
+	uint8_t index, sreg, failed = 0;
+	
+	if(!flight_frozen)
+		return 0;
+	while(!failed && (flight_dumped <= flight_count) &&
+			(eelog_pending() + LOG_RECORD + 1 <= EELOG_QUEUE)) {
+		if(!flight_dumped) {
+			values[0] = flight_reason;
+			values[1] = flight_count;
+			values[2] = FLIGHT_DIVIDER;
+			values[3] = control_ticks() - flight_last;
+			failed = log_record(LOG_FLIGHT, values, 4);
+		} else {
+			// Newest first, flight_dumped samples back from the head
+			index = (flight_head + FLIGHT_SAMPLES - flight_dumped) % FLIGHT_SAMPLES;
+			sample = &flight_ring[index];
+			newer = (flight_dumped == 1)? &none : &flight_ring[(index + 1) % FLIGHT_SAMPLES];
+			values[0] = sample->left - newer->left;
+			values[1] = sample->right - newer->right;
+			values[2] = (int32_t)sample->left_command - newer->left_command;
+			values[3] = (int32_t)sample->right_command - newer->right_command;
+			values[4] = (int32_t)sample->ranger1 - newer->ranger1;
+			values[5] = (int32_t)sample->ranger2 - newer->ranger2;
+			values[6] = (int32_t)sample->twi_errors - newer->twi_errors;
+			failed = log_record(LOG_FLIGHT_SAMPLE, values, 7);
+		}
+		flight_dumped++;
+	}
+	if(!failed && (flight_dumped <= flight_count))
+		return 1;
+	
+	sreg = SREG;
+	cli();
+	flight_dumped = 0;
+	flight_count = 0;
+	flight_divider = 0;
+	flight_frozen = 0;
+	SREG = sreg;
+	return 0;
+}
+#endif
 
 SIGNAL(BADISR_vect) {
+	// Interrupts stay off from here on: the log is written by polling
+	debug_wait = EELOG_WAIT;
+	log_record(LOG_BAD_INTERRUPT, 0, 0);
+#if(FLIGHT_RECORDER)
+	flight_freeze(FLIGHT_BAD_INTERRUPT);
+	while(flight_dump())
+		eelog_flush();
+#endif
+	eelog_flush();
 	while(1) {
 	//LED_TOGGLE(LED_RIGHT);
-	DEBUG_STRING("WHAT THE FUCK");
 	_delay_ms(50);
 	}
 }
@@ -263,6 +769,33 @@ SIGNAL(BADISR_vect) {
 
 /* Interrupt Handlers */
 
+/* Control tick, CONTROL_HZ from Timer2 compare A */
+SIGNAL(TIMER2_COMPA_vect) {
+	uint8_t latency = TCNT2;
+	PROFILE_ISR_START();
+	
+	if(latency > control_latency)
+		control_latency = latency;
+	encoderSeq++;
+	controlTicks++;
+#if(ENCODER_COUNTERS)
+	encoder_count();
+#endif
+	bus_schedule();
+#if(!SLAVE_SPEED_CONTROL)
+	speed_update(&wheelLeft);
+	speed_update(&wheelRight);
+#endif
+	encoder_snapshot(&nav_now);
+	navigate();
+	command_flush();
+	adc_schedule();
+#if(FLIGHT_RECORDER)
+	flight_sample();
+#endif
+	PROFILE_ISR_STOP(PROFILE_TICK);
+}
+
 /* Interrupt handler for Timer1 interrupt
 	Should occur every 20 milliseconds */
 SIGNAL(TIMER1_CAPT_vect) {
@@ -278,53 +811,435 @@ SIGNAL(TIMER1_CAPT_vect) {
 
 
 
+/* Queue the channels due this tick and start on them; called from the control tick */
+void adc_schedule(void) {
+	uint8_t i;
+	
+	for(i = 0; i < ADC_CHANNELS; i++) {
+		if(!adc_table[i].divider || (++adc_counts[i] < adc_table[i].divider))
+			continue;
+		adc_counts[i] = 0;
+		if(adc_pending & _BV(i))
+			adc_overruns++;
+		adc_pending |= _BV(i);
+	}
+	if((adc_current == ADC_IDLE) && adc_pending)
+		adc_next();
+}
+
+/* Start the lowest pending channel, or go idle */
+void adc_next(void) {
+	uint8_t i;
+	
+	for(i = 0; i < ADC_CHANNELS; i++) {
+		if(adc_pending & _BV(i)) {
+			adc_current = i;
+			ADMUX = adc_table[i].mux;
+			ADCSRA |= _BV(ADSC);
+			return;
+		}
+	}
+	adc_current = ADC_IDLE;
+}
+
+/* Median of three */
+uint16_t median3(uint16_t a, uint16_t b, uint16_t c) {
+	if(a > b) {
+		uint16_t t = a;
+		a = b;
+		b = t;
+	}
+	return (c <= a)? a : (c >= b)? b : c;
+}
+
+/* Decimate a finished burst, keep it in the history and filter it */
+void adc_sample(struct adc_filter *filter, const struct adc_channel *channel) {
+	uint16_t sample = (filter->sum >> channel->extra_bits) << (ADC_BITS - 10 - channel->extra_bits);
+	uint8_t first = !filter->ready;
+	uint8_t head = filter->head;
+	
+	filter->history[head] = sample;
+	filter->head = (head + 1) & (ADC_HISTORY - 1);
+	if(filter->filled < ADC_HISTORY)
+		filter->filled++;
+	
+	// Until there are three samples the history is still zeroes
+	if(channel->median && filter->filled >= 3) {
+		sample = median3(sample, filter->history[(head - 1) & (ADC_HISTORY - 1)],
+			filter->history[(head - 2) & (ADC_HISTORY - 1)]);
+	}
+	if(first || !channel->iir_shift) {
+		filter->iir = sample << ADC_IIR_FRACTION;
+	} else {
+		filter->iir += ((int32_t)((uint32_t)sample << ADC_IIR_FRACTION) - filter->iir) >> channel->iir_shift;
+	}
+	
+	filter->value = filter->iir >> ADC_IIR_FRACTION;
+	filter->stamp = controlTicks;
+	filter->ready = 1;
+	filter->seq++;
+	adc_samples++;
+}
+
+/*
+	Latest filtered value of a channel, 12-bit, and its age in ms, without
+	disabling interrupts: ADC_vect bumps the channel's seq on every update
+	and the copy is retried if it moved. The filter isn't volatile, so
+	barriers keep its loads between the seq reads. Returns 0 if there's no
+	value yet.
+*/
+uint8_t adc_get(uint8_t channel, uint16_t *value, uint16_t *age) {
+	struct adc_filter *filter = &adc_filters[channel];
+	uint32_t stamp;
+	uint8_t seq, ready;
+	
+	do {
+		seq = filter->seq;
+		HAL_BARRIER();
+		*value = filter->value;
+		stamp = filter->stamp;
+		ready = filter->ready;
+		HAL_BARRIER();
+	} while(seq != filter->seq);
+	
+	if(!ready)
+		return 0;
+	*age = MIN((control_ticks() - stamp) * (1000 / CONTROL_HZ), 65535);
+	return 1;
+}
+
+/* Copy up to n of a channel's latest decimated samples, newest first; returns how many */
+uint8_t adc_history(uint8_t channel, uint16_t *samples, uint8_t n) {
+	struct adc_filter *filter = &adc_filters[channel];
+	uint8_t seq, i, head, copied;
+	
+	do {
+		seq = filter->seq;
+		HAL_BARRIER();
+		head = filter->head;
+		copied = MIN(n, filter->filled);
+		for(i = 0; i < copied; i++)
+			samples[i] = filter->history[(head - 1 - i) & (ADC_HISTORY - 1)];
+		HAL_BARRIER();
+	} while(seq != filter->seq);
+	return copied;
+}
+
 /* Interrupt handler for ADC */
 SIGNAL(ADC_vect) {
-	//LED_PORT ^= _BV(LED_PIN);
-	adc_reading = (ADCH << 8) | ADCL;
-	
-	// Choose next MUX value based on previous
-	switch(ADMUX) {
-		case MUX_RANGER1:
-			ADMUX = MUX_RANGER2;
-			ranger1 = adc_reading;
-			break;
-		case MUX_RANGER2:
-			ADMUX = MUX_COMPASS1;
-			ranger2 = adc_reading;
-			break;
-		case MUX_COMPASS1:
-			ADMUX = MUX_COMPASS2;
-			compass1 = adc_reading;
-			break;
-		case MUX_COMPASS2:
-			ADMUX = MUX_INFRARED1;
-			compass2 = adc_reading;
-			break;
-		case MUX_INFRARED1:
-			ADMUX = MUX_INFRARED2;
-			break;
-		case MUX_INFRARED2:
-			ADMUX = MUX_INFRARED3;
-			break;
-		case MUX_INFRARED3:
-			ADMUX = MUX_RANGER1;
-			break;
+	PROFILE_ISR_START();
+	const struct adc_channel *channel = &adc_table[adc_current];
+	struct adc_filter *filter = &adc_filters[adc_current];
+	
+	filter->sum += ADC;
+	adc_conversions++;
+	if(++filter->count < (1 << (2 * channel->extra_bits))) {
+		// More of the burst to go
+		ADCSRA |= _BV(ADSC);
+	} else {
+		adc_sample(filter, channel);
+		filter->sum = 0;
+		filter->count = 0;
+		adc_pending &= ~_BV(adc_current);
+		adc_next();
 	}
+	PROFILE_ISR_STOP(PROFILE_ADC);
 }
 
-SIGNAL(INT0_vect) {
-	encoderLeft++;
-	//LED_TOGGLE(LED_LEFT);
-	LEDL_PORT ^= _BV(LEDL_PIN);
+/* Count change for each (previous AB << 2 | AB) of one encoder */
+const int8_t quadrature[16] = {
+	0, 1, -1, 0,
+	-1, 0, 0, 1,
+	1, 0, 0, -1,
+	0, -1, 1, 0
+};
+
+/* AB of both encoders, left in bits 3:2 and right in bits 1:0 */
+uint8_t encoder_read(void) {
+	uint8_t pins = ENCODER_PIN;
+	
+	return (((pins >> ENCL_A) & 1) << 3) | (((pins >> ENCL_B) & 1) << 2)
+		| (((pins >> ENCR_A) & 1) << 1) | ((pins >> ENCR_B) & 1);
 }
 
-SIGNAL(INT1_vect) {
-	encoderRight++;
-	//LED_TOGGLE(LED_RIGHT);
-	LEDR_PORT ^= _BV(LEDR_PIN);
+/*
+	Consistent copy of both encoder counts and the time, without
+	disabling interrupts. Every interrupt that writes them bumps
+	encoderSeq; interrupts don't nest and run to completion before the
+	main loop resumes, so a copy taken with encoderSeq unchanged is whole.
+	The wheel speeds aren't volatile, so barriers keep their loads between
+	the encoderSeq reads.
+*/
+void encoder_snapshot(struct encoder_snapshot *snapshot) {
+	uint8_t seq;
+	
+	do {
+		seq = encoderSeq;
+		HAL_BARRIER();
+		snapshot->left = encoderLeft;
+		snapshot->right = encoderRight;
+		snapshot->left_speed = wheelLeft.speed;
+		snapshot->right_speed = wheelRight.speed;
+		snapshot->time = controlTicks * (1000000L / CONTROL_HZ)
+			+ (uint16_t)TCNT2 * 256 / (F_CPU / 1000000L);
+		HAL_BARRIER();
+	} while(seq != encoderSeq);
+}
+
+/* Control ticks so far, read the same way */
+uint32_t control_ticks(void) {
+	uint32_t ticks;
+	uint8_t seq;
+	
+	do {
+		seq = encoderSeq;
+		ticks = controlTicks;
+	} while(seq != encoderSeq);
+	return ticks;
 }
 
+/* Same for a snapshot the control tick keeps */
+void snapshot_copy(struct encoder_snapshot *dst, volatile struct encoder_snapshot *src) {
+	uint8_t seq;
+	
+	do {
+		seq = encoderSeq;
+		dst->left = src->left;
+		dst->right = src->right;
+		dst->left_speed = src->left_speed;
+		dst->right_speed = src->right_speed;
+		dst->time = src->time;
+	} while(seq != encoderSeq);
+}
+
+/*
+	Extend the hardware counts into encoderLeft/Right. Called from the
+	control tick with interrupts off, so both counters are read together;
+	neither wheel can pass 256 ticks in one control period.
+*/
+void encoder_count(void) {
+	uint8_t left = TCNT0;
+	uint16_t right = TCNT1;
+	int16_t dleft = (int16_t)(uint8_t)(left - counterLeft) * leftDirection;
+	int16_t dright = (int16_t)(uint16_t)(right - counterRight) * rightDirection;
+	
+	encoderLeft += dleft;
+	encoderRight += dright;
+	counterLeft = left;
+	counterRight = right;
+	
+	// No edge times in this mode: speed is the change over the last tick
+	wheelLeft.fresh = (dleft != 0);
+	wheelLeft.speed = dleft * CONTROL_HZ;
+	wheelRight.fresh = (dright != 0);
+	wheelRight.speed = dright * CONTROL_HZ;
+}
+
+/*
+	Time one counted edge. A reversal or an edge too close to the last
+	one (bounce) throws away the history, so a jittering wheel reads as
+	slow rather than fast.
+*/
+void edge_record(struct wheel_timing *wheel, uint16_t stamp, int8_t step) {
+	uint8_t n = wheel->valid;
+	
+	if((step != wheel->direction) || (n && ((uint16_t)(stamp - wheel->edges[(wheel->index - 1) & 3]) < EDGE_GLITCH))) {
+		wheel->direction = step;
+		n = 0;
+	}
+	if(n) {
+		wheel->span = stamp - wheel->edges[(wheel->index - n) & 3];
+		wheel->intervals = n;
+	} else {
+		wheel->intervals = 0;
+	}
+	wheel->edges[wheel->index] = stamp;
+	wheel->index = (wheel->index + 1) & 3;
+	wheel->valid = (n < 4)? n + 1 : 4;
+	wheel->fresh = 1;
+}
+
+/*
+	Once per control tick: speed from the time across the last few edges,
+	bounded by the time since the newest one so it falls away as the wheel
+	stops, and zero after STOP_TICKS with no edges at all
+*/
+void speed_update(struct wheel_timing *wheel) {
+	if(wheel->fresh) {
+		wheel->fresh = 0;
+		wheel->idle = 0;
+	} else if(wheel->idle < STOP_TICKS) {
+		wheel->idle++;
+	}
+#if(!ENCODER_COUNTERS)
+	if(wheel->idle >= STOP_TICKS) {
+		wheel->speed = 0;
+		wheel->valid = 0;
+		wheel->intervals = 0;
+	} else if(wheel->intervals) {
+		uint16_t elapsed = TCNT1 - wheel->edges[(wheel->index - 1) & 3];
+		uint32_t speed;
+		
+		if((uint32_t)elapsed * wheel->intervals > wheel->span)
+			speed = EDGE_HZ / elapsed;
+		else
+			speed = EDGE_HZ * wheel->intervals / wheel->span;
+		wheel->speed = (int16_t)MIN(speed, 32767UL) * wheel->direction;
+	}
+#endif
+}
+
+#if(SLAVE_POLL)
+/* Point the slave's register reads at POLL_FROM and take what's there so far */
+void poll_select(void) {
+	uint8_t select[FRAME_LENGTH] = { 2, 0, REGISTER, POLL_FROM };
+	
+	if(twi_writeTo(TWI_SLAVE, select, frame_seal(select), TWI_WAIT) ||
+			(twi_readFrom(TWI_SLAVE, (uint8_t *)&polled_last + POLL_FROM, POLL_LENGTH) != POLL_LENGTH))
+		LOG(LOG_SLAVE_SILENT, POLL_FROM);
+}
+
+/* Fold a read into the counts, speeds and rangers; called from the TWI interrupt */
+void poll_done(struct twi_transaction *transfer) {
+#if(SLAVE_SPEED_CONTROL)
+	encoderSeq++;
+	encoderLeft += polled.encoder_left - polled_last.encoder_left;
+	encoderRight += polled.encoder_right - polled_last.encoder_right;
+	wheelLeft.speed = polled.speed_left;
+	wheelLeft.idle = polled.speed_left? 0 : STOP_TICKS;
+	wheelRight.speed = polled.speed_right;
+	wheelRight.idle = polled.speed_right? 0 : STOP_TICKS;
+#endif
+#if(SLAVE_SENSORS)
+	if(polled.sensor_seq != polled_last.sensor_seq) {
+		sensor_publish(&adc_filters[MUX_RANGER1], polled.sensors[0], polled.sensor_age);
+		sensor_publish(&adc_filters[MUX_RANGER2], polled.sensors[1], polled.sensor_age);
+	}
+#endif
+	polled_last = polled;
+}
+
+/* Hand a value filtered on the slave to adc_get() readers; adc_history()
+   gets the filtered values too, the raw samples stay on the slave */
+void sensor_publish(struct adc_filter *filter, uint16_t value, uint16_t age) {
+	filter->history[filter->head] = value;
+	filter->head = (filter->head + 1) & (ADC_HISTORY - 1);
+	if(filter->filled < ADC_HISTORY)
+		filter->filled++;
+	filter->value = value;
+	filter->stamp = controlTicks - (uint32_t)age * CONTROL_HZ / 1000;
+	filter->ready = 1;
+	filter->seq++;
+	adc_samples++;
+}
+#endif
+
+/* Set up each board's poll, spread over the ticks like the ADC channels */
+void bus_init(void) {
+	for(uint8_t i = 0; i < BUS_DEVICES; i++) {
+		struct bus_device *device = &bus_devices[i];
+		
+		device->poll.address = device->address;
+		device->poll.read = 1;
+		device->poll.data = device->data;
+		device->poll.length = device->length;
+		device->poll.retries = 0;
+		device->poll.priority = device->priority;
+		device->poll.done = bus_done;
+		device->count = i;
+	}
+	bus_general.address = TWI_GENERAL_CALL;
+	bus_general.read = 0;
+	bus_general.data = bus_general_data;
+	bus_general.retries = COMMAND_RETRIES;
+	bus_general.priority = TWI_URGENT;
+	bus_general.done = 0;
+}
+
+/* Queue the polls that are due and keep the bus load; called from the control tick */
+void bus_schedule(void) {
+	for(uint8_t i = 0; i < BUS_DEVICES; i++) {
+		struct bus_device *device = &bus_devices[i];
+		
+		if(!device->divider || (++device->count < device->divider))
+			continue;
+		device->count = 0;
+		if((device->poll.status == TWI_PENDING) || twi_enqueue(&device->poll))
+			device->misses++;
+	}
+	
+	if(++bus_count >= CONTROL_HZ) {
+		uint32_t clocks = twi_busClocks();
+		
+		bus_count = 0;
+		bus_load = (clocks - bus_clocks) / (TWI_FREQ / 1000);
+		bus_load_peak = MAX(bus_load_peak, bus_load);
+		bus_clocks = clocks;
+	}
+}
+
+/* A poll is off the bus: hand a whole one to its board's handler; called from the TWI interrupt */
+void bus_done(struct twi_transaction *transfer) {
+	struct bus_device *device = (struct bus_device *)((uint8_t *)transfer - offsetof(struct bus_device, poll));
+	
+	if(transfer->status || (transfer->count != device->length)) {
+		device->misses++;
+		return;
+	}
+	device->polls++;
+	device->done(transfer);
+}
+
+/* Brake every board on the bus at once with a general call, ahead of anything queued */
+void bus_brake(uint8_t amount) {
+	if(bus_general.status == TWI_PENDING)
+		return;
+	bus_general_data[0] = 2;
+	bus_general_data[2] = BRAKE;
+	bus_general_data[3] = amount;
+	bus_general.length = frame_seal(bus_general_data);
+	if(twi_enqueue(&bus_general))
+		commands_dropped++;
+}
+
+uint8_t wheels_stopped(void) {
+	return (wheelLeft.idle >= STOP_TICKS) && (wheelRight.idle >= STOP_TICKS);
+}
+
+#if(!ENCODER_COUNTERS)
+/* Quadrature decoder, on any edge of either encoder */
+SIGNAL(PCINT3_vect) {
+	PROFILE_ISR_START();
+	uint16_t stamp = TCNT1;
+	uint8_t state = encoder_read();
+	uint8_t last = encoderState;
+	uint8_t changed = state ^ last;
+	int8_t step;
+	
+	encoderSeq++;
+	if(changed & 0x0C) {
+		if((changed & 0x0C) == 0x0C)
+			encoderErrors++;
+		step = quadrature[(last & 0x0C) | (state >> 2)];
+		encoderLeft += step;
+		if(step)
+			edge_record(&wheelLeft, stamp, step);
+		LEDL_PORT ^= _BV(LEDL_PIN);
+	}
+	if(changed & 0x03) {
+		if((changed & 0x03) == 0x03)
+			encoderErrors++;
+		step = quadrature[((last & 0x03) << 2) | (state & 0x03)];
+		encoderRight += step;
+		if(step)
+			edge_record(&wheelRight, stamp, step);
+		LEDR_PORT ^= _BV(LEDR_PIN);
+	}
+	encoderState = state;
+	PROFILE_ISR_STOP(PROFILE_PCINT);
+}
+#endif
+
 
 /*
 	Sets the next ADC conversion to the compass, 
@@ -333,11 +1248,20 @@ SIGNAL(INT1_vect) {
 
 uint16_t reset_compass() {
 	uint16_t reading1, reading2;
-	// Turn off ADC interrupt and auto-trigger
-	ADCSRA &= ~_BV(ADIE) & ~_BV(ADATE);
+	uint8_t idle, sreg;
 	
-	// Wait for any other conversions to complete
-	loop_until_bit_is_clear(ADCSRA, ADSC);
+	// Wait for the sequencer to go idle, then keep it off the ADC
+	do {
+		sreg = SREG;
+		cli();
+		idle = (adc_current == ADC_IDLE);
+		if(idle)
+			adc_current = ADC_HELD;
+		SREG = sreg;
+		HAL_SPIN();
+	} while(!idle);
+	ADCSRA &= ~_BV(ADIE);
+	ADMUX = MUX_COMPASS1;
 	
 	// Set compass, start conversion and wait
 	COMPASS_SET;
@@ -351,8 +1275,9 @@ uint16_t reset_compass() {
 	loop_until_bit_is_clear(ADCSRA, ADSC);
 	reading2 = (ADCH << 8) | ADCL;
 	
-	// Restore interrupts and restart
-	ADCSRA |= _BV(ADIE) | _BV(ADATE) | _BV(ADSC);
+	// Clear the last result's flag and hand the ADC back to the sequencer
+	ADCSRA |= _BV(ADIF) | _BV(ADIE);
+	adc_current = ADC_IDLE;
 	
 	// Return the offset voltage
 	return reading2 - reading1;
@@ -386,29 +1311,75 @@ void LED_TOGGLE(uint8_t led) {
 	}
 }
 
-void DEBUG_STRING(const char *str) {
-	if(PINA & _BV(3) && (eeprom_p <= (uint8_t *)1950)) {
-		uint8_t len = strlen(str);
-		eeprom_write_block(str, eeprom_p, len);
-		eeprom_p += len;
-	}
+/* Open the log with a header naming this build, with PA3 high */
+void log_start(void) {
+	struct log_header header = { LOG_MAGIC, LOG_VERSION, LOG_OPTIONS, LOG_TRACK, CONTROL_HZ };
+	
+	memcpy(header.built, __DATE__ " " __TIME__, sizeof(header.built));
+	eelog_init(0, DEBUG_LOG_END);
+	log_time = 0;
+	if(PINA & _BV(3))
+		eelog_write(&header, sizeof(header), EELOG_WAIT);
 }
 
-void DEBUG_NUMBER(const char *name, uint16_t num) {
-	if(PINA & _BV(3) && (eeprom_p <= (uint8_t *)1950)) {
-		char snum[8];
-		snum[0] = '=';
-		itoa(num, snum+1, 10);
-		uint8_t len = strlen(name);
-		eeprom_write_block(name, eeprom_p, len);
-		eeprom_p += len;
-		len = strlen(snum);
-		eeprom_write_block(snum, eeprom_p, len);
-		eeprom_p += len;
-		eeprom_write_block("\n\r", eeprom_p, 2);
-		eeprom_p += 2;
+/* Write value 7 bits a byte, low first; returns the bytes written */
+uint8_t log_varint(uint8_t *out, uint32_t value) {
+	uint8_t n = 0;
+	
+	while(value >= 0x80) {
+		out[n++] = value | 0x80;
+		value >>= 7;
 	}
+	out[n++] = value;
+	return n;
+}
+
+/* Log a record: event, ticks since the last record, then zigzag values.
+   Returns 1 if it was dropped, as eelog_write() does */
+uint8_t log_record(uint8_t event, const int32_t *values, uint8_t count) {
+	uint8_t record[LOG_RECORD], len;
+	uint32_t now;
+	
+	if(!(PINA & _BV(3)))
+		return 1;
+	now = control_ticks();
+	record[0] = event;
+	len = 1 + log_varint(record + 1, now - log_time);
+	for(uint8_t i = 0; (i < count) && (i < LOG_VALUES); i++)
+		len += log_varint(record + len, ((uint32_t)values[i] << 1) ^ (uint32_t)(values[i] >> 31));
+	if(eelog_write(record, len, debug_wait))
+		return 1;
+	log_time = now;
+	return 0;
+}
+
+/* Log text as a LOG_TEXT record, cut to DEBUG_LINE characters */
+void DEBUG_STRING(const char *str) {
+	uint8_t record[1 + 5 + 1 + DEBUG_LINE], len, n;
+	uint32_t now;
+	
+	if(!(PINA & _BV(3)))
+		return;
+	now = control_ticks();
+	n = MIN(strlen(str), DEBUG_LINE);
+	record[0] = LOG_TEXT;
+	len = 1 + log_varint(record + 1, now - log_time);
+	len += log_varint(record + len, n);
+	memcpy(record + len, str, n);
+	if(!eelog_write(record, len + n, debug_wait))
+		log_time = now;
+}
+
+#if(PROFILE_ENABLED)
+/* One line of the profile report, to EEPROM and the serial port */
+void profile_put(const char *line) {
+	DEBUG_STRING(line);
+#if(SERIAL_ENABLED)
+	uart_puts(line);
+	uart_puts("\n\r");
+#endif
 }
+#endif
 
 
 
@@ -10,8 +10,34 @@
 
 #define SERIAL_ENABLED 1
 
+/* Serial port speed, set in double speed mode to the nearest F_CPU / 8
+   divider. The build stops if that's more than UART_BAUD_TOLERANCE off:
+   at 20 MHz the fastest that pass are 250000, 500000 and 625000 */
+#ifndef SERIAL_BAUD
+#define SERIAL_BAUD 9600
+#endif
+
 #define TWI_ENABLED 1
 
+/* Count encoder channel A in Timer0/Timer1 instead of decoding quadrature */
+#ifndef ENCODER_COUNTERS
+#define ENCODER_COUNTERS 0
+#endif
+
+/* Encoders on the slave instead, built with SPEED_CONTROL: it holds each
+   wheel at the speed sent with VELOCITY and the control tick polls its
+   encoder counts and speeds over TWI */
+#ifndef SLAVE_SPEED_CONTROL
+#define SLAVE_SPEED_CONTROL 0
+#endif
+
+/* Rangers on the slave instead, built with SENSORS: it samples and
+   filters them, and the control tick reads the finished values over TWI
+   along with anything else it polls */
+#ifndef SLAVE_SENSORS
+#define SLAVE_SENSORS 0
+#endif
+
 /* Status LED */
 #define LED_LEFT 0
 #define LEDL_PORT PORTC
@@ -30,6 +56,49 @@
 #define MOTOR_SPEED_LOW2 150
 #define TURN_SPEED 120
 
+/* Acceleration the slave ramps the wheels to each setpoint at, in PWM
+   counts per second up to 4980; 0 sends plain SETPOINTs that step straight there */
+#ifndef MOTOR_ACCEL
+#define MOTOR_ACCEL 4000
+#endif
+
+/* Quadrature encoders: channel A on INT0/INT1, B on PD6/PD7, all four
+   on the port D pin change interrupt (PCINT26, 27, 30, 31) */
+#define ENCODER_PIN PIND
+#define ENCODER_DDR DDRD
+#define ENCODER_PORT PORTD
+#define ENCL_A 2
+#define ENCR_A 3
+#define ENCL_B 6
+#define ENCR_B 7
+#define ENCODER_MASK (_BV(ENCL_A) | _BV(ENCR_A) | _BV(ENCL_B) | _BV(ENCR_B))
+
+/* With ENCODER_COUNTERS, A instead clocks Timer0 (T0, PB0, left) and
+   Timer1 (T1, PB1, right) on its rising edge. The control tick extends
+   the counts from the change in TCNT0/TCNT1, so there's no encoder
+   interrupt at all, but direction is taken from the wheel commands and
+   Timer0's 80 KHz output and Timer1's 20 ms timebase are given up. */
+#define COUNTER_CLOCK (_BV(CS02) | _BV(CS01) | _BV(CS00)) /* Rising edge on Tn */
+
+#if(ENCODER_COUNTERS && PROFILE_ENABLED)
+#error "The profiler times with Timer0 and Timer1, build ENCODER_COUNTERS with PROFILE=0"
+#endif
+
+#if(ENCODER_COUNTERS && SLAVE_SPEED_CONTROL)
+#error "ENCODER_COUNTERS and SLAVE_SPEED_CONTROL both move the encoders, build one or the other"
+#endif
+
+#if(ENCODER_COUNTERS || SLAVE_SPEED_CONTROL)
+#define COUNTS_PER_TICK 1
+#else
+#define COUNTS_PER_TICK 4 /* Every edge of A and B is counted */
+#endif
+
+/* Wheel speed from encoder edge times on Timer1, free-running at clk / 64 */
+#define EDGE_HZ (F_CPU / 64)
+#define EDGE_GLITCH (EDGE_HZ / 20000) /* Edges closer than 50 us are bounce */
+#define STOP_TICKS (80 * CONTROL_HZ / 1000) /* No edge for 80 ms: stopped */
+
 /* Measurements */
 #define TICKS_PER_DEGREE 0.3909722
 #define TICKS_PER_METRE 300
@@ -37,8 +106,77 @@
 #define BRAKE_SPEED 80
 #define MIN(x, y) ((x < y)? x : y)
 #define MAX(x, y) ((x < y)? y : x)
+#define ABS(x) ((x < 0)? -(x) : x)
 #define CONSTRAIN(x, low, high) (MIN(high, MAX(low, x)))
 
+/* Control loop: Timer2 compare A, clk / 256 */
+#define CONTROL_HZ 500
+#define CONTROL_TOP (F_CPU / 256 / CONTROL_HZ - 1)
+#define BRAKE_TICKS (BRAKE_TIME * CONTROL_HZ / 1000L)
+
+/* Wheel synchronisation PID on the encoder difference, Q8 gains (256 = 1.0).
+   Override at build time with -DSYNC_KP=... or at runtime from EEPROM */
+#if(SLAVE_SPEED_CONTROL)
+/* In ticks per second, and the slave's speed loop lags a little */
+#ifndef SYNC_KP
+#define SYNC_KP 2048
+#endif
+#ifndef SYNC_KI
+#define SYNC_KI 128
+#endif
+#ifndef SYNC_KD
+#define SYNC_KD 6144
+#endif
+#else
+#ifndef SYNC_KP
+#define SYNC_KP (1536 / COUNTS_PER_TICK)
+#endif
+#ifndef SYNC_KI
+#define SYNC_KI (96 / COUNTS_PER_TICK)
+#endif
+#ifndef SYNC_KD
+#define SYNC_KD (1536 / COUNTS_PER_TICK)
+#endif
+#endif
+#define SYNC_DIVIDER 10 /* Run every 10th control tick, 50 Hz */
+
+/* Wheel speeds navigation asks for: PWM, or with SLAVE_SPEED_CONTROL
+   encoder ticks per second for the slave to hold */
+#if(SLAVE_SPEED_CONTROL)
+#define NAV_DRIVE_SPEED 330
+#define NAV_TURN_SPEED 150
+#define NAV_SPEED_MAX 420
+#define SYNC_LIMIT_DRIVE 90
+#define SYNC_LIMIT_TURN 60
+#else
+#define NAV_DRIVE_SPEED MOTOR_SPEED_HIGH
+#define NAV_TURN_SPEED TURN_SPEED
+#define NAV_SPEED_MAX 255
+#define SYNC_LIMIT_DRIVE (MOTOR_SPEED_HIGH - MOTOR_SPEED_LOW)
+#define SYNC_LIMIT_TURN 40
+#endif
+
+/* Slave registers the control tick polls: one read from POLL_FROM to
+   POLL_TO, the encoders and speeds and/or the rangers */
+#define SLAVE_POLL (SLAVE_SPEED_CONTROL || SLAVE_SENSORS)
+#if(SLAVE_SPEED_CONTROL)
+#define POLL_FROM REG_ENCODERS
+#define POLL_DIVIDER 2 /* Every other control tick, 250 Hz */
+#else
+#define POLL_FROM REG_SENSORS
+#define POLL_DIVIDER 10 /* 50 Hz, as often as the slave has new rangers */
+#endif
+#if(SLAVE_SENSORS)
+#define POLL_TO sizeof(struct slave_registers)
+#else
+#define POLL_TO REG_SENSORS
+#endif
+#define POLL_LENGTH (POLL_TO - POLL_FROM)
+
+/* Gains block at the top of EEPROM, clear of the debug log */
+#define GAINS_EEPROM ((void *)0x7F0)
+#define GAINS_MAGIC 0x4750
+
 /* TWI Definitions */
 #define TWI_SLAVE 0x5A
 #define TWI_BAD_LENGTH 1
@@ -49,6 +187,58 @@
 #define TWI_WAIT 1
 #define TWI_NOWAIT 0
 
+/* Boards on the bus, rows of bus_devices */
+#define BUS_MOTORS 0 /* The slave at TWI_SLAVE */
+#define BUS_DEVICES 1
+
+/* With TWI_BENCHMARK, commands are timed on Timer1 at each bus speed
+   before the track: BENCH_ROUNDS setpoints each read back from the
+   slave's sequence register one at a time, then BENCH_COMMANDS with the
+   queue kept full. */
+#ifndef TWI_BENCHMARK
+#define TWI_BENCHMARK 0
+#endif
+#define BENCH_ROUNDS 32
+#define BENCH_COMMANDS 64
+
+#if(TWI_BENCHMARK && ENCODER_COUNTERS)
+#error "The TWI benchmark times with Timer1, build ENCODER_COUNTERS without it"
+#endif
+
+/* With UART_BENCHMARK, the serial port is timed on Timer1 before the
+   track: UART_BENCH_ROUNDS fills of the empty TX ring, a byte at a time
+   with uart_putc() and then in bulk with uart_write(), give the CPU cycles
+   each takes to queue a byte. The fills are dropped rather than sent and
+   the UDRE interrupt's share is left to PROFILE. Then for each of
+   UART_BENCH_BAUDS that's within tolerance, the bytes per second the line
+   carries at the divider it gets and the share of the CPU each feeder
+   would take to keep up with it. */
+#ifndef UART_BENCHMARK
+#define UART_BENCHMARK 0
+#endif
+#define UART_BENCH_BAUDS 9600, 250000, 500000, 625000, 1000000
+#define UART_BENCH_ROUNDS 64
+
+#if(UART_BENCHMARK && (ENCODER_COUNTERS || !SERIAL_ENABLED))
+#error "The UART benchmark times the serial port with Timer1, build it with SERIAL_ENABLED and without ENCODER_COUNTERS"
+#endif
+
+/* Flight recorder: every FLIGHT_DIVIDER control ticks a sample of the
+   encoders, wheel commands, rangers and TWI errors goes in a ring of the
+   last FLIGHT_SAMPLES. A trigger in FLIGHT_TRIGGERS freezes it
+   FLIGHT_AFTER samples later and the main loop dumps it to the EEPROM
+   log; a dump takes about half the log, so braking, which happens at
+   every checkpoint, isn't a trigger unless asked for. */
+#ifndef FLIGHT_RECORDER
+#define FLIGHT_RECORDER 1
+#endif
+#ifndef FLIGHT_TRIGGERS
+#define FLIGHT_TRIGGERS (_BV(FLIGHT_DEMAND) | _BV(FLIGHT_COMMAND) | _BV(FLIGHT_DONE) | _BV(FLIGHT_BAD_INTERRUPT))
+#endif
+#define FLIGHT_SAMPLES 96 /* 1.9 s */
+#define FLIGHT_DIVIDER 10 /* 50 Hz */
+#define FLIGHT_AFTER 10 /* 0.2 s after the trigger */
+
 /* TWI Commands */
 #define FORWARD_LEFT 1
 #define FORWARD_RIGHT 2 
@@ -60,7 +250,72 @@
 #define TURN_RIGHT 7
 #define TURN_LEFT 8
 #define REVERSE 9
-unsigned char cmd_data[2];
+#define SETPOINT 10 /* Both wheels at once, signed: reverse bits, left speed, right speed */
+#define SETPOINT_LENGTH 4
+#define SETPOINT_LEFT_REVERSE 0x01
+#define SETPOINT_RIGHT_REVERSE 0x02
+
+/* Ramp both wheels towards signed targets: reverse bits as for SETPOINT,
+   left target, right target, left acceleration, right acceleration.
+   The slave steps each wheel's PWM by acceleration / 64 every RAMP_HZ
+   tick until it gets there; 0 goes straight to the target. Any other
+   command for a wheel stops its ramp where it is. */
+#define RAMP 12
+#define RAMP_LENGTH 6
+#define RAMP_HZ 1250
+#define RAMP_RATE(counts) ((uint8_t)((counts) * 64UL / RAMP_HZ)) /* Acceleration for PWM counts per second */
+
+/* Hold both wheels at signed speeds in encoder ticks per second, each a
+   little-endian int16: left, then right. Only a SPEED_CONTROL slave takes
+   it; any other command for a wheel takes it off speed control. */
+#define VELOCITY 13
+#define VELOCITY_LENGTH 5
+
+/* Slave register map, read back over TWI: REGISTER points at an offset,
+   then each read returns the bytes from there to the end of the map.
+   The pointer stays put, so the master can poll a block with reads alone.
+   Little-endian, like both AVRs. */
+#define REGISTER 11
+
+struct slave_registers {
+	int16_t left, right; /* PWM as applied, -255 .. 255, 0 braking */
+	uint8_t sequence; /* Of the last frame applied */
+	uint8_t faults; /* FAULT_* seen since the faults were last read */
+	int32_t encoder_left, encoder_right; /* INT0/INT1 edges, back for reverse (SPEED_CONTROL) */
+	int16_t speed_left, speed_right; /* Ticks per second (SPEED_CONTROL) */
+	uint16_t sensors[2]; /* Rangers, filtered, 12-bit (SENSORS) */
+	uint16_t sensor_age; /* Milliseconds since they were sampled, as the read starts */
+	uint8_t sensor_seq; /* Bumped with each new block */
+} __attribute__((__packed__));
+
+#define REG_LEFT offsetof(struct slave_registers, left)
+#define REG_SEQUENCE offsetof(struct slave_registers, sequence)
+#define REG_FAULTS offsetof(struct slave_registers, faults)
+#define REG_ENCODERS offsetof(struct slave_registers, encoder_left)
+#define REG_SPEEDS offsetof(struct slave_registers, speed_left)
+#define REG_SENSORS offsetof(struct slave_registers, sensors)
+
+#define FAULT_SHORT 0x01 /* Frame or command without all its bytes */
+#define FAULT_UNKNOWN 0x02 /* No such command */
+#define FAULT_REGISTER 0x04 /* REGISTER past the end of the map */
+#define FAULT_CRC 0x08 /* Frame failed its CRC */
+
+/* Commands go over in frames: length, sequence, the commands back to
+   back, CRC-8. length counts the command bytes, and the CRC (polynomial
+   0x07, _crc8_ccitt_update() from util/crc16.h) covers everything before
+   it. The slave checks the whole frame before acting on any of it, then
+   sets REG_SEQUENCE to its sequence. A frame carrying the sequence it
+   already has is a retry whose ack got lost, and isn't applied twice.
+   A frame sent as a general call reaches every board together and is
+   applied whatever its sequence, without changing REG_SEQUENCE. */
+#define FRAME_OVERHEAD 3
+#define FRAME_COMMANDS 8 /* Command bytes one frame can carry */
+#define FRAME_LENGTH (FRAME_COMMANDS + FRAME_OVERHEAD)
+#define COMMAND_LENGTH(code) (((code) == SETPOINT)? SETPOINT_LENGTH : ((code) == RAMP)? RAMP_LENGTH : \
+	((code) == VELOCITY)? VELOCITY_LENGTH : 2)
+#define COMMAND_VALID(code) (((code) >= FORWARD_LEFT) && ((code) <= VELOCITY))
+#define COMMAND_BOTH_WHEELS(code) (((code) == BRAKE) || ((code) == RAMP) || ((code) == VELOCITY) || \
+	(((code) >= FORWARD) && ((code) <= SETPOINT)))
 
 /* Data types */
 struct checkpoint {
@@ -71,14 +326,157 @@ struct checkpoint {
 	uint8_t sensor_flags; /* Bitfield indicating sensors that can be trusted near checkpoint */
 } __attribute__((__packed__));
 
+/* Navigation states, stepped once per control tick */
+#define NAV_IDLE 0
+#define NAV_NEXT 1 /* Pick up the next checkpoint */
+#define NAV_TURN 2 /* Turning to face it */
+#define NAV_TURN_BRAKE 3
+#define NAV_DRIVE 4 /* Driving straight towards it */
+#define NAV_DRIVE_BRAKE 5
+#define NAV_DONE 6
+
+#define NAV_UNSET INT16_MIN /* Wheel setpoint not known, so the next one is always sent */
+
+/* Wheel commands the control tick queues on the TWI bus. Those from one
+   tick share a frame, which goes on the bus at the end of the tick; a
+   command for both wheels replaces any wheel commands before it in the
+   frame. A slot is free again once its transfer is done; a frame the
+   slave doesn't take is tried COMMAND_RETRIES more times and then
+   counted as failed. */
+#define COMMAND_QUEUE TWI_QUEUE_LENGTH
+#define COMMAND_RETRIES 3
+
+struct queued_command {
+	struct twi_transaction transfer;
+	uint8_t data[FRAME_LENGTH];
+};
+
+/* A board the control tick polls. Its reads go on the bus every divider
+   ticks at its priority; boards start at different counts, so those with
+   the same rate come due on different ticks. Command frames are
+   TWI_URGENT and go ahead of every poll, so another board adds to the
+   bus load but not to how long a command waits behind it. */
+struct bus_device {
+	uint8_t address;
+	uint8_t priority; /* Of its polls, TWI_NORMAL or TWI_URGENT */
+	uint8_t divider; /* Poll every divider control ticks, 0 never */
+	uint8_t *data; /* Where a poll reads to */
+	uint8_t length;
+	void (*done)(struct twi_transaction *transfer); /* With each whole poll, from the TWI interrupt */
+	uint8_t count;
+	struct twi_transaction poll;
+	volatile uint16_t polls; /* Taken by the board */
+	volatile uint16_t misses; /* Failed, or not done by the next poll */
+};
+
+/* Encoder counts and when they were read, in microseconds */
+struct encoder_snapshot {
+	int32_t left, right;
+	int16_t left_speed, right_speed; /* Counts per second */
+	uint32_t time;
+};
+
+/* Recent edge times of one wheel, for its speed */
+struct wheel_timing {
+	uint16_t edges[4]; /* Timer1 at the last four edges, next to go at index */
+	uint8_t index;
+	uint8_t valid; /* Edges held since the last glitch or reversal, up to 4 */
+	int8_t direction;
+	uint8_t fresh; /* An edge came since the last control tick */
+	uint16_t span; /* Timer1 counts across the last intervals edge gaps */
+	uint8_t intervals;
+	uint16_t idle; /* Control ticks since the last edge */
+	int16_t speed; /* Counts per second */
+};
+
+struct flight_sample {
+	int32_t left, right; /* Encoder counts, as in nav_now */
+	int16_t left_command, right_command; /* nav_left, nav_right */
+	uint16_t ranger1, ranger2;
+	uint8_t twi_errors; /* Commands dropped and failed, wrapping */
+};
+
+struct gains {
+	uint16_t magic; /* GAINS_MAGIC, or the built-in gains are used */
+	int16_t kp, ki, kd;
+};
+
 /* Global variables */
 
 // Current checkpoint
 struct checkpoint *goal;
 
-// Encoder counts (signed)
+// Navigation
+volatile uint8_t nav_state;
+int32_t nav_target; /* Ticks to the end of the current turn or straight */
+uint16_t nav_brake; /* Control ticks left braking */
+struct encoder_snapshot nav_now; /* Counts this control tick works from */
+volatile struct encoder_snapshot nav_stop; /* Counts when the brake went on */
+int16_t nav_left, nav_right; /* Last wheel setpoints queued, or NAV_UNSET */
+
+#if(FLIGHT_RECORDER)
+// Flight recorder
+struct flight_sample flight_ring[FLIGHT_SAMPLES];
+uint8_t flight_head; /* Next sample goes here */
+uint8_t flight_count; /* Samples held, up to FLIGHT_SAMPLES */
+uint8_t flight_divider;
+uint8_t flight_after; /* Samples left to take before freezing, 0 if not triggered */
+uint8_t flight_reason;
+uint32_t flight_last; /* Control tick of the newest sample */
+volatile uint8_t flight_frozen; /* Waiting for the main loop to dump it */
+uint8_t flight_dumped; /* Records of the dump logged so far */
+#endif
+
+// Wheel synchronisation
+struct pid sync_pid;
+uint8_t sync_count;
+
+// Command queue
+struct queued_command commands[COMMAND_QUEUE];
+uint8_t command_head;
+struct queued_command *command_open; /* Frame this tick's commands go in, not queued yet */
+uint8_t command_sequence; /* Of the last frame sealed */
+volatile uint8_t commands_dropped; /* No free slot */
+volatile uint8_t commands_failed; /* Out of retries */
+volatile uint16_t commands_sent; /* Frames taken by the slave */
+
+// Worst Timer2 count seen on entering the control tick
+volatile uint8_t control_latency;
+volatile uint32_t controlTicks;
+
+// Encoder counts (signed, COUNTS_PER_TICK per tick)
 volatile int32_t encoderLeft, encoderRight;
-volatile int8_t leftDirection, rightDirection;
+volatile uint8_t encoderState; /* Last AB of each wheel, left in bits 3:2 */
+volatile uint16_t encoderErrors; /* Transitions that skipped a state */
+volatile uint8_t encoderSeq; /* Bumped by every interrupt that writes the above */
+struct wheel_timing wheelLeft, wheelRight;
+uint8_t counterLeft; /* TCNT0 and TCNT1 at the last control tick */
+uint16_t counterRight;
+
+// Slave registers polled by the control tick, POLL_FROM onwards valid
+struct slave_registers polled, polled_last;
+void poll_done(struct twi_transaction *transfer);
+
+// Boards on the bus, indexed by BUS_ number
+struct bus_device bus_devices[BUS_DEVICES] = {
+#if(SLAVE_POLL)
+	{ TWI_SLAVE, TWI_NORMAL, POLL_DIVIDER, (uint8_t *)&polled + POLL_FROM, POLL_LENGTH, poll_done },
+#else
+	{ TWI_SLAVE, TWI_NORMAL, 0, 0, 0, 0 }, /* Only sent commands */
+#endif
+};
+
+// General call frame for stopping every board at once
+struct twi_transaction bus_general;
+uint8_t bus_general_data[FRAME_LENGTH];
+
+// Bus load: SCL clocks over the last second as a share of what it had, permille
+uint16_t bus_count;
+uint32_t bus_clocks;
+volatile uint16_t bus_load, bus_load_peak;
+
+// Direction each wheel is commanded to turn, 1 or -1
+int8_t leftDirection, rightDirection;
 
 // Servo
 #define SERVO_TURN 30
@@ -86,8 +484,7 @@ volatile int8_t leftDirection, rightDirection;
 #define SERVO_END 5000
 uint16_t servo_counter = 0;
 
-// ADC result
-volatile uint16_t adc_reading;
+// ADC channels
 #define MUX_RANGER1 0x00
 #define MUX_RANGER2 0x01
 #define MUX_COMPASS1 0x02
@@ -97,8 +494,63 @@ volatile uint16_t adc_reading;
 #define MUX_INFRARED3 0x06
 #define MUX_ADC7 0x07
 
-volatile uint16_t ranger1, ranger2;
-volatile uint16_t compass1, compass2;
+// ADC sequencer: each control tick queues the channels that are due, and
+// ADC_vect converts them one after another, then leaves the ADC idle.
+// A channel's conversions are summed in a burst of 4^extra_bits and
+// decimated, for extra_bits more resolution, then filtered. Readers get
+// the filtered value through adc_get(), on a 12-bit scale.
+#define ADC_PRESCALE (_BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0)) /* clk / 128, 156 KHz at 20 MHz */
+#define ADC_CHANNELS 7
+#define ADC_IDLE 0xFF
+#define ADC_HELD 0xFE /* reset_compass() has the ADC */
+#define ADC_HISTORY 8 /* Decimated samples kept per channel, a power of 2 */
+#define ADC_BITS 12 /* Scale of filtered values */
+#define ADC_IIR_FRACTION 4 /* Extra bits kept in the IIR state */
+
+struct adc_channel {
+	uint8_t mux;
+	uint8_t divider; /* Sample every divider control ticks, 0 to skip */
+	uint8_t extra_bits; /* Oversample 4^extra_bits conversions per sample, up to 2 */
+	uint8_t median; /* Median of the last three samples before the IIR */
+	uint8_t iir_shift; /* IIR weight of a new sample is 1/2^iir_shift, 0 for none */
+};
+
+/* Indexed by the MUX_ value of the channel */
+struct adc_channel adc_table[ADC_CHANNELS] = {
+#if(SLAVE_SENSORS)
+	{ MUX_RANGER1, 0, 1, 1, 1 }, /* Sampled on the slave, filled in by poll_done() */
+	{ MUX_RANGER2, 0, 1, 1, 1 },
+#else
+	{ MUX_RANGER1, 25, 1, 1, 1 }, /* 20 Hz, 11-bit, spikes removed */
+	{ MUX_RANGER2, 25, 1, 1, 1 },
+#endif
+	{ MUX_COMPASS1, 10, 2, 0, 2 }, /* 50 Hz, 12-bit, smoothed */
+	{ MUX_COMPASS2, 10, 2, 0, 2 },
+	{ MUX_INFRARED1, 0, 0, 0, 0 }, /* Not used yet */
+	{ MUX_INFRARED2, 0, 0, 0, 0 },
+	{ MUX_INFRARED3, 0, 0, 0, 0 }
+};
+
+struct adc_filter {
+	uint16_t sum; /* Conversions in the burst so far */
+	uint8_t count;
+	uint16_t history[ADC_HISTORY]; /* Decimated samples, 12-bit */
+	uint8_t head; /* Next slot in history */
+	uint8_t filled; /* Slots in history with a sample, up to ADC_HISTORY */
+	uint16_t iir; /* Filter state, 12-bit plus ADC_IIR_FRACTION */
+	uint16_t value; /* Filtered, 12-bit */
+	uint8_t ready; /* There's a value */
+	uint32_t stamp; /* controlTicks when value was last updated */
+	volatile uint8_t seq; /* Bumped by ADC_vect on every update */
+};
+
+struct adc_filter adc_filters[ADC_CHANNELS];
+uint8_t adc_counts[ADC_CHANNELS];
+volatile uint8_t adc_pending; /* Channels due, one bit each */
+volatile uint8_t adc_current = ADC_IDLE;
+volatile uint16_t adc_overruns; /* Channels that came due again before converting */
+volatile uint32_t adc_conversions;
+volatile uint32_t adc_samples;
 
 // Compass reading / resetting
 #define COMPASS_SET {}
@@ -111,20 +563,92 @@ void twi_rx(uint8_t* buffer, int count);
 void twi_tx(void);
 
 uint16_t reset_compass(void);
-
-void command(uint8_t command, uint8_t value);
-void turnTo(uint16_t ticks);
-void driveUntil(uint16_t distance);
-void brake(uint8_t amount);
+void adc_schedule(void);
+void adc_next(void);
+void adc_sample(struct adc_filter *filter, const struct adc_channel *channel);
+uint16_t median3(uint16_t a, uint16_t b, uint16_t c);
+uint8_t adc_get(uint8_t channel, uint16_t *value, uint16_t *age);
+uint8_t adc_history(uint8_t channel, uint16_t *samples, uint8_t n);
+
+struct queued_command *command_slot(void);
+void command_send(struct queued_command *slot, uint8_t length);
+uint8_t *command_add(uint8_t code);
+void command_flush(void);
+uint8_t frame_crc(const uint8_t *data, uint8_t length);
+uint8_t frame_seal(uint8_t *frame);
+void queue_command(uint8_t command, uint8_t value);
+void queue_setpoint(int16_t left, int16_t right);
+void command_done(struct twi_transaction *transfer);
+uint8_t read_slave(struct slave_registers *registers);
+void twi_benchmark(void);
+void navigate(void);
+void brake(uint8_t amount, uint8_t next_state);
+void synchronise(int16_t speed);
+uint8_t encoder_read(void);
+void encoder_snapshot(struct encoder_snapshot *snapshot);
+uint32_t control_ticks(void);
+void snapshot_copy(struct encoder_snapshot *dst, volatile struct encoder_snapshot *src);
+void encoder_count(void);
+void edge_record(struct wheel_timing *wheel, uint16_t stamp, int8_t step);
+void speed_update(struct wheel_timing *wheel);
+void uart_benchmark(void);
+uint32_t uart_bench_run(uint8_t bulk, uint8_t fill, uint16_t *bytes);
+void poll_select(void);
+void bus_init(void);
+void bus_schedule(void);
+void bus_done(struct twi_transaction *transfer);
+void bus_brake(uint8_t amount);
+void sensor_publish(struct adc_filter *filter, uint16_t value, uint16_t age);
+uint8_t wheels_stopped(void);
+void load_gains(void);
+void log_navigation(uint8_t state);
 
 void LED_ON(uint8_t led);
 void LED_OFF(uint8_t led);
 void LED_TOGGLE(uint8_t led);
 
 void DEBUG_STRING(const char *str);
-void DEBUG_NUMBER(const char *name, uint16_t num);
-
-uint8_t *eeprom_p = 0;
+void profile_put(const char *line);
+void log_start(void);
+uint8_t log_varint(uint8_t *out, uint32_t value);
+uint8_t log_record(uint8_t event, const int32_t *values, uint8_t count);
+void flight_sample(void);
+void flight_trigger(uint8_t reason);
+void flight_freeze(uint8_t reason);
+uint8_t flight_dump(void);
+
+// EEPROM log: while the control tick runs a record that doesn't fit in
+// the queue is dropped, so logging can't hold up navigation; before and
+// after, it waits for room. Records are binary, see logevents.h
+#define DEBUG_LINE 48 /* Longest DEBUG_STRING() text, cut to fit */
+#define DEBUG_LOG_END ((uint16_t)(uintptr_t)GAINS_EEPROM)
+uint8_t debug_wait = EELOG_WAIT;
+uint32_t log_time; /* Control tick of the last record logged */
+
+/* Log an event with its values, in the order logevents.h names them */
+#define LOG(event, ...) do { \
+	const int32_t log_values[] = { __VA_ARGS__ }; \
+	log_record(event, log_values, sizeof(log_values) / sizeof(log_values[0])); \
+} while(0)
+
+#define LOG_OPTIONS ((SLAVE_SPEED_CONTROL? LOG_SLAVE_SPEED_CONTROL : 0) | \
+	(SLAVE_SENSORS? LOG_SLAVE_SENSORS : 0) | \
+	(ENCODER_COUNTERS? LOG_ENCODER_COUNTERS : 0) | \
+	(PROFILE_ENABLED? LOG_PROFILE : 0) | \
+	(TWI_BENCHMARK? LOG_TWI_BENCHMARK : 0) | \
+	(UART_BENCHMARK? LOG_UART_BENCHMARK : 0))
+
+#if defined(SQUARE_TRACK)
+#define LOG_TRACK 1
+#elif defined(ZIGZAG_TRACK)
+#define LOG_TRACK 2
+#elif defined(STRAIGHT_TRACK)
+#define LOG_TRACK 3
+#elif defined(SPIN_TRACK)
+#define LOG_TRACK 4
+#else
+#define LOG_TRACK 0
+#endif
 
 #if(SERIAL_ENABLED)
 #define DEBUG_CHAR(x) uart_putc(x)
@@ -0,0 +1,43 @@
+#include "pid.h"
+
+void pid_init(struct pid *pid, int16_t kp, int16_t ki, int16_t kd, int16_t limit) {
+	pid->kp = kp;
+	pid->ki = ki;
+	pid->kd = kd;
+	pid->limit = limit;
+	pid_reset(pid);
+}
+
+/* Forget the history before starting on a new setpoint */
+void pid_reset(struct pid *pid) {
+	pid->integral = 0;
+	pid->last = 0;
+}
+
+int16_t pid_update(struct pid *pid, int16_t error) {
+	int32_t limit = (int32_t)pid->limit << PID_SHIFT;
+	int32_t integral = pid->integral + (int32_t)pid->ki * error;
+	int32_t output;
+	
+	if(integral > limit)
+		integral = limit;
+	else if(integral < -limit)
+		integral = -limit;
+	
+	output = (int32_t)pid->kp * error + integral + (int32_t)pid->kd * (error - pid->last);
+	pid->last = error;
+	
+	// Only integrate while the output isn't pinned in the same direction
+	if(output > limit) {
+		output = limit;
+		if(integral > pid->integral)
+			integral = pid->integral;
+	} else if(output < -limit) {
+		output = -limit;
+		if(integral < pid->integral)
+			integral = pid->integral;
+	}
+	pid->integral = integral;
+	
+	return output / PID_ONE;
+}
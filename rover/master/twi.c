@@ -18,7 +18,6 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
 #include <math.h>
-#include <stdlib.h>
 #include <inttypes.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
@@ -33,26 +32,40 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #endif
 
 #include "twi.h"
+#include "hal.h"
 
 static volatile uint8_t twi_state;
 static uint8_t twi_slarw;
 
 static void (*twi_onSlaveTransmit)(void);
+static void (*twi_onSlaveTransmitDone)(uint8_t);
 static void (*twi_onSlaveReceive)(uint8_t*, int);
 
-static uint8_t* twi_masterBuffer;
+static uint8_t twi_masterBuffer[TWI_BUFFER_LENGTH];
+static uint8_t* twi_masterData;
 static volatile uint8_t twi_masterBufferIndex;
 static uint8_t twi_masterBufferLength;
 
-static uint8_t* twi_txBuffer;
+static struct twi_transaction* twi_queue[TWI_PRIORITIES][TWI_QUEUE_LENGTH];
+static volatile uint8_t twi_queueTail[TWI_PRIORITIES];
+static volatile uint8_t twi_queueCount[TWI_PRIORITIES];
+static struct twi_transaction* volatile twi_current;
+static struct twi_transaction twi_write;
+
+static const uint8_t* twi_txData;
 static volatile uint8_t twi_txBufferIndex;
 static volatile uint8_t twi_txBufferLength;
 
-static uint8_t* twi_rxBuffer;
+static uint8_t twi_rxBuffer[TWI_BUFFER_LENGTH];
 static volatile uint8_t twi_rxBufferIndex;
+static volatile uint8_t twi_rxGeneral;
+
+static volatile uint32_t twi_clocks;
 
 static volatile uint8_t twi_error;
 
+static const uint8_t twi_zero = 0x00;	// sent when the slave tx callback gives nothing
+
 /* 
 * Function twi_init
 * Desc     readys twi pins and sets twi bitrate
@@ -77,22 +90,37 @@ void twi_init(void)
 #endif
 
     // initialize twi prescaler and bit rate
-	cbi(TWSR, TWPS0);
-	cbi(TWSR, TWPS1);
-	TWBR = ((CPU_FREQ / TWI_FREQ) - 16) / 2;
-
-/* twi bit rate formula from atmega128 manual pg 204
-SCL Frequency = CPU Clock Frequency / (16 + (2 * TWBR))
-note: TWBR should be 10 or higher for master mode
-It is 72 for a 16mhz Wiring board with 100kHz TWI */
+	twi_setFrequency(TWI_FREQ);
 
     // enable twi module, acks, and twi interrupt
 TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA);
+}
 
-    // allocate buffers
-twi_masterBuffer = (uint8_t*) calloc(TWI_BUFFER_LENGTH, sizeof(uint8_t));
-twi_txBuffer = (uint8_t*) calloc(TWI_BUFFER_LENGTH, sizeof(uint8_t));
-twi_rxBuffer = (uint8_t*) calloc(TWI_BUFFER_LENGTH, sizeof(uint8_t));
+/* 
+* Function twi_setFrequency
+* Desc     sets twi prescaler and bit rate for an SCL frequency
+* Input    frequency: SCL frequency in Hz
+* Output   none
+*/
+void twi_setFrequency(uint32_t frequency)
+{
+	uint32_t divider = (CPU_FREQ + frequency - 1) / frequency;
+	uint32_t twbr = (divider > 16)? (divider - 15) / 2 : 0;
+	uint8_t prescaler = 0;
+
+	// rounded up, so SCL is never faster than asked for; slow clocks
+	// take the prescaler, each step of it divides by 4
+	while(twbr > 255 && prescaler < 3) {
+		twbr = (twbr + 3) / 4;
+		prescaler++;
+	}
+	TWSR = prescaler;
+	TWBR = (twbr > 255)? 255 : twbr;
+
+/* twi bit rate formula from atmega128 manual pg 204
+SCL Frequency = CPU Clock Frequency / (16 + (2 * TWBR * 4^TWPS))
+note: TWBR should be 10 or higher for master mode
+It is 92 for 100kHz and 17 for 400kHz at 20MHz */
 }
 
 /* 
@@ -104,7 +132,33 @@ twi_rxBuffer = (uint8_t*) calloc(TWI_BUFFER_LENGTH, sizeof(uint8_t));
 void twi_setAddress(uint8_t address)
 {
     // set twi slave address (skip over TWGCE bit)
-	TWAR = address << 1;
+	TWAR = (address << 1) | (TWAR & _BV(TWGCE));
+}
+
+/* 
+* Function twi_setGeneralCall
+* Desc     sets whether the slave answers general calls
+* Input    enable: 1 to answer them
+* Output   none
+*/
+void twi_setGeneralCall(uint8_t enable)
+{
+	if(enable){
+		TWAR |= _BV(TWGCE);
+	}else{
+		TWAR &= ~_BV(TWGCE);
+	}
+}
+
+/* 
+* Function twi_generalCall
+* Desc     tells the slave rx callback how it was addressed
+* Input    none
+* Output   1 if the last write received was a general call
+*/
+uint8_t twi_generalCall(void)
+{
+	return twi_rxGeneral;
 }
 
 /* 
@@ -118,51 +172,28 @@ void twi_setAddress(uint8_t address)
 */
 uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length)
 {
-	uint8_t i;
+	struct twi_transaction read;
 
-    // ensure data will fit into buffer
-	if(TWI_BUFFER_LENGTH < length){
+	if(0 == length){
 		return 0;
 	}
 
-    // wait until twi is ready, become master receiver
-	while(TWI_READY != twi_state){
-		continue;
-	}
-	twi_state = TWI_MRX;
-    // reset error state (0xFF.. no error occured)
-	twi_error = 0xFF;
-
-    // initialize buffer iteration vars
-	twi_masterBufferIndex = 0;
-	twi_masterBufferLength = length-1;      // This is not intuitive, read on...
-    // On receive, the previously configured ACK/NACK setting is transmitted in
-    // response to the received byte before the interrupt is signalled. 
-    // Therefor we must actually set NACK when the _next_ to last byte is
-    // received, causing that NACK to be sent in response to receiving the last
-    // expected byte of data.
-
-    // build sla+w, slave device address + w bit
-	twi_slarw = TW_READ;
-	twi_slarw |= address << 1;
-
-    // send start condition
-	TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTA);
-
-    // wait for read operation to complete
-	while(TWI_MRX == twi_state){
-		continue;
+    // queue the read straight into data and wait for it
+	read.address = address;
+	read.read = 1;
+	read.data = data;
+	read.length = length;
+	read.retries = 0;
+	read.priority = TWI_NORMAL;
+	read.done = 0;
+	while(twi_enqueue(&read)){
+		HAL_SPIN();
 	}
-
-	if (twi_masterBufferIndex < length)
-		length = twi_masterBufferIndex;
-
-    // copy twi buffer to data
-	for(i = 0; i < length; ++i){
-		data[i] = twi_masterBuffer[i];
+	while(TWI_PENDING == read.status){
+		HAL_SPIN();
 	}
 
-	return length;
+	return read.count;
 }
 
 /* 
@@ -172,7 +203,9 @@ uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length)
 * Input    address: 7bit i2c device address
 *          data: pointer to byte array
 *          length: number of bytes in array
-*          wait: boolean indicating to wait for write or not
+*          wait: boolean indicating to wait for write or not;
+*                when waiting data goes out from the caller's
+*                array, otherwise it's copied first
 * Output   0 .. success
 *          1 .. length to long for buffer
 *          2 .. address send, NACK received
@@ -188,59 +221,225 @@ uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait
 		return 1;
 	}
 
-    // wait until twi is ready, become master transmitter
-	while(TWI_READY != twi_state){
-		continue;
+    // wait until the last write is done with the buffer
+	while(TWI_PENDING == twi_write.status){
+		HAL_SPIN();
+	}
+
+    // the caller may reuse data straight away unless it waits, so copy it
+	if(!wait){
+		for(i = 0; i < length; ++i){
+			twi_masterBuffer[i] = data[i];
+		}
+		data = twi_masterBuffer;
+	}
+
+	twi_write.address = address;
+	twi_write.read = 0;
+	twi_write.data = data;
+	twi_write.length = length;
+	twi_write.retries = 0;
+	twi_write.priority = TWI_NORMAL;
+	twi_write.done = 0;
+	while(twi_enqueue(&twi_write)){
+		HAL_SPIN();
+	}
+
+    // wait for write operation to complete
+	if(!wait){
+		return 0;
 	}
-	twi_state = TWI_MTX;
+	while(TWI_PENDING == twi_write.status){
+		HAL_SPIN();
+	}
+
+	return twi_write.status;
+}
+
+/* 
+* Function twi_begin
+* Desc     sends the start condition for a queued transaction
+* Input    transaction: the transaction to put on the bus
+* Output   none
+*/
+static void twi_begin(struct twi_transaction* transaction)
+{
+	twi_state = transaction->read ? TWI_MRX : TWI_MTX;
     // reset error state (0xFF.. no error occured)
 	twi_error = 0xFF;
 
     // initialize buffer iteration vars
+	twi_masterData = transaction->data;
 	twi_masterBufferIndex = 0;
-	twi_masterBufferLength = length;
-
-    // copy data to twi buffer
-	for(i = 0; i < length; ++i){
-		twi_masterBuffer[i] = data[i];
+	twi_masterBufferLength = transaction->length;
+	if(transaction->read){
+	    // On receive, the previously configured ACK/NACK setting is transmitted in
+	    // response to the received byte before the interrupt is signalled. 
+	    // Therefor we must actually set NACK when the _next_ to last byte is
+	    // received, causing that NACK to be sent in response to receiving the last
+	    // expected byte of data.
+		twi_masterBufferLength--;
 	}
 
-    // build sla+w, slave device address + w bit
-	twi_slarw = TW_WRITE;
-	twi_slarw |= address << 1;
+    // build sla+r/w, slave device address + r/w bit
+	twi_slarw = transaction->read ? TW_READ : TW_WRITE;
+	twi_slarw |= transaction->address << 1;
 
     // send start condition
 	TWCR = _BV(TWEN) | _BV(TWIE) | _BV(TWEA) | _BV(TWINT) | _BV(TWSTA);
+}
 
-    // wait for write operation to complete
-	while(wait && (TWI_MTX == twi_state)){
-		continue;
+/* 
+* Function twi_startNext
+* Desc     puts the oldest queued transaction of the highest priority
+*          waiting on the bus if it's free, or restarts the current one
+*          if it lost arbitration and we were addressed as a slave meanwhile
+*          must be called with interrupts off
+* Input    none
+* Output   none
+*/
+static void twi_startNext(void)
+{
+	uint8_t priority;
+
+	if(TWI_READY != twi_state){
+		return;
+	}
+	if(!twi_current){
+		for(priority = TWI_PRIORITIES - 1; !twi_queueCount[priority]; priority--){
+			if(0 == priority){
+				return;
+			}
+		}
+		twi_current = twi_queue[priority][twi_queueTail[priority]];
+		twi_queueTail[priority] = (twi_queueTail[priority] + 1) % TWI_QUEUE_LENGTH;
+		twi_queueCount[priority]--;
+	}
+	twi_begin(twi_current);
+}
+
+/* 
+* Function twi_finish
+* Desc     ends the master transfer on the bus: retries it if it failed
+*          and has retries left, otherwise completes it and starts the
+*          next one
+* Input    error: 0xFF for success or the TW_ status that failed it
+* Output   none
+*/
+static void twi_finish(uint8_t error)
+{
+	struct twi_transaction* transaction = twi_current;
+
+	twi_error = error;
+    // address and each byte take 9 clocks, start and stop about one each
+	twi_clocks += 9 * (twi_masterBufferIndex + 1) + 2;
+	if(TW_MT_ARB_LOST == error){
+		twi_releaseBus();
+	}else{
+		twi_stop();
+	}
+
+	if(transaction){
+		if((0xFF != error) && (transaction->attempts < transaction->retries)){
+			transaction->attempts++;
+			twi_begin(transaction);
+			return;
+		}
+		twi_current = 0;
+		transaction->count = twi_masterBufferIndex;
+		if(0xFF == error)
+			transaction->status = 0;	// success
+		else if((TW_MT_SLA_NACK == error) || (TW_MR_SLA_NACK == error))
+			transaction->status = 2;	// error: address send, nack received
+		else if(TW_MT_DATA_NACK == error)
+			transaction->status = 3;	// error: data send, nack received
+		else
+			transaction->status = 4;	// other twi error
+		if(transaction->done){
+			transaction->done(transaction);
+		}
 	}
+	twi_startNext();
+}
+
+/* 
+* Function twi_enqueue
+* Desc     queues a master read or write, which starts at once if the
+*          bus is free; safe to call from interrupts
+* Input    transaction: address, read, data, length, retries, priority
+*          and done filled in
+* Output   0 .. queued, status is TWI_PENDING until it's done
+*          1 .. queue full or nothing to read
+*/
+uint8_t twi_enqueue(struct twi_transaction* transaction)
+{
+	uint8_t sreg;
+	uint8_t priority = transaction->priority ? TWI_URGENT : TWI_NORMAL;
+
+	if(transaction->read && (0 == transaction->length)){
+		return 1;
+	}
+
+	sreg = SREG;
+	cli();
+	if(TWI_QUEUE_LENGTH == twi_queueCount[priority]){
+		SREG = sreg;
+		return 1;
+	}
+	transaction->attempts = 0;
+	transaction->count = 0;
+	transaction->status = TWI_PENDING;
+	twi_queue[priority][(twi_queueTail[priority] + twi_queueCount[priority]) % TWI_QUEUE_LENGTH] = transaction;
+	twi_queueCount[priority]++;
+	twi_startNext();
+	SREG = sreg;
+
+	return 0;
+}
 
-	if (twi_error == 0xFF)
-		return 0;	    // success
-	else if (twi_error == TW_MT_SLA_NACK)
-		return 2;	    // error: address send, nack received
-	else if (twi_error == TW_MT_DATA_NACK)
-		return 3;	    // error: data send, nack received
-	else
-		return 4;	    // other twi error
+/* 
+* Function twi_pending
+* Desc     counts the transactions queued or on the bus
+* Input    none
+* Output   number of transactions
+*/
+uint8_t twi_pending(void)
+{
+	return twi_queueCount[TWI_NORMAL] + twi_queueCount[TWI_URGENT] + (twi_current ? 1 : 0);
+}
+
+/* 
+* Function twi_busClocks
+* Desc     counts the SCL clocks master transfers have taken, every
+*          attempt included; over a known time it gives the bus load
+* Input    none
+* Output   clocks so far, wrapping
+*/
+uint32_t twi_busClocks(void)
+{
+	uint8_t sreg = SREG;
+	uint32_t clocks;
+
+	cli();
+	clocks = twi_clocks;
+	SREG = sreg;
+
+	return clocks;
 }
 
 /* 
 * Function twi_transmit
-* Desc     fills slave tx buffer with data
-*          must be called in slave tx event callback
+* Desc     sets the data the slave sends, without copying it;
+*          must be called in slave tx event callback, and the
+*          data left alone until the next slave event
 * Input    data: pointer to byte array
 *          length: number of bytes in array
 * Output   1 length too long for buffer
 *          2 not slave transmitter
 *          0 ok
 */
-uint8_t twi_transmit(volatile uint8_t* data, volatile uint8_t length)
+uint8_t twi_transmit(const uint8_t* data, uint8_t length)
 {
-	uint8_t i;
-
     // ensure data will fit into buffer
 	if(TWI_BUFFER_LENGTH < length){
 		return 1;
@@ -251,11 +450,9 @@ uint8_t twi_transmit(volatile uint8_t* data, volatile uint8_t length)
 		return 2;
 	}
 
-    // set length and copy data into tx buffer
+    // send straight from the caller's data
+	twi_txData = data;
 	twi_txBufferLength = length;
-	for(i = 0; i < length; ++i){
-		twi_txBuffer[i] = data[i];
-	}
 
 	return 0;
 }
@@ -282,6 +479,19 @@ void twi_attachSlaveTxEvent( void (*function)(void) )
 	twi_onSlaveTransmit = function;
 }
 
+/* 
+* Function twi_attachSlaveTxDoneEvent
+* Desc     sets function called when a slave write operation is over,
+*          with how many bytes the master clocked out; a read cut off
+*          by a bus error doesn't call it
+* Input    function: callback function to use, or 0
+* Output   none
+*/
+void twi_attachSlaveTxDoneEvent( void (*function)(uint8_t) )
+{
+	twi_onSlaveTransmitDone = function;
+}
+
 /* 
 * Function twi_reply
 * Desc     sends byte or readys receive line
@@ -336,6 +546,8 @@ void twi_releaseBus(void)
 
 SIGNAL(TWI_vect)
 {
+	PROFILE_ISR_START();
+
 	switch(TW_STATUS){
 	    // All Master
 		case TW_START:         // sent start condition
@@ -351,29 +563,26 @@ SIGNAL(TWI_vect)
 	    // if there is data to send, send it, otherwise stop 
 		if(twi_masterBufferIndex < twi_masterBufferLength){
 		    // copy data to output register and ack
-			TWDR = twi_masterBuffer[twi_masterBufferIndex++];
+			TWDR = twi_masterData[twi_masterBufferIndex++];
 			twi_reply(1);
 		}else{
-			twi_stop();
+			twi_finish(0xFF);
 		}
 		break;
 		case TW_MT_SLA_NACK:      // address sent, nack received
-		twi_error = TW_MT_SLA_NACK;
-		twi_stop();
+		twi_finish(TW_MT_SLA_NACK);
 		break;
 		case TW_MT_DATA_NACK:     // data sent, nack received
-		twi_error = TW_MT_DATA_NACK;
-		twi_stop();
+		twi_finish(TW_MT_DATA_NACK);
 		break;
 		case TW_MT_ARB_LOST:     // lost bus arbitration
-		twi_error = TW_MT_ARB_LOST;
-		twi_releaseBus();
+		twi_finish(TW_MT_ARB_LOST);
 		break;
 
 	    // Master Receiver
 		case TW_MR_DATA_ACK:     // data received, ack sent
 	    // put byte into buffer
-		twi_masterBuffer[twi_masterBufferIndex++] = TWDR;
+		twi_masterData[twi_masterBufferIndex++] = TWDR;
 		case TW_MR_SLA_ACK:      // address sent, ack received
 	    // ack if more bytes are expected, otherwise nack
 		if(twi_masterBufferIndex < twi_masterBufferLength){
@@ -384,17 +593,23 @@ SIGNAL(TWI_vect)
 		break;
 		case TW_MR_DATA_NACK:     // data received, nack sent
 	    // put final byte into buffer
-		twi_masterBuffer[twi_masterBufferIndex++] = TWDR;
+		twi_masterData[twi_masterBufferIndex++] = TWDR;
+		twi_finish(0xFF);
+		break;
 		case TW_MR_SLA_NACK:     // address sent, nack received
-		twi_stop();
+		twi_finish(TW_MR_SLA_NACK);
 		break;
 	    // TW_MR_ARB_LOST handled by TW_MT_ARB_LOST case
 
 	    // Slave Receiver
 		case TW_SR_SLA_ACK:       // addressed, returned ack
-		case TW_SR_GCALL_ACK:     // addressed generally, returned ack
 		case TW_SR_ARB_LOST_SLA_ACK:       // lost arbitration, returned ack
+		twi_rxGeneral = 0;
+		goto receive;
+		case TW_SR_GCALL_ACK:     // addressed generally, returned ack
 		case TW_SR_ARB_LOST_GCALL_ACK:     // lost arbitration, returned ack
+		twi_rxGeneral = 1;
+		receive:
 	    // enter slave receiver mode
 		twi_state = TWI_SRX;
 	    // indicate that rx buffer can be overwritten and ack
@@ -424,6 +639,7 @@ SIGNAL(TWI_vect)
 		twi_reply(1);
 	    // leave slave receiver state
 		twi_state = TWI_READY;
+		twi_startNext();
 		break;
 		case TW_SR_DATA_NACK:           // data received, returned nack
 		case TW_SR_GCALL_DATA_NACK:     // data received generally, returned nack
@@ -446,12 +662,12 @@ SIGNAL(TWI_vect)
 	    // if they didn't change buffer & length, initialize it
 		if(0 == twi_txBufferLength){
 			twi_txBufferLength = 1;
-			twi_txBuffer[0] = 0x00;
+			twi_txData = &twi_zero;
 		}
 	    // transmit first byte from buffer, fall
 		case TW_ST_DATA_ACK:     // byte sent, ack returned
 	    // copy data to output register
-		TWDR = twi_txBuffer[twi_txBufferIndex++];
+		TWDR = twi_txData[twi_txBufferIndex++];
 	    // if there is more to send, ack, otherwise nack
 		if(twi_txBufferIndex < twi_txBufferLength){
 			twi_reply(1);
@@ -461,19 +677,25 @@ SIGNAL(TWI_vect)
 		break;
 		case TW_ST_DATA_NACK:     // received nack, we are done 
 		case TW_ST_LAST_DATA:     // received ack, but we are done already!
+	    // tell the user how much of the buffer went out
+		if(twi_onSlaveTransmitDone){
+			twi_onSlaveTransmitDone(twi_txBufferIndex);
+		}
 	    // ack future responses
 		twi_reply(1);
 	    // leave slave receiver state
 		twi_state = TWI_READY;
+		twi_startNext();
 		break;
 
 	    // All
 		case TW_NO_INFO:       // no state information
 		break;
 		case TW_BUS_ERROR:     // bus error, illegal stop/start
-		twi_error = TW_BUS_ERROR;
-		twi_stop();
+		twi_finish(TW_BUS_ERROR);
 		break;
 	}
+
+	PROFILE_ISR_STOP(PROFILE_TWI);
 }
 
@@ -39,7 +39,9 @@ LICENSE:
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
+#include <string.h>
 #include "uart.h"
+#include "hal.h"
 
 
 /*
@@ -250,6 +252,7 @@ Purpose:  called when the UART has received a character
     unsigned char data;
     unsigned char usr;
     unsigned char lastRxError;
+    PROFILE_ISR_START();
  
  
     /* read UART status register and UART data register */ 
@@ -280,6 +283,7 @@ Purpose:  called when the UART has received a character
         UART_RxBuf[tmphead] = data;
     }
     UART_LastRxError = lastRxError;   
+    PROFILE_ISR_STOP(PROFILE_UART_RX);
 }
 
 
@@ -290,6 +294,7 @@ Purpose:  called when the UART is ready to transmit the next byte
 **************************************************************************/
 {
     unsigned char tmptail;
+    PROFILE_ISR_START();
 
     
     if ( UART_TxHead != UART_TxTail) {
@@ -302,6 +307,7 @@ Purpose:  called when the UART is ready to transmit the next byte
         /* tx buffer empty, disable UDRE interrupt */
         UART0_CONTROL &= ~_BV(UART0_UDRIE);
     }
+    PROFILE_ISR_STOP(PROFILE_UART_TX);
 }
 
 
@@ -425,7 +431,7 @@ void uart_putc(unsigned char data)
     tmphead  = (UART_TxHead + 1) & UART_TX_BUFFER_MASK;
     
     while ( tmphead == UART_TxTail ){
-        ;/* wait for free space in buffer */
+        HAL_SPIN(); /* wait for free space in buffer */
     }
     
     UART_TxBuf[tmphead] = data;
@@ -451,6 +457,59 @@ void uart_puts(const char *s )
 }/* uart_puts */
 
 
+/*************************************************************************
+Function: uart_write()
+Purpose:  write a block of bytes to ringbuffer for transmitting via UART
+Input:    bytes to be transmitted, and how many
+Returns:  none
+**************************************************************************/
+void uart_write(const void *data, unsigned int length)
+{
+    const unsigned char *bytes = data;
+    unsigned char start, room;
+    unsigned int span;
+
+
+    while ( length ) {
+        /* the ISR only moves the tail, which can only make more room */
+        start = (UART_TxHead + 1) & UART_TX_BUFFER_MASK;
+        room = (UART_TxTail - UART_TxHead - 1) & UART_TX_BUFFER_MASK;
+        if ( !room ) {
+            UART0_CONTROL |= _BV(UART0_UDRIE);
+            HAL_SPIN(); /* wait for free space in buffer */
+            continue;
+        }
+
+        /* as much as fits before the end of the buffer */
+        span = UART_TX_BUFFER_SIZE - start;
+        if ( span > room )
+            span = room;
+        if ( span > length )
+            span = length;
+        memcpy((unsigned char *)UART_TxBuf + start, bytes, span);
+        UART_TxHead = (start + span - 1) & UART_TX_BUFFER_MASK;
+        bytes += span;
+        length -= span;
+    }
+
+    /* enable UDRE interrupt */
+    UART0_CONTROL    |= _BV(UART0_UDRIE);
+
+}/* uart_write */
+
+
+/*************************************************************************
+Function: uart_tx_free()
+Purpose:  room left in the transmit ringbuffer
+Returns:  bytes that can be written without blocking
+**************************************************************************/
+unsigned char uart_tx_free(void)
+{
+    return (UART_TxTail - UART_TxHead - 1) & UART_TX_BUFFER_MASK;
+
+}/* uart_tx_free */
+
+
 /*************************************************************************
 Function: uart_puts_p()
 Purpose:  transmit string from program memory to UART
@@ -606,7 +665,7 @@ void uart1_putc(unsigned char data)
     tmphead  = (UART1_TxHead + 1) & UART_TX_BUFFER_MASK;
     
     while ( tmphead == UART1_TxTail ){
-        ;/* wait for free space in buffer */
+        HAL_SPIN(); /* wait for free space in buffer */
     }
     
     UART1_TxBuf[tmphead] = data;
@@ -0,0 +1,27 @@
+#ifndef PID_H
+#define PID_H
+
+#include <inttypes.h>
+
+/*
+	Fixed-point PID controller. Gains are Q8 (256 = 1.0) and the output is
+	clamped to +/- limit. The integral is held within the same limit and
+	stops growing while the output is saturated, so it can't wind up
+	during a stall or a long turn.
+*/
+
+#define PID_SHIFT 8
+#define PID_ONE (1 << PID_SHIFT)
+
+struct pid {
+	int16_t kp, ki, kd; /* Q8 */
+	int16_t limit; /* Output clamp */
+	int32_t integral; /* Q8 */
+	int16_t last; /* Error at the previous update */
+};
+
+void pid_init(struct pid *pid, int16_t kp, int16_t ki, int16_t kd, int16_t limit);
+void pid_reset(struct pid *pid);
+int16_t pid_update(struct pid *pid, int16_t error);
+
+#endif /* end of include guard: PID_H */
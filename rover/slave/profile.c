@@ -0,0 +1,160 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hal.h"
+
+/*
+	CPU time accounting, see profile.h. Copied into each firmware directory
+	like twi.c and uart.c; keep the copies the same.
+*/
+
+#if(PROFILE_ENABLED)
+
+volatile struct profile_slot profile_slots[PROFILE_SLOTS];
+volatile uint32_t profile_isr_time;
+
+static volatile uint32_t profile_overflows;
+static uint32_t profile_epoch;
+static struct profile_mark profile_idle_mark;
+static uint8_t profile_idling;
+
+static const char *profile_names[PROFILE_SLOTS] = {
+	"tick", "pcint", "int0", "int1", "adc", "twi",
+	"uart rx", "uart tx", "eeprom", "idle"
+};
+
+/* Start the timer; call from init() with interrupts still off */
+void profile_init(void) {
+#if defined(__AVR_ATmega168__)
+	TCCR2A = 0x00;
+	TCCR2B = _BV(CS22); // clk / 64, normal mode
+	TIMSK2 |= _BV(TOIE2);
+#else
+	TCCR1A = 0x00;
+	TCCR1B = _BV(CS11) | _BV(CS10); // clk / 64, normal mode
+	TIMSK1 |= _BV(TOIE1);
+#endif
+	profile_epoch = profile_now();
+}
+
+/* Timer count extended by the overflows; call with interrupts off */
+static uint32_t profile_read(void) {
+	profile_count_t count = PROFILE_TCNT;
+	uint32_t overflows = profile_overflows;
+
+	// The timer wrapped after the last overflow ISR, but it hasn't run yet
+	if((PROFILE_TIFR & _BV(PROFILE_TOV)) && !(count >> (PROFILE_BITS - 1)))
+		overflows++;
+	return (overflows << PROFILE_BITS) | count;
+}
+
+/* Timer counts since reset */
+uint32_t profile_now(void) {
+	uint8_t sreg = SREG;
+	uint32_t now;
+
+	cli();
+	now = profile_read();
+	SREG = sreg;
+	return now;
+}
+
+/* Mark the start of a main-loop span */
+void profile_begin(struct profile_mark *mark) {
+	uint8_t sreg = SREG;
+
+	cli();
+	mark->start = profile_read();
+	mark->isr = profile_isr_time;
+	SREG = sreg;
+}
+
+/* Account the time since profile_begin(), less the ISRs that ran meanwhile */
+void profile_end(struct profile_mark *mark, uint8_t slot) {
+	volatile struct profile_slot *s = &profile_slots[slot];
+	struct profile_mark now;
+	uint32_t spent;
+
+	profile_begin(&now);
+	spent = (now.start - mark->start) - (now.isr - mark->isr) / PROFILE_CYCLES;
+	s->count++;
+	s->time += spent;
+	if(spent > s->worst)
+		s->worst = spent;
+}
+
+/* The main loop has nothing to do; cheap to call on every pass */
+void profile_idle(void) {
+	if(!profile_idling) {
+		profile_begin(&profile_idle_mark);
+		profile_idling = 1;
+	}
+}
+
+/* The main loop found work; ends the idle span if there was one */
+void profile_busy(void) {
+	if(profile_idling) {
+		profile_end(&profile_idle_mark, PROFILE_IDLE);
+		profile_idling = 0;
+	}
+}
+
+static uint32_t profile_us(uint64_t cycles) {
+	return cycles / (F_CPU / 1000000UL);
+}
+
+static char *profile_field(char *p, uint32_t value) {
+	*p++ = ' ';
+	ultoa(value, p, 10);
+	return p + strlen(p);
+}
+
+/*
+	Hand put() one line per slot that has run: name, calls, total
+	microseconds, worst case in cycles and permille of the time since
+	profile_init(). Lines have no line ending. The slots are copied first,
+	so a slow put() (EEPROM) doesn't show up in its own report.
+*/
+void profile_report(void (*put)(const char *line)) {
+	struct profile_slot slots[PROFILE_SLOTS];
+	uint32_t elapsed, permille, worst;
+	uint64_t cycles;
+	uint8_t sreg = SREG;
+	char line[56];
+	char *p;
+
+	cli();
+	elapsed = profile_read() - profile_epoch;
+	memcpy(slots, (const void *)profile_slots, sizeof(slots));
+	SREG = sreg;
+
+	permille = elapsed / 1000;
+	put("profile calls us worst permille");
+	for(uint8_t i = 0; i < PROFILE_SLOTS; i++) {
+		if(slots[i].count == 0)
+			continue;
+		// ISRs are kept in cycles, spans in timer counts
+		cycles = slots[i].time;
+		worst = slots[i].worst;
+		if(PROFILE_SPAN(i)) {
+			cycles *= PROFILE_CYCLES;
+			worst *= PROFILE_CYCLES;
+		}
+		p = line + strlen(strcpy(line, profile_names[i]));
+		p = profile_field(p, slots[i].count);
+		p = profile_field(p, profile_us(cycles));
+		p = profile_field(p, worst);
+		profile_field(p, permille? cycles / PROFILE_CYCLES / permille : 0);
+		put(line);
+	}
+	p = line + strlen(strcpy(line, "elapsed"));
+	profile_field(p, profile_us((uint64_t)elapsed * PROFILE_CYCLES));
+	put(line);
+}
+
+SIGNAL(PROFILE_OVF_vect) {
+	profile_overflows++;
+}
+
+#endif
@@ -1,13 +1,24 @@
 #include <avr/io.h>
 #include <avr/interrupt.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include "pid.h"
 #include "slave.h"
 #include "twi.h"
+#include "hal.h"
 
 #if(SERIAL_ENABLED)
 #include "uart.h"
+#include "telemetry.h"
+#if(UART_BAUD_ERROR(SERIAL_BAUD, F_CPU) > UART_BAUD_TOLERANCE)
+#error "SERIAL_BAUD is too far from any rate F_CPU / 8 divides down to"
+#endif
+#if(TELE_CLOCK_HZ != RAMP_HZ)
+#error "Telemetry times are ramp ticks, TELE_CLOCK_HZ has to match RAMP_HZ"
+#endif
 #endif
 
 #if defined(SQUARE_TRACK)
@@ -26,6 +37,7 @@ void init(void) {
 	TIMSK2 = 0x00;
 	
 	// Set 8-bit timer 0 and PWM outputs OC0A(PD6) and OC0B(PD5) at clock speed
+	// (the profiler times ISRs against its count)
 	TCCR0A = _BV(COM0A1) | _BV(COM0B1) | _BV(WGM00);
 	TCCR0B = _BV(CS00); 
 	MOTORL1 = MOTORL2 = 0;
@@ -44,13 +56,39 @@ void init(void) {
 	DDRD |= _BV(3); // Enable output
 	*/
 	
+	// Timer2 free-running at clk / 64 while the servo output is unused:
+	// compare A steps the PWM ramps, the profiler times against the count
+	TCCR2A = 0x00;
+	TCCR2B = _BV(CS22);
+	OCR2A = RAMP_COUNTS;
+	TIMSK2 = _BV(OCIE2A);
+	rampLeft.step = rampRight.step = 0;
+#if(PROFILE_ENABLED)
+	profile_init();
+#endif
+	
 	MOTORL_DDR |= _BV(MOTORL1_PIN) | _BV(MOTORL2_PIN);
 	MOTORR_DDR |= _BV(MOTORR1_PIN) | _BV(MOTORR2_PIN);
 	
 	// Enable rising-edge external interrupts on INT0(pin 4) and INT1(pin 5)
 	// Warning, INT1 conflicts with OC2B (servo PWM output)
-	//EICRA = _BV(ISC11) | _BV(ISC10) | _BV(ISC01) | _BV(ISC00);
-	//EIMSK = _BV(INT1) | _BV(INT0);
+#if(SPEED_CONTROL)
+	DDRD &= ~(_BV(2) | _BV(3));
+	EICRA = _BV(ISC11) | _BV(ISC10) | _BV(ISC01) | _BV(ISC00);
+	EIMSK = _BV(INT1) | _BV(INT0);
+	pid_init(&controlLeft.pid, SPEED_KP, SPEED_KI, SPEED_KD, SPEED_LIMIT);
+	pid_init(&controlRight.pid, SPEED_KP, SPEED_KI, SPEED_KD, SPEED_LIMIT);
+	controlLeft.idle = controlRight.idle = STOP_TICKS;
+	controlLeft.direction = controlRight.direction = 1;
+#endif
+
+#if(SENSORS)
+	// ADC for single conversions against AREF, started by the ramp tick
+	ADMUX = 0x00;
+	ADCSRA = _BV(ADEN) | _BV(ADIE) | SENSOR_PRESCALE;
+	ADCSRB = 0x00;
+	DIDR0 = _BV(ADC1D) | _BV(ADC0D);
+#endif
 	
 		
 #if(TWI_ENABLED)
@@ -61,13 +99,15 @@ void init(void) {
 	// Attach TWI interrupts
 	twi_attachSlaveRxEvent(twi_rx);
 	twi_attachSlaveTxEvent(twi_tx);
+	twi_attachSlaveTxDoneEvent(twi_tx_done);
 	
-	// Set slave address
+	// Set slave address, and take the master's broadcasts too
 	twi_setAddress(TWI_SLAVE);
+	twi_setGeneralCall(1);
 	
 #endif
 	
-	uart_init(UART_BAUD_SELECT(9600, F_CPU));
+	uart_init(UART_BAUD_SELECT_NEAREST(SERIAL_BAUD, F_CPU));
 		
 	DDRD &= ~_BV(0);
 	DDRD |= _BV(1);
@@ -123,7 +163,23 @@ int main(void) {
 	}
 	*/
 	
+#if(PROFILE_ENABLED)
+	uint32_t reported = profile_now();
+#endif
 	while(1) {
+#if(PROFILE_ENABLED)
+		if(profile_now() - reported >= PROFILE_REPORT * (F_CPU / PROFILE_CYCLES)) {
+			PROFILE_IDLE_LEAVE();
+			reported = profile_now();
+			profile_report(DEBUG_STRING);
+		}
+#endif
+#if(SERIAL_ENABLED)
+		PROFILE_IDLE_LEAVE();
+		telemetry_poll();
+#endif
+		PROFILE_IDLE_ENTER();
+		HAL_SPIN();
 		//if(debug_flag) {
 		//	debug_flag=0;
 		//	uart_puts(debug_buffer);
@@ -161,7 +217,7 @@ int main(void) {
 	
 	DEBUG_STRING("done track!");
 	// Finished, do nothing
-	while(1) {}
+	HAL_HALT();
 	
 	return 0;
 }
@@ -238,65 +294,414 @@ void brake() {
 /* TWI Callbacks */
 
 void twi_rx(uint8_t* buffer, int count) {
+	uint8_t *command, *end;
+	
 	LED_PORT ^= _BV(LED_PIN);
+	faults_acknowledge();
+	
+	// An empty write is just the master checking we're there
+	if(count == 0)
+		return;
+	if((count < FRAME_OVERHEAD) || (count != buffer[0] + FRAME_OVERHEAD)) {
+		registers.faults |= FAULT_SHORT;
+		return;
+	}
+	end = buffer + count - 1;
+	if(frame_crc(buffer, count - 1) != *end) {
+		registers.faults |= FAULT_CRC;
+		return;
+	}
+	
+	// Every command has to be known and whole before any of them runs
+	for(command = buffer + 2; command < end; command += COMMAND_LENGTH(*command)) {
+		if(!COMMAND_VALID(*command)) {
+			registers.faults |= FAULT_UNKNOWN;
+			return;
+		}
+	}
+	if(command != end) {
+		registers.faults |= FAULT_SHORT;
+		return;
+	}
+	
+	// A general call goes to every board at once and isn't one of our
+	// numbered frames, so it's always applied and leaves the sequence be
+	if(twi_generalCall()) {
+		for(command = buffer + 2; command < end; command += COMMAND_LENGTH(*command))
+			command_apply(command);
+		return;
+	}
+	
+	// A retry of the last frame, the master just didn't see our ack
+	if(buffer[1] == registers.sequence)
+		return;
+	for(command = buffer + 2; command < end; command += COMMAND_LENGTH(*command))
+		command_apply(command);
+	registers.sequence = buffer[1];
+}
+
+/* Carry out one command from a checked frame */
+void command_apply(const uint8_t *command) {
+	uint8_t l1, l2, r1, r2;
+	uint8_t left = (command[0] != FORWARD_RIGHT) && (command[0] != REVERSE_RIGHT) && (command[0] != REGISTER);
+	uint8_t right = (command[0] != FORWARD_LEFT) && (command[0] != REVERSE_LEFT) && (command[0] != REGISTER);
+	int16_t duty;
+	
+	// Anything else that drives a wheel takes it off its ramp or speed loop
+	if(command[0] != RAMP) {
+		if(left)
+			rampLeft.step = 0;
+		if(right)
+			rampRight.step = 0;
+	}
+#if(SPEED_CONTROL)
+	if(command[0] != VELOCITY) {
+		if(left)
+			controlLeft.enabled = 0;
+		if(right)
+			controlRight.enabled = 0;
+	}
+#endif
 	
-	// Write command 
-	switch(buffer[0]) {
+	switch(command[0]) {
 		case FORWARD_LEFT:
-			MOTORL_FORWARD(buffer[1]);
+			MOTORL_FORWARD(command[1]);
 			break;
 		case FORWARD_RIGHT:
-			MOTORR_FORWARD(buffer[1]);
+			MOTORR_FORWARD(command[1]);
 			break;
 		case BRAKE:
-			MOTORL_BRAKE(buffer[1]);
-			MOTORR_BRAKE(buffer[1]);
+			MOTORL_BRAKE(command[1]);
+			MOTORR_BRAKE(command[1]);
 			break;
 		case REVERSE_LEFT:
-			MOTORL_REVERSE(buffer[1])
+			MOTORL_REVERSE(command[1])
 			break;
 		case REVERSE_RIGHT:
-			MOTORR_REVERSE(buffer[1])
+			MOTORR_REVERSE(command[1])
 			break;
 		case FORWARD:
-			MOTORL_FORWARD(buffer[1]);
-			MOTORR_FORWARD(buffer[1]);
+			MOTORL_FORWARD(command[1]);
+			MOTORR_FORWARD(command[1]);
 			break;
 		case TURN_LEFT:
-			MOTORL_REVERSE(buffer[1]);
-			MOTORR_FORWARD(buffer[1]);
+			MOTORL_REVERSE(command[1]);
+			MOTORR_FORWARD(command[1]);
 			break;
 		case TURN_RIGHT:
-			MOTORL_FORWARD(buffer[1]);
-			MOTORR_REVERSE(buffer[1]);
+			MOTORL_FORWARD(command[1]);
+			MOTORR_REVERSE(command[1]);
 			break;
 		case REVERSE:
-			MOTORL_REVERSE(buffer[1]);
-			MOTORR_REVERSE(buffer[1]);
+			MOTORL_REVERSE(command[1]);
+			MOTORR_REVERSE(command[1]);
 			break;
-			
-			
+		case SETPOINT:
+			l1 = (command[1] & SETPOINT_LEFT_REVERSE)? 0 : command[2];
+			l2 = (command[1] & SETPOINT_LEFT_REVERSE)? command[2] : 0;
+			r1 = (command[1] & SETPOINT_RIGHT_REVERSE)? 0 : command[3];
+			r2 = (command[1] & SETPOINT_RIGHT_REVERSE)? command[3] : 0;
+			// Both wheels change together
+			MOTORL1 = l1;
+			MOTORL2 = l2;
+			MOTORR1 = r1;
+			MOTORR2 = r2;
+			break;
+		case RAMP:
+			ramp_start(&rampLeft, (int16_t)MOTORL1 - MOTORL2, command[1] & SETPOINT_LEFT_REVERSE, command[2], command[4]);
+			ramp_start(&rampRight, (int16_t)MOTORR1 - MOTORR2, command[1] & SETPOINT_RIGHT_REVERSE, command[3], command[5]);
+			// Wheels that were braking start from 0
+			duty = rampLeft.duty >> 8;
+			MOTORL_SET(duty);
+			duty = rampRight.duty >> 8;
+			MOTORR_SET(duty);
+			break;
+#if(SPEED_CONTROL)
+		case VELOCITY:
+			speed_start(&controlLeft, command[1] | (command[2] << 8));
+			speed_start(&controlRight, command[3] | (command[4] << 8));
+			break;
+#endif
+		case REGISTER:
+			if(command[1] < sizeof(registers))
+				register_pointer = command[1];
+			else
+				registers.faults |= FAULT_REGISTER;
+			break;
+	}
+}
+
+/* Aim a wheel's ramp at a new target, from the PWM applied if it wasn't ramping */
+void ramp_start(struct ramp *ramp, int16_t applied, uint8_t reverse, uint8_t target, uint8_t acceleration) {
+	if(!ramp->step)
+		ramp->duty = (int32_t)applied * 256;
+	ramp->target = reverse? -(int16_t)target : target;
+	ramp->step = (uint16_t)acceleration * 4;
+	if(!ramp->step)
+		ramp->duty = (int32_t)ramp->target * 256;
+}
+
+/* One RAMP_HZ step towards the target; returns 1 if the PWM needs updating */
+uint8_t ramp_step(struct ramp *ramp) {
+	int32_t target = (int32_t)ramp->target * 256;
+	
+	if(!ramp->step)
+		return 0;
+	if(ramp->duty < target) {
+		ramp->duty += ramp->step;
+		if(ramp->duty > target)
+			ramp->duty = target;
+	} else {
+		ramp->duty -= ramp->step;
+		if(ramp->duty < target)
+			ramp->duty = target;
 	}
+	if(ramp->duty == target)
+		ramp->step = 0;
+	return 1;
+}
+
+#if(SPEED_CONTROL)
+/*
+	Timer2 at clk / 64, extended to 16 bits by the ramp ticks. Right from
+	an ISR even with the compare A interrupt due but not yet taken, as
+	long as that's less than 6 counts (19 us) late.
+*/
+uint16_t clock_stamp(void) {
+	return rampClock + (uint8_t)(TCNT2 - (uint8_t)(OCR2A - RAMP_COUNTS));
+}
+
+/* Time an encoder edge; returns the count step, in the direction driven */
+int8_t edge_record(struct wheel_control *wheel, int16_t applied) {
+	uint16_t stamp = clock_stamp();
+	uint16_t gap = stamp - wheel->edge;
+	uint8_t stopped = (wheel->idle >= STOP_TICKS);
+	int8_t direction = wheel->direction;
+	
+	// Driven the other way, it keeps going the old way until it slows right down
+	if(((applied > 0) != (direction > 0)) && applied && (stopped || (gap > EDGE_REVERSE)))
+		direction = -direction;
+	
+	// A reversal, bounce or the first edge after stopping leaves no period
+	if((direction != wheel->direction) || (gap < EDGE_GLITCH) || stopped)
+		wheel->period = 0;
+	else
+		wheel->period = gap;
+	wheel->direction = direction;
+	wheel->edge = stamp;
+	wheel->idle = 0;
+	return direction;
+}
 
+/* Put a wheel under speed control, from a clean PID if it wasn't already */
+void speed_start(struct wheel_control *wheel, int16_t target) {
+	if(!wheel->enabled)
+		pid_reset(&wheel->pid);
+	wheel->target = target;
+	wheel->enabled = 1;
 }
 
+/* Once per speed loop tick: the speed, falling away as the edges stop */
+void speed_update(struct wheel_control *wheel) {
+	uint16_t elapsed;
+	
+	if(wheel->idle < STOP_TICKS)
+		wheel->idle++;
+	if(wheel->idle >= STOP_TICKS) {
+		wheel->speed = 0;
+		wheel->period = 0;
+	} else if(wheel->period) {
+		elapsed = clock_stamp() - wheel->edge;
+		wheel->speed = (int16_t)(EDGE_HZ / MAX(wheel->period, elapsed)) * wheel->direction;
+	}
+}
+
+/* PWM for a wheel under speed control: feedforward on the target plus the PID */
+int16_t speed_output(struct wheel_control *wheel) {
+	int16_t duty;
+	
+	if(wheel->target == 0) {
+		pid_reset(&wheel->pid);
+		return 0;
+	}
+	duty = (int32_t)wheel->target * SPEED_KF / 256
+		+ pid_update(&wheel->pid, CONSTRAIN(wheel->target - wheel->speed, -1000, 1000));
+	return CONSTRAIN(duty, -255, 255);
+}
+#endif
+
+/* CRC-8 of a frame's bytes, polynomial 0x07 */
+uint8_t frame_crc(const uint8_t *data, uint8_t length) {
+	uint8_t crc = 0;
+	
+	while(length--)
+		crc = _crc8_ccitt_update(crc, *data++);
+	return crc;
+}
+
+/* Master read: the register map from the pointer on, in one burst */
 void twi_tx(void) {
-	// Send data value back as little-endian value
-	twi_transmit((char *)txValue, 2);
+	faults_acknowledge();
+	registers.left = (int16_t)MOTORL1 - MOTORL2;
+	registers.right = (int16_t)MOTORR1 - MOTORR2;
+	registers.encoder_left = encoderLeft;
+	registers.encoder_right = encoderRight;
+#if(SPEED_CONTROL)
+	registers.speed_left = controlLeft.speed;
+	registers.speed_right = controlRight.speed;
+#endif
+#if(SENSORS)
+	for(uint8_t i = 0; i < SENSOR_CHANNELS; i++)
+		registers.sensors[i] = sensorValues[i];
+	registers.sensor_age = (uint32_t)(uint16_t)(rampTicks - sensorStamp) * 1000 / RAMP_HZ;
+	registers.sensor_seq = sensorSeq;
+#endif
+	twi_transmit((const uint8_t *)&registers + register_pointer, sizeof(registers) - register_pointer);
 }
 
+/* Master read over. The map goes out from in place, so faults can't be
+   cleared until then, and only if the master read as far as them. */
+void twi_tx_done(uint8_t sent) {
+	if(register_pointer <= REG_FAULTS && sent > REG_FAULTS - register_pointer)
+		faults_sent = registers.faults;
+}
+
+/* Clear the faults the master has read; any since then stay set */
+void faults_acknowledge(void) {
+	registers.faults &= ~faults_sent;
+	faults_sent = 0;
+}
+
+#endif
+
+
+
+/* PWM ramps, RAMP_HZ, and the speed loops every SPEED_DIVIDER of those */
+SIGNAL(TIMER2_COMPA_vect) {
+	int16_t duty;
+	
+	PROFILE_ISR_START();
+	rampClock += RAMP_COUNTS;
+	rampTicks++;
+	OCR2A += RAMP_COUNTS;
+	if(ramp_step(&rampLeft)) {
+		duty = rampLeft.duty >> 8;
+		MOTORL_SET(duty);
+	}
+	if(ramp_step(&rampRight)) {
+		duty = rampRight.duty >> 8;
+		MOTORR_SET(duty);
+	}
+#if(SPEED_CONTROL)
+	if(++speedCount >= SPEED_DIVIDER) {
+		speedCount = 0;
+		speed_update(&controlLeft);
+		speed_update(&controlRight);
+		if(controlLeft.enabled) {
+			duty = speed_output(&controlLeft);
+			MOTORL_SET(duty);
+		}
+		if(controlRight.enabled) {
+			duty = speed_output(&controlRight);
+			MOTORR_SET(duty);
+		}
+	}
 #endif
+#if(SENSORS)
+	if(++sensorCount >= SENSOR_DIVIDER) {
+		sensorCount = 0;
+		sensors_start();
+	}
+#endif
+	PROFILE_ISR_STOP(PROFILE_TICK);
+}
 
+#if(SENSORS)
+/* Start a block of sensor samples at the first channel */
+void sensors_start(void) {
+	if(sensorCurrent != SENSOR_IDLE) {
+		sensorOverruns++;
+		return;
+	}
+	sensorCurrent = 0;
+	ADMUX = 0;
+	ADCSRA |= _BV(ADSC);
+}
 
+/* Median of three */
+uint16_t median3(uint16_t a, uint16_t b, uint16_t c) {
+	if(a > b) {
+		uint16_t t = a;
+		a = b;
+		b = t;
+	}
+	return (c <= a)? a : (c >= b)? b : c;
+}
+
+/* Decimate a finished burst and filter it; returns the filtered value, 12-bit */
+uint16_t sensor_sample(struct sensor_filter *filter) {
+	uint16_t sample = (filter->sum >> 1) << 1; // 11 bits on a 12-bit scale
+	uint16_t filtered = sample;
+	
+	if(filter->ready)
+		filtered = median3(sample, filter->samples[0], filter->samples[1]);
+	else
+		filter->samples[0] = sample;
+	filter->samples[1] = filter->samples[0];
+	filter->samples[0] = sample;
+	if(filter->ready)
+		filter->iir += (int16_t)((filtered << 1) - filter->iir) >> 1;
+	else
+		filter->iir = filtered << 1;
+	filter->ready = 1;
+	filter->sum = 0;
+	filter->count = 0;
+	return filter->iir >> 1;
+}
+
+/* Sensor conversions: sum the burst, then move on to the next channel */
+SIGNAL(ADC_vect) {
+	PROFILE_ISR_START();
+	struct sensor_filter *filter = &sensorFilters[sensorCurrent];
+	
+	filter->sum += ADC;
+	if(++filter->count < SENSOR_BURST) {
+		ADCSRA |= _BV(ADSC);
+	} else {
+		sensorValues[sensorCurrent] = sensor_sample(filter);
+		if(++sensorCurrent < SENSOR_CHANNELS) {
+			ADMUX = sensorCurrent;
+			ADCSRA |= _BV(ADSC);
+		} else {
+			sensorCurrent = SENSOR_IDLE;
+			sensorStamp = rampTicks;
+			sensorSeq++;
+		}
+	}
+	PROFILE_ISR_STOP(PROFILE_ADC);
+}
+#endif
 
 SIGNAL(INT0_vect) {
+	PROFILE_ISR_START();
+#if(SPEED_CONTROL)
+	encoderLeft += edge_record(&controlLeft, (int16_t)MOTORL1 - MOTORL2);
+#else
 	encoderLeft++;
+#endif
 	LED_PORT ^= _BV(LED_PIN);
+	PROFILE_ISR_STOP(PROFILE_INT0);
 }
 
 SIGNAL(INT1_vect) {
+	PROFILE_ISR_START();
+#if(SPEED_CONTROL)
+	encoderRight += edge_record(&controlRight, (int16_t)MOTORR1 - MOTORR2);
+#else
 	encoderRight++;
+#endif
 	LED_PORT ^= _BV(LED_PIN);
+	PROFILE_ISR_STOP(PROFILE_INT1);
 }
 
 
@@ -313,23 +718,83 @@ void LED_OFF() {
 }
 
 
+/* Send a line of text as a telemetry frame */
 void DEBUG_STRING(const char *str) {
 #if(SERIAL_ENABLED)
-	uart_puts(str);
-	uart_puts("\n\r");
+	telemetry_send(TELE_TEXT, ramp_now(), 0, 0, str);
 #endif
 }
 
+/* Send a named number as a telemetry frame, the name after the value */
 void DEBUG_NUMBER(const char *name, uint16_t num) {
 #if(SERIAL_ENABLED)
-	char snum[8];
-	itoa(num, snum, 10);
-	uart_puts(name);
-	uart_putc('=');
-	uart_puts(snum);
-	uart_puts("\n\r");
+	int16_t value = num;
+	
+	telemetry_send(TELE_NUMBER, ramp_now(), &value, 1, name);
 #endif
 }
 
+#if(SERIAL_ENABLED)
+/* Ramp ticks so far, for telemetry times */
+uint16_t ramp_now(void) {
+	uint8_t sreg = SREG;
+	uint16_t now;
+	
+	cli();
+	now = rampTicks;
+	SREG = sreg;
+	return now;
+}
+
+/* Send each telemetry channel that's due; called from the main loop */
+void telemetry_poll(void) {
+	uint16_t now = ramp_now();
+	int16_t values[6];
+	uint8_t sreg = SREG;
+	
+	if(telemetry_due(TELE_WHEELS, now)) {
+		cli();
+		values[0] = (int16_t)MOTORL1 - MOTORL2;
+		values[1] = (int16_t)MOTORR1 - MOTORR2;
+		values[2] = rampLeft.target;
+		values[3] = rampRight.target;
+		SREG = sreg;
+		telemetry_send(TELE_WHEELS, now, values, 4, 0);
+	}
+#if(SPEED_CONTROL)
+	if(telemetry_due(TELE_SPEED, now)) {
+		cli();
+		values[0] = encoderLeft;
+		values[1] = encoderRight;
+		values[2] = controlLeft.speed;
+		values[3] = controlRight.speed;
+		values[4] = controlLeft.enabled? controlLeft.target : 0;
+		values[5] = controlRight.enabled? controlRight.target : 0;
+		SREG = sreg;
+		telemetry_send(TELE_SPEED, now, values, 6, 0);
+	}
+#endif
+#if(SENSORS)
+	if(telemetry_due(TELE_SENSORS, now)) {
+		cli();
+		values[0] = sensorValues[0];
+		values[1] = sensorValues[1];
+		values[2] = (uint32_t)(uint16_t)(now - sensorStamp) * 1000 / RAMP_HZ;
+		values[3] = sensorOverruns;
+		SREG = sreg;
+		telemetry_send(TELE_SENSORS, now, values, 4, 0);
+	}
+#endif
+	if(telemetry_due(TELE_LINK, now)) {
+		cli();
+		values[0] = registers.sequence;
+		values[1] = registers.faults;
+		SREG = sreg;
+		values[2] = telemetry_frames();
+		telemetry_send(TELE_LINK, now, values, 3, 0);
+	}
+}
+#endif
+
 
 
@@ -4,17 +4,40 @@
 #define SQUARE_TRACK
 //#define ZIGZAG_TRACK
 
-/* Clock speed of the AVR CPU */
+/* Clock speed of the AVR CPU, normally from the Makefile */
 #ifndef F_CPU
-#define F_CPU 16000000
+#define F_CPU 20000000UL
 #endif
 
 #define STARTUP_DELAY 2000
 
 #define SERIAL_ENABLED 1
 
+/* Serial port speed, set in double speed mode to the nearest F_CPU / 8
+   divider; the build stops if that's more than UART_BAUD_TOLERANCE off.
+   The telemetry is binary and read by teledecode, not a terminal, so it
+   runs well above 9600 */
+#ifndef SERIAL_BAUD
+#define SERIAL_BAUD 250000
+#endif
+
+/* Seconds between profile reports on the serial port */
+#define PROFILE_REPORT 5
+
 #define TWI_ENABLED 1
 
+/* Count the encoders on INT0/INT1 and hold each wheel at the speed the
+   master sets with VELOCITY */
+#ifndef SPEED_CONTROL
+#define SPEED_CONTROL 0
+#endif
+
+/* Sample the rangers on ADC0/ADC1 and publish them filtered in the
+   register map, for the master to read in one burst */
+#ifndef SENSORS
+#define SENSORS 0
+#endif
+
 /* Status LED */
 #define LED_PORT PORTB
 #define LED_DDR DDRB
@@ -44,12 +67,54 @@
 #define MOTORR_REVERSE(x) {MOTORR1 = 0; MOTORR2 = x;}
 #define MOTORR_BRAKE(x) {MOTORR1 = x; MOTORR2 = x;}
 
+#define MOTORL_SET(x) {if((x) < 0) MOTORL_REVERSE(-(x)) else MOTORL_FORWARD(x)}
+#define MOTORR_SET(x) {if((x) < 0) MOTORR_REVERSE(-(x)) else MOTORR_FORWARD(x)}
+
 #define MOTOR_SPEED 255
 
+/* Wheel speed loop, every SPEED_DIVIDER ramp ticks. Encoder edges are
+   timed against Timer2 at clk / 64, extended by the ramp ticks; speed is
+   the time across the last gap, or since the newest edge if that's longer. */
+#define SPEED_DIVIDER 5
+#define SPEED_HZ (RAMP_HZ / SPEED_DIVIDER)
+#define EDGE_HZ (F_CPU / 64)
+#define EDGE_GLITCH (EDGE_HZ / 20000) /* Edges closer than 50 us are bounce */
+#define EDGE_REVERSE (EDGE_HZ / 60) /* Only one channel: a wheel driven the other
+	way is taken to have turned round once it's below 60 ticks per second */
+#define STOP_TICKS (80 * SPEED_HZ / 1000) /* No edge for 80 ms: stopped */
+#define SPEED_MAX 420 /* Ticks per second at full PWM, for the feedforward */
+#define SPEED_KF (255L * 256 / SPEED_MAX) /* Q8, PWM per tick per second */
+#ifndef SPEED_KP
+#define SPEED_KP 128 /* Q8 gains on the speed error in ticks per second */
+#endif
+#ifndef SPEED_KI
+#define SPEED_KI 24
+#endif
+#ifndef SPEED_KD
+#define SPEED_KD 0
+#endif
+#ifndef SPEED_LIMIT
+#define SPEED_LIMIT 80 /* PWM the PID can add to the feedforward, either way */
+#endif
+
+#define MIN(x, y) ((x < y)? x : y)
+#define MAX(x, y) ((x < y)? y : x)
+#define CONSTRAIN(x, low, high) (MIN(high, MAX(low, x)))
+
 #define TICKS_PER_DEGREE 1
 #define TICKS_PER_METRE 300
 #define BRAKE_TIME 1000
 
+/* Sensors: every SENSOR_DIVIDER ramp ticks (50 Hz) each channel gets a
+   burst of SENSOR_BURST conversions summed to 11 bits, then the median of
+   the last three and an IIR of weight 1/2, like the master's rangers. The
+   block goes into the register map once all the channels are done. */
+#define SENSOR_CHANNELS 2
+#define SENSOR_DIVIDER 25
+#define SENSOR_BURST 4
+#define SENSOR_IDLE 0xFF
+#define SENSOR_PRESCALE (_BV(ADPS2) | _BV(ADPS1) | _BV(ADPS0)) /* clk / 128, 156 KHz at 20 MHz */
+
 /* Servo motor(s) */
 #define SERVO_MIN 950 // TODO: recalculate this value for 8-bit control
 #define SERVO1 OCR2B
@@ -76,6 +141,71 @@
 #define TURN_RIGHT 7
 #define TURN_LEFT 8
 #define REVERSE 9
+#define SETPOINT 10 /* Both wheels at once, signed: reverse bits, left speed, right speed */
+#define SETPOINT_LENGTH 4
+#define SETPOINT_LEFT_REVERSE 0x01
+#define SETPOINT_RIGHT_REVERSE 0x02
+
+/* Ramp both wheels towards signed targets: reverse bits as for SETPOINT,
+   left target, right target, left acceleration, right acceleration.
+   Timer2 compare A steps each wheel's PWM by acceleration / 64 every
+   RAMP_HZ tick until it gets there; 0 goes straight to the target. Any
+   other command for a wheel stops its ramp where it is. */
+#define RAMP 12
+#define RAMP_LENGTH 6
+#define RAMP_HZ 1250
+#define RAMP_COUNTS (F_CPU / 64 / RAMP_HZ) /* Timer2 counts at clk / 64 */
+#define RAMP_RATE(counts) ((uint8_t)((counts) * 64UL / RAMP_HZ)) /* Acceleration for PWM counts per second */
+
+/* Hold both wheels at signed speeds in encoder ticks per second, each a
+   little-endian int16: left, then right. Only in a SPEED_CONTROL build;
+   any other command for a wheel takes it off speed control. */
+#define VELOCITY 13
+#define VELOCITY_LENGTH 5
+
+/* Slave register map, read back over TWI: REGISTER points at an offset,
+   then each read returns the bytes from there to the end of the map.
+   The pointer stays put, so the master can poll a block with reads alone.
+   Little-endian, like both AVRs. */
+#define REGISTER 11
+
+struct slave_registers {
+	int16_t left, right; /* PWM as applied, -255 .. 255, 0 braking */
+	uint8_t sequence; /* Of the last frame applied */
+	uint8_t faults; /* FAULT_* seen since the faults were last read */
+	int32_t encoder_left, encoder_right; /* INT0/INT1 edges, back for reverse (SPEED_CONTROL) */
+	int16_t speed_left, speed_right; /* Ticks per second (SPEED_CONTROL) */
+	uint16_t sensors[SENSOR_CHANNELS]; /* Rangers, filtered, 12-bit (SENSORS) */
+	uint16_t sensor_age; /* Milliseconds since they were sampled, as the read starts */
+	uint8_t sensor_seq; /* Bumped with each new block */
+} __attribute__((__packed__));
+
+#define REG_LEFT offsetof(struct slave_registers, left)
+#define REG_SEQUENCE offsetof(struct slave_registers, sequence)
+#define REG_FAULTS offsetof(struct slave_registers, faults)
+#define REG_ENCODERS offsetof(struct slave_registers, encoder_left)
+#define REG_SPEEDS offsetof(struct slave_registers, speed_left)
+#define REG_SENSORS offsetof(struct slave_registers, sensors)
+
+#define FAULT_SHORT 0x01 /* Frame or command without all its bytes */
+#define FAULT_UNKNOWN 0x02 /* No such command */
+#define FAULT_REGISTER 0x04 /* REGISTER past the end of the map */
+#define FAULT_CRC 0x08 /* Frame failed its CRC */
+
+/* Commands go over in frames: length, sequence, the commands back to
+   back, CRC-8. length counts the command bytes, and the CRC (polynomial
+   0x07, _crc8_ccitt_update() from util/crc16.h) covers everything before
+   it. The slave checks the whole frame before acting on any of it, then
+   sets REG_SEQUENCE to its sequence. A frame carrying the sequence it
+   already has is a retry whose ack got lost, and isn't applied twice.
+   A frame sent as a general call reaches every board together and is
+   applied whatever its sequence, without changing REG_SEQUENCE. */
+#define FRAME_OVERHEAD 3
+#define FRAME_COMMANDS 8 /* Command bytes one frame can carry */
+#define FRAME_LENGTH (FRAME_COMMANDS + FRAME_OVERHEAD)
+#define COMMAND_LENGTH(code) (((code) == SETPOINT)? SETPOINT_LENGTH : ((code) == RAMP)? RAMP_LENGTH : \
+	((code) == VELOCITY)? VELOCITY_LENGTH : 2)
+#define COMMAND_VALID(code) (((code) >= FORWARD_LEFT) && ((code) <= (SPEED_CONTROL? VELOCITY : RAMP)))
 
 /* Data types */
 struct checkpoint {
@@ -85,16 +215,64 @@ struct checkpoint {
 	uint8_t sensor_flags; /* Bitfield indicating sensors that can be trusted near checkpoint */
 } __attribute__((__packed__));
 
+/* A wheel's PWM ramp, run from the Timer2 compare A interrupt */
+struct ramp {
+	int32_t duty; /* PWM as applied, in 1/256 counts */
+	int16_t target; /* -255 .. 255 */
+	uint16_t step; /* 1/256 counts per RAMP_HZ tick, 0 when not ramping */
+};
+
+/* A wheel's encoder timing and speed loop */
+struct wheel_control {
+	uint16_t edge; /* clock_stamp() at the last edge */
+	uint16_t period; /* Stamp counts between the last two edges, 0 if not known */
+	uint8_t idle; /* Speed loop ticks since the last edge */
+	int8_t direction; /* Of the PWM last applied, 1 or -1 */
+	int16_t speed; /* Ticks per second */
+	int16_t target; /* Ticks per second, while enabled */
+	uint8_t enabled;
+	struct pid pid;
+};
+
+/* A sensor channel's burst and filter */
+struct sensor_filter {
+	uint16_t sum; /* Conversions in the burst so far */
+	uint8_t count;
+	uint16_t samples[2]; /* The last two decimated, newest first */
+	uint16_t iir; /* 12-bit plus a fraction bit */
+	uint8_t ready;
+};
+
 /* Global variables */
 
-// Output value to send back to master
-volatile uint16_t txValue;
+// Register map and where the next read starts in it
+struct slave_registers registers;
+uint8_t register_pointer;
+uint8_t faults_sent; /* In the last register read that reached them, cleared at the next TWI event */
+
+// PWM ramps
+struct ramp rampLeft, rampRight;
+
+// Speed loops, and Timer2 extended by the ramp ticks
+struct wheel_control controlLeft, controlRight;
+uint16_t rampClock;
+uint16_t rampTicks;
+uint8_t speedCount;
+
+// Sensor sampling, and the last block finished for the register map
+struct sensor_filter sensorFilters[SENSOR_CHANNELS];
+uint8_t sensorCurrent = SENSOR_IDLE;
+uint8_t sensorCount;
+uint16_t sensorOverruns; /* Blocks that came due before the last was done */
+uint16_t sensorValues[SENSOR_CHANNELS];
+uint16_t sensorStamp; /* rampTicks when the block was done */
+uint8_t sensorSeq;
 
 // Current checkpoint
 struct checkpoint *goal;
 
 // Encoder counts
-uint32_t encoderLeft, encoderRight;
+int32_t encoderLeft, encoderRight;
 
 /* Interrupt debug messages */
 int debug_flag = 0;
@@ -111,6 +289,20 @@ void brake(void);
 
 void twi_rx(uint8_t* buffer, int count);
 void twi_tx(void);
+void twi_tx_done(uint8_t sent);
+void faults_acknowledge(void);
+void command_apply(const uint8_t *command);
+void ramp_start(struct ramp *ramp, int16_t applied, uint8_t reverse, uint8_t target, uint8_t acceleration);
+uint8_t ramp_step(struct ramp *ramp);
+uint16_t clock_stamp(void);
+int8_t edge_record(struct wheel_control *wheel, int16_t applied);
+void speed_start(struct wheel_control *wheel, int16_t target);
+void speed_update(struct wheel_control *wheel);
+int16_t speed_output(struct wheel_control *wheel);
+void sensors_start(void);
+uint16_t sensor_sample(struct sensor_filter *filter);
+uint16_t median3(uint16_t a, uint16_t b, uint16_t c);
+uint8_t frame_crc(const uint8_t *data, uint8_t length);
 
 void LED_ON(void);
 void LED_OFF(void);
@@ -118,6 +310,8 @@ void LED_OFF(void);
 
 void DEBUG_STRING(const char *str);
 void DEBUG_NUMBER(const char *name, uint16_t num);
+uint16_t ramp_now(void);
+void telemetry_poll(void);
 #if(SERIAL_ENABLED)
 #define DEBUG_CHAR(x) uart_putc(x)
 #else
@@ -0,0 +1,138 @@
+/*
+	Turn the slave's serial telemetry back into CSV, one row per value:
+	time in seconds, channel, field, value. Text goes in the value column,
+	quoted; a number's name is its field. Reads a file, or stdin, and
+	counts damaged and lost frames on stderr at the end. Built for the
+	host with make teledecode.
+*/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "telemetry.h"
+
+#define TELE_NAME(id, name, hz, fields) name,
+#define TELE_FIELDS(id, name, hz, fields) fields,
+static const char *channel_names[] = { TELE_CHANNELS(TELE_NAME) };
+static const char *channel_fields[] = { TELE_CHANNELS(TELE_FIELDS) };
+
+static unsigned long frames, damaged, lost;
+static double seconds;
+static int started;
+static uint8_t sequence;
+static uint16_t clock;
+
+/* CRC-CCITT as avr-libc's _crc_ccitt_update() */
+static uint16_t crc_ccitt(uint16_t crc, uint8_t data) {
+	crc ^= data;
+	for(int i = 0; i < 8; i++)
+		crc = (crc & 1)? (crc >> 1) ^ 0x8408 : crc >> 1;
+	return crc;
+}
+
+/* Undo COBS; returns the decoded length, or -1 if the codes don't fit */
+static int cobs_decode(const uint8_t *in, int length, uint8_t *out) {
+	int at = 0, n = 0, code;
+
+	while(at < length) {
+		code = in[at++];
+		if(!code || at + code - 1 > length)
+			return -1;
+		memcpy(out + n, in + at, code - 1);
+		n += code - 1;
+		at += code - 1;
+		if(at < length)
+			out[n++] = 0;
+	}
+	return n;
+}
+
+/* Print one decoded frame */
+static void frame(const uint8_t *data, int length) {
+	const char *field, *end;
+	uint16_t crc = 0xFFFF, time;
+	int i, n;
+
+	if(length < TELE_HEADER + 2 || data[0] >= TELE_CHANNEL_COUNT) {
+		damaged++;
+		return;
+	}
+	for(i = 0; i < length - 2; i++)
+		crc = crc_ccitt(crc, data[i]);
+	if(crc != (data[length - 2] | data[length - 1] << 8)) {
+		damaged++;
+		return;
+	}
+	length -= 2;
+
+	// Times wrap every 52 s, so unwrap them against the last frame
+	time = data[2] | data[3] << 8;
+	if(started) {
+		lost += (uint8_t)(data[1] - sequence - 1);
+		seconds += (double)(uint16_t)(time - clock) / TELE_CLOCK_HZ;
+	} else {
+		seconds = (double)time / TELE_CLOCK_HZ;
+		started = 1;
+	}
+	sequence = data[1];
+	clock = time;
+	frames++;
+
+	field = channel_fields[data[0]];
+	for(i = TELE_HEADER, n = 0; *field && i + 2 <= length; i += 2, n++) {
+		end = strchr(field, ',');
+		if(!end)
+			end = field + strlen(field);
+		if(data[0] == TELE_NUMBER)
+			printf("%.3f,%s,%.*s,%d\n", seconds, channel_names[data[0]],
+				length - i - 2, (const char *)data + i + 2, (int16_t)(data[i] | data[i + 1] << 8));
+		else
+			printf("%.3f,%s,%.*s,%d\n", seconds, channel_names[data[0]], (int)(end - field), field,
+				(int16_t)(data[i] | data[i + 1] << 8));
+		field = *end? end + 1 : end;
+	}
+	if(data[0] == TELE_TEXT) {
+		printf("%.3f,%s,,\"", seconds, channel_names[data[0]]);
+		for(; i < length; i++) {
+			if(data[i] == '"')
+				putchar('"');
+			putchar((data[i] == '\n' || data[i] == '\r')? ' ' : data[i]);
+		}
+		printf("\"\n");
+	}
+}
+
+int main(int argc, char **argv) {
+	uint8_t in[TELE_FRAME + 2], out[TELE_FRAME + 2];
+	int c, length = 0, n;
+	FILE *f = stdin;
+
+	if(argc > 2) {
+		fprintf(stderr, "usage: %s [telemetry.bin] > run.csv\n", argv[0]);
+		return 2;
+	}
+	if(argc == 2 && !(f = fopen(argv[1], "rb"))) {
+		perror(argv[1]);
+		return 1;
+	}
+
+	printf("time,channel,field,value\n");
+	while((c = getc(f)) != EOF) {
+		if(c) {
+			// A frame too long to be one is junk up to the next 0
+			if(length < (int)sizeof(in))
+				in[length] = c;
+			length++;
+			continue;
+		}
+		if(length > (int)sizeof(in) || (n = cobs_decode(in, length, out)) < 0) {
+			if(length)
+				damaged++;
+		} else if(n) {
+			frame(out, n);
+		}
+		length = 0;
+	}
+	fprintf(stderr, "teledecode: %lu frames, %lu damaged, %lu lost\n", frames, damaged, lost);
+	return 0;
+}
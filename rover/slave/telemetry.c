@@ -0,0 +1,72 @@
+#include <avr/io.h>
+#include <util/crc16.h>
+#include "telemetry.h"
+#include "uart.h"
+
+#define TELE_INTERVAL(id, name, hz, fields) (hz)? TELE_CLOCK_HZ / (hz) : 0,
+static const uint16_t tele_intervals[TELE_CHANNEL_COUNT] = { TELE_CHANNELS(TELE_INTERVAL) };
+static uint16_t tele_last[TELE_CHANNEL_COUNT]; /* Time of each channel's last frame */
+static uint8_t tele_sent[TELE_CHANNEL_COUNT]; /* It's sent one */
+static uint8_t tele_sequence;
+static uint16_t tele_frames;
+
+// The frame being encoded: COBS code bytes are filled in as each run
+// of non-zero bytes ends, and the spare byte at the end holds the 0
+// that ends it
+static uint8_t tele_frame[1 + TELE_FRAME + 1];
+static uint8_t tele_length; /* Bytes in tele_frame */
+static uint8_t tele_code; /* Where the code byte for the current run goes */
+static uint16_t tele_crc;
+
+/* Add a byte to the frame, COBS encoding it as it goes */
+static void tele_put(uint8_t byte) {
+	tele_crc = _crc_ccitt_update(tele_crc, byte);
+	if(byte) {
+		tele_frame[tele_length++] = byte;
+	} else {
+		tele_frame[tele_code] = tele_length - tele_code;
+		tele_code = tele_length++;
+	}
+}
+
+/* Is it time the channel sent again? If so, the time is taken as its last frame */
+uint8_t telemetry_due(uint8_t channel, uint16_t now) {
+	if(tele_sent[channel] && ((uint16_t)(now - tele_last[channel]) < tele_intervals[channel]))
+		return 0;
+	tele_sent[channel] = 1;
+	tele_last[channel] = now;
+	return 1;
+}
+
+/* Send count values and any text, cut to fit, as one frame; waits for room in the UART */
+void telemetry_send(uint8_t channel, uint16_t now, const int16_t *values, uint8_t count, const char *text) {
+	uint8_t room = TELE_PAYLOAD;
+	uint16_t crc;
+
+	tele_length = 1;
+	tele_code = 0;
+	tele_crc = 0xFFFF;
+	tele_put(channel);
+	tele_put(tele_sequence++);
+	tele_put(now);
+	tele_put(now >> 8);
+	for(; count && (room >= 2); count--, room -= 2, values++) {
+		tele_put(*values);
+		tele_put(*values >> 8);
+	}
+	for(; text && *text && room; room--)
+		tele_put(*text++);
+	crc = tele_crc;
+	tele_put(crc);
+	tele_put(crc >> 8);
+	tele_frame[tele_code] = tele_length - tele_code;
+	tele_frame[tele_length++] = 0;
+
+	uart_write(tele_frame, tele_length);
+	tele_frames++;
+}
+
+/* Frames sent so far */
+uint16_t telemetry_frames(void) {
+	return tele_frames;
+}
@@ -0,0 +1,49 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+/*
+	Binary telemetry on the serial port, shared by slave.c, which sends
+	it, and teledecode.c on the host, which turns the stream into CSV
+	(make teledecode, then ./slave_host | ./teledecode > run.csv).
+
+	A frame is the channel, a sequence number that counts every frame
+	sent, the time in TELE_CLOCK_HZ ticks as a little-endian uint16, the
+	channel's values as little-endian int16s and then any text, and a
+	CRC-16 (CCITT as _crc_ccitt_update(), from 0xFFFF) of all that, low
+	byte first. The frame is COBS encoded, so it holds no 0 bytes, and a
+	0 ends it: a reader that joins mid-stream or loses a byte picks up
+	again at the next 0, and the CRC throws out the damaged frame.
+*/
+
+#include <inttypes.h>
+
+#define TELE_CLOCK_HZ 1250 /* The slave's RAMP_HZ */
+#define TELE_HEADER 4 /* Channel, sequence, time */
+#define TELE_PAYLOAD 40 /* Most bytes of values and text in a frame */
+#define TELE_FRAME (TELE_HEADER + TELE_PAYLOAD + 2)
+
+/*
+	Channels: ID, name, most frames a second (0 for no limit), then the
+	names of its values in order. TELE_TEXT is all text; TELE_NUMBER is a
+	value named by the text after it.
+*/
+#define TELE_CHANNELS(X) \
+	X(TELE_TEXT, "text", 0, "") \
+	X(TELE_NUMBER, "number", 0, "value") \
+	X(TELE_WHEELS, "wheels", 25, "left_pwm,right_pwm,left_target,right_target") \
+	X(TELE_SPEED, "speed", 25, "left_count,right_count,left_speed,right_speed,left_target,right_target") \
+	X(TELE_SENSORS, "sensors", 10, "ranger1,ranger2,age_ms,overruns") \
+	X(TELE_LINK, "link", 2, "sequence,faults,frames")
+
+#define TELE_ID(id, name, hz, fields) id,
+enum tele_channel {
+	TELE_CHANNELS(TELE_ID)
+	TELE_CHANNEL_COUNT
+};
+#undef TELE_ID
+
+uint8_t telemetry_due(uint8_t channel, uint16_t now);
+void telemetry_send(uint8_t channel, uint16_t now, const int16_t *values, uint8_t count, const char *text);
+uint16_t telemetry_frames(void);
+
+#endif /* end of include guard: TELEMETRY_H */
@@ -24,12 +24,24 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 //#define ATMEGA8
 
+// Bus timing follows the build's clock
 #ifndef CPU_FREQ
+#ifdef F_CPU
+#define CPU_FREQ F_CPU
+#else
 #define CPU_FREQ 16000000L
 #endif
+#endif
+
+#define TWI_STANDARD 100000L
+#define TWI_FAST 400000L	// needs stronger pull-ups than the internal ones
 
 #ifndef TWI_FREQ
-#define TWI_FREQ 100000L
+#define TWI_FREQ TWI_STANDARD
+#endif
+
+#if ((CPU_FREQ / TWI_FREQ) - 16) / 2 < 10
+#error "TWI_FREQ is too fast for CPU_FREQ, TWBR must be 10 or more"
 #endif
 
 #ifndef TWI_BUFFER_LENGTH
@@ -42,24 +54,75 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #define TWI_SRX   3
 #define TWI_STX   4
 
+#ifndef TWI_QUEUE_LENGTH
+#define TWI_QUEUE_LENGTH 8
+#endif
+
+// Transaction status while queued or on the bus; afterwards it's
+// 0 or one of twi_writeTo()'s error codes
+#define TWI_PENDING 0xFF
+
+// Queue priorities; every urgent transfer goes on the bus before any
+// normal one that's waiting
+#define TWI_NORMAL 0
+#define TWI_URGENT 1
+#define TWI_PRIORITIES 2
+
+// Address for a write that every slave listening to general calls takes
+#define TWI_GENERAL_CALL 0x00
+
+// A queued master transfer. The caller fills in the first seven fields and
+// leaves the transaction and its data alone until status isn't TWI_PENDING.
+struct twi_transaction {
+	uint8_t address;	// 7bit i2c device address
+	uint8_t read;		// 1 to read into data, 0 to write it
+	uint8_t* data;
+	uint8_t length;
+	uint8_t retries;	// attempts after the first on NACK, lost arbitration or bus error
+	uint8_t priority;	// TWI_NORMAL or TWI_URGENT
+	void (*done)(struct twi_transaction*);	// called from the TWI interrupt, or 0
+	uint8_t attempts;
+	uint8_t count;		// bytes transferred
+	volatile uint8_t status;
+};
+
 // Sets up TWI
 void twi_init(void);
 
+// Sets SCL frequency in Hz, for master mode
+void twi_setFrequency(uint32_t frequency);
+
 // Sets slave address
 void twi_setAddress(uint8_t address);
 
+// Answer general calls too, in slave mode
+void twi_setGeneralCall(uint8_t enable);
+
+// Whether the last write received in slave mode was a general call
+uint8_t twi_generalCall(void);
+
 // Master read
 uint8_t twi_readFrom(uint8_t address, uint8_t* data, uint8_t length);
 
 // Master write
 uint8_t twi_writeTo(uint8_t address, uint8_t* data, uint8_t length, uint8_t wait);
 
-// Slave write (for returning a buffer)
-uint8_t twi_transmit(volatile uint8_t* data, volatile uint8_t length);
+// Queue a master transfer, from anywhere including interrupts
+uint8_t twi_enqueue(struct twi_transaction* transaction);
+
+// Transactions queued or on the bus
+uint8_t twi_pending(void);
+
+// SCL clocks master transfers have taken so far, for the bus utilisation
+uint32_t twi_busClocks(void);
+
+// Slave write (for returning a buffer, which is sent from in place)
+uint8_t twi_transmit(const uint8_t* data, uint8_t length);
 
 // Attach slave interrupts
 void twi_attachSlaveRxEvent( void (*)(uint8_t*, int) );
 void twi_attachSlaveTxEvent( void (*)(void) );
+void twi_attachSlaveTxDoneEvent( void (*)(uint8_t) );
 
 // Return ACK/NACK + byte to master
 void twi_reply(uint8_t);
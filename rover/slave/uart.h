@@ -69,6 +69,26 @@ LICENSE:
  */
 #define UART_BAUD_SELECT_DOUBLE_SPEED(baudRate,xtalCpu) (((xtalCpu)/((baudRate)*8l)-1)|0x8000)
 
+/** @brief  UART Baudrate Expression for double speed mode, rounded to the nearest
+ *          divider instead of down, for the high rates where one step is a big error
+ *  @param  xtalcpu  system clock in Mhz, e.g. 20000000L for 20Mhz
+ *  @param  baudrate baudrate in bps, e.g. 9600, 250000
+ */
+#define UART_BAUD_SELECT_NEAREST(baudRate,xtalCpu) ((((xtalCpu)+(baudRate)*4l)/((baudRate)*8l)-1)|0x8000)
+
+/** @brief  Baudrate UART_BAUD_SELECT_NEAREST() actually gives */
+#define UART_BAUD_ACTUAL(baudRate,xtalCpu) ((xtalCpu)/(8l*(((xtalCpu)+(baudRate)*4l)/((baudRate)*8l))))
+
+/** @brief  How far UART_BAUD_ACTUAL() is from baudRate either way, in parts per thousand;
+ *          usable in #if, so a bad choice can stop the build
+ */
+#define UART_BAUD_ERROR(baudRate,xtalCpu) \
+    (((UART_BAUD_ACTUAL(baudRate,xtalCpu) > (baudRate))? \
+    UART_BAUD_ACTUAL(baudRate,xtalCpu) - (baudRate) : (baudRate) - UART_BAUD_ACTUAL(baudRate,xtalCpu)) * 1000l / (baudRate))
+
+/** @brief  Most UART_BAUD_ERROR() to count on the far end taking, 2% */
+#define UART_BAUD_TOLERANCE 20
+
 
 /** Size of the circular receive buffer, must be power of 2 */
 #ifndef UART_RX_BUFFER_SIZE
@@ -154,6 +174,27 @@ extern void uart_putc(unsigned char data);
 extern void uart_puts(const char *s );
 
 
+/**
+ *  @brief   Put a block of bytes to ringbuffer for transmitting via UART
+ *
+ *  Copies as much as fits in one go, in at most two runs either side of
+ *  the wrap, and turns the transmit interrupt on once, not per byte.
+ *  Blocks while the buffer is full, like uart_putc().
+ *
+ *  @param   data bytes to be transmitted, 0 included
+ *  @param   length how many
+ *  @return  none
+ */
+extern void uart_write(const void *data, unsigned int length);
+
+
+/**
+ *  @brief   Bytes uart_putc() or uart_write() can take now without blocking
+ *  @return  free space in the transmit ringbuffer
+ */
+extern unsigned char uart_tx_free(void);
+
+
 /**
  * @brief    Put string from program memory to ringbuffer for transmitting via UART.
  *